@@ -0,0 +1,314 @@
+// Benchmarks of HashMap hot paths against other hash tables.
+// Every benchmark reports throughput in items per second, latency ones
+// also report percentiles of a single operation in nanoseconds.
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "hashtable.cpp"
+
+#ifdef HASHTABLE_BENCHMARK_ABSL
+#include "absl/container/flat_hash_map.h"
+#endif
+#if __has_include("robin_hood.h")
+#include "robin_hood.h"
+#define HASHTABLE_BENCHMARK_ROBIN_HOOD
+#endif
+
+namespace {
+
+// Returns mixed bits of x, so consecutive numbers give random keys.
+uint64_t mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+
+// Makes the key of the given type for the number.
+template<class Key>
+Key make_key(uint64_t x);
+
+template<>
+uint64_t make_key<uint64_t>(uint64_t x) {
+    return x;
+}
+
+// Strings are longer than the small string buffer, so comparing them
+// reads memory out of the table as it does for real string keys.
+template<>
+std::string make_key<std::string>(uint64_t x) {
+    return "hashtable-benchmark-key-" + std::to_string(x);
+}
+
+// Returns count keys made from numbers from first on, which are
+// mixed if random is set.
+template<class Key>
+std::vector<Key> make_keys(size_t count, uint64_t first, bool random) {
+    std::vector<Key> res;
+    res.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        res.push_back(make_key<Key>(random ? mix(first + i) : first + i));
+    }
+    return res;
+}
+
+// Numbers of keys which are never inserted start here.
+constexpr uint64_t missing_keys = uint64_t(1) << 48;
+
+// Collects durations of single operations and reports their percentiles.
+class LatencyRecorder {
+ public:
+    // Adds duration of ops operations timed together.
+    void add(std::chrono::steady_clock::duration time, size_t ops = 1) {
+        samples.push_back(std::chrono::duration<double, std::nano>(
+            time).count() / ops);
+    }
+
+    // Sets p50, p99, p999 and max counters of the state.
+    void report(benchmark::State& state) {
+        if (samples.empty()) {
+            return;
+        }
+        std::sort(samples.begin(), samples.end());
+        state.counters["p50_ns"] = at(0.5);
+        state.counters["p99_ns"] = at(0.99);
+        state.counters["p999_ns"] = at(0.999);
+        state.counters["max_ns"] = samples.back();
+    }
+
+ private:
+    std::vector<double> samples;
+
+    double at(double quantile) const {
+        return samples[size_t(quantile * (samples.size() - 1))];
+    }
+};
+
+// Inserts range(0) keys into an empty table, which grows all the way.
+template<class Map>
+void insert(benchmark::State& state, bool random) {
+    using key_type = typename Map::key_type;
+    auto keys = make_keys<key_type>(state.range(0), 0, random);
+    for (auto _ : state) {
+        Map map;
+        for (const auto& key : keys) {
+            map.emplace(key, 0);
+        }
+        benchmark::DoNotOptimize(map.size());
+    }
+    state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+// Same as insert() into a table reserved for all keys, so the difference
+// is the cost of growing.
+template<class Map>
+void insert_reserved(benchmark::State& state, bool random) {
+    using key_type = typename Map::key_type;
+    auto keys = make_keys<key_type>(state.range(0), 0, random);
+    for (auto _ : state) {
+        Map map;
+        map.reserve(keys.size());
+        for (const auto& key : keys) {
+            map.emplace(key, 0);
+        }
+        benchmark::DoNotOptimize(map.size());
+    }
+    state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+// Times every insert of range(0) random keys into an empty table,
+// so percentiles show the pauses of growing.
+template<class Map>
+void insert_latency(benchmark::State& state) {
+    using key_type = typename Map::key_type;
+    auto keys = make_keys<key_type>(state.range(0), 0, true);
+    LatencyRecorder latency;
+    for (auto _ : state) {
+        Map map;
+        for (const auto& key : keys) {
+            auto start = std::chrono::steady_clock::now();
+            map.emplace(key, 0);
+            latency.add(std::chrono::steady_clock::now() - start);
+        }
+        benchmark::DoNotOptimize(map.size());
+    }
+    state.SetItemsProcessed(state.iterations() * keys.size());
+    latency.report(state);
+}
+
+// Looks up keys in a table of range(0) ones, range(1) percent
+// of lookups find their key.
+template<class Map>
+void lookup(benchmark::State& state, bool random) {
+    using key_type = typename Map::key_type;
+    size_t count = state.range(0);
+    auto keys = make_keys<key_type>(count, 0, random);
+    Map map;
+    for (const auto& key : keys) {
+        map.emplace(key, 0);
+    }
+    auto missing = make_keys<key_type>(count, missing_keys, random);
+    std::vector<key_type> queries;
+    queries.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t pick = mix(i + missing_keys);
+        queries.push_back(pick % 100 < uint64_t(state.range(1))
+            ? keys[(pick >> 8) % count] : missing[i]);
+    }
+    // Batches are timed together, a clock read costs about one lookup.
+    constexpr size_t batch = 32;
+    LatencyRecorder latency;
+    for (auto _ : state) {
+        size_t found = 0;
+        for (size_t i = 0; i < count; i += batch) {
+            size_t last = std::min(count, i + batch);
+            auto start = std::chrono::steady_clock::now();
+            for (size_t j = i; j < last; ++j) {
+                found += map.find(queries[j]) != map.end();
+            }
+            latency.add(std::chrono::steady_clock::now() - start, last - i);
+        }
+        benchmark::DoNotOptimize(found);
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+    latency.report(state);
+}
+
+// Keeps range(0) keys in a table erasing the oldest key and inserting
+// a new one, which leaves deleted elements behind.
+template<class Map>
+void churn(benchmark::State& state) {
+    using key_type = typename Map::key_type;
+    size_t count = state.range(0);
+    auto keys = make_keys<key_type>(2 * count, 0, true);
+    Map map;
+    for (size_t i = 0; i < count; ++i) {
+        map.emplace(keys[i], 0);
+    }
+    size_t oldest = 0;
+    for (auto _ : state) {
+        map.erase(keys[oldest]);
+        map.emplace(keys[(oldest + count) % keys.size()], 0);
+        oldest = (oldest + 1) % keys.size();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// Iterates over a table of range(0) keys after all but range(1) percent
+// of them are erased, so most of the buffer is empty.
+template<class Map>
+void iterate_after_erase(benchmark::State& state) {
+    using key_type = typename Map::key_type;
+    size_t count = state.range(0);
+    auto keys = make_keys<key_type>(count, 0, true);
+    Map map;
+    for (const auto& key : keys) {
+        map.emplace(key, 1);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (mix(i) % 100 >= uint64_t(state.range(1))) {
+            map.erase(keys[i]);
+        }
+    }
+    for (auto _ : state) {
+        uint64_t sum = 0;
+        for (const auto& item : map) {
+            sum += item.second;
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * map.size());
+}
+
+// Fills a table with range(0) keys and erases them all again, so tables
+// that shrink resize in both directions.
+template<class Map>
+void grow_and_shrink(benchmark::State& state) {
+    using key_type = typename Map::key_type;
+    auto keys = make_keys<key_type>(state.range(0), 0, true);
+    Map map;
+    for (auto _ : state) {
+        for (const auto& key : keys) {
+            map.emplace(key, 0);
+        }
+        for (const auto& key : keys) {
+            map.erase(key);
+        }
+        benchmark::DoNotOptimize(map.size());
+    }
+    state.SetItemsProcessed(state.iterations() * 2 * keys.size());
+}
+
+// Registers all benchmarks of the table type under the given name.
+template<class Map>
+void register_map(const std::string& name) {
+    for (bool random : { false, true }) {
+        std::string order = random ? "random/" : "sequential/";
+        benchmark::RegisterBenchmark(
+            ("insert/" + order + name).c_str(), insert<Map>, random)
+            ->RangeMultiplier(16)->Range(1 << 10, 1 << 20);
+        benchmark::RegisterBenchmark(
+            ("insert_reserved/" + order + name).c_str(),
+            insert_reserved<Map>, random)
+            ->RangeMultiplier(16)->Range(1 << 10, 1 << 20);
+        benchmark::RegisterBenchmark(
+            ("lookup/" + order + name).c_str(), lookup<Map>, random)
+            ->ArgNames({ "size", "hit_pct" })
+            ->ArgsProduct({ { 1 << 10, 1 << 16, 1 << 20 }, { 0, 50, 100 } });
+    }
+    benchmark::RegisterBenchmark(
+        ("insert_latency/" + name).c_str(), insert_latency<Map>)
+        ->Arg(1 << 20);
+    benchmark::RegisterBenchmark(("churn/" + name).c_str(), churn<Map>)
+        ->RangeMultiplier(16)->Range(1 << 10, 1 << 20);
+    benchmark::RegisterBenchmark(
+        ("iterate_after_erase/" + name).c_str(), iterate_after_erase<Map>)
+        ->ArgNames({ "size", "kept_pct" })
+        ->ArgsProduct({ { 1 << 16, 1 << 20 }, { 1, 10, 50 } });
+    benchmark::RegisterBenchmark(
+        ("grow_and_shrink/" + name).c_str(), grow_and_shrink<Map>)
+        ->RangeMultiplier(16)->Range(1 << 10, 1 << 20);
+}
+
+// Registers all benchmarks of every table with the given key type.
+template<class Key>
+void register_maps(const std::string& key_name) {
+    using value_type = uint64_t;
+    register_map<HashMap<Key, value_type>>("HashMap<" + key_name + ">");
+    register_map<HashMap<Key, value_type, std::hash<Key>,
+        std::equal_to<Key>, std::allocator<std::pair<const Key, value_type>>,
+        RobinHoodHashMapPolicy>>("HashMap<" + key_name + ">/robin_hood");
+    register_map<HashMap<Key, value_type, std::hash<Key>,
+        std::equal_to<Key>, std::allocator<std::pair<const Key, value_type>>,
+        IncrementalHashMapPolicy>>("HashMap<" + key_name + ">/incremental");
+    register_map<std::unordered_map<Key, value_type>>(
+        "std::unordered_map<" + key_name + ">");
+#ifdef HASHTABLE_BENCHMARK_ABSL
+    register_map<absl::flat_hash_map<Key, value_type>>(
+        "absl::flat_hash_map<" + key_name + ">");
+#endif
+#ifdef HASHTABLE_BENCHMARK_ROBIN_HOOD
+    register_map<robin_hood::unordered_flat_map<Key, value_type>>(
+        "robin_hood::unordered_flat_map<" + key_name + ">");
+#endif
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    register_maps<uint64_t>("int");
+    register_maps<std::string>("string");
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -1,433 +1,7437 @@
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
 #include <functional>
+#include <iterator>
+#include <limits>
+#include <memory>
+#if __cplusplus >= 201703L
+#include <memory_resource>
+#endif
+#include <mutex>
+#include <new>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <thread>
+#if __cplusplus >= 201703L
+#include <shared_mutex>
+#include <string_view>
+#endif
+#include <tuple>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
-// Hash table with open addressing, linear probing and lazy deletion.
-// Using dynamic rehashing with doubling and halving size.
-// https://en.wikipedia.org/wiki/Open_addressing
-template<class KeyType, class ValueType, class Hash = std::hash<KeyType>>
-class HashMap {
- public:
-    // default_size - size of hash table
-    // when first initialized or cleared.
+
+// Storage of one element of a hash table, constructed only
+// when the slot holds an element.
+// mutable_value lets rehashing move keys out of the slot.
+template<class KeyType, class ValueType>
+union MapSlot {
+    std::pair<const KeyType, ValueType> value;
+    std::pair<KeyType, ValueType> mutable_value;
+
+    MapSlot() {}
+    ~MapSlot() {}
+
+    // Copy-constructs the element of other slot here.
+    void copy_construct(const MapSlot& oth) {
+        new (&value) std::pair<const KeyType, ValueType>(oth.value);
+    }
+
+    // Move-constructs the element of other slot here.
+    void move_construct(MapSlot& oth) {
+        new (&mutable_value)
+            std::pair<KeyType, ValueType>(std::move(oth.mutable_value));
+    }
+};
+
+// MapSlot with the hash of its element, see DefaultHashMapPolicy.
+template<class KeyType, class ValueType>
+struct HashedMapSlot {
+    union {
+        std::pair<const KeyType, ValueType> value;
+        std::pair<KeyType, ValueType> mutable_value;
+    };
+    size_t hash;
+
+    HashedMapSlot() {}
+    ~HashedMapSlot() {}
+
+    // Copy-constructs the element of other slot here with its hash.
+    void copy_construct(const HashedMapSlot& oth) {
+        new (&value) std::pair<const KeyType, ValueType>(oth.value);
+        hash = oth.hash;
+    }
+
+    // Move-constructs the element of other slot here with its hash.
+    void move_construct(HashedMapSlot& oth) {
+        new (&mutable_value)
+            std::pair<KeyType, ValueType>(std::move(oth.mutable_value));
+        hash = oth.hash;
+    }
+};
+
+// Hints the processor to load the cache line with the address,
+// does nothing where no such hint is available.
+inline void prefetch_address(const void* address) {
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(address);
+#elif defined(__SSE2__)
+    _mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#else
+    (void)address;
+#endif
+}
+
+// Hash finalizers, applied to the result of Hash before it's turned
+// into a position. Tables take the low bits of the hash, so a weak Hash
+// (std::hash of integers is the identity on libstdc++) needs mixing
+// to keep probe chains short.
+
+// Leaves the hash unchanged.
+struct IdentityHashMixer {
+    size_t operator()(size_t hash) const {
+        return hash;
+    }
+};
+
+// Fibonacci hashing: multiplies by 2^64 / golden ratio and folds
+// the high half of the product into the low one. One multiplication.
+struct FibonacciHashMixer {
+    size_t operator()(size_t hash) const {
+        uint64_t res = uint64_t(hash) * 0x9E3779B97F4A7C15ull;
+        return size_t(res ^ (res >> 32));
+    }
+};
+
+// Finalizer of MurmurHash3, every input bit affects every output bit.
+// https://github.com/aappleby/smhasher/wiki/MurmurHash3
+struct MurmurHashMixer {
+    size_t operator()(size_t hash) const {
+        uint64_t res = uint64_t(hash);
+        res ^= res >> 33;
+        res *= 0xFF51AFD7ED558CCDull;
+        res ^= res >> 33;
+        res *= 0xC4CEB9FE1A85EC53ull;
+        res ^= res >> 33;
+        return size_t(res);
+    }
+};
+
+// Compile-time options of HashMap.
+// Derive from it and redefine members to change them.
+struct DefaultHashMapPolicy {
+    // Finalizer applied to every hash before it's masked to a position.
+    using mixer = IdentityHashMixer;
+    // Size of a table when first initialized or cleared.
     constexpr static size_t default_size = 8;
-    constexpr static size_t decreasing_size = 2;
+    // Table grows increasing_size times when non-empty positions (live
+    // and deleted elements) would exceed max_load of its size, and
+    // shrinks decreasing_size times when live elements are fewer than
+    // min_load of it. The gap between them keeps a table that oscillates
+    // around either threshold from being rebuilt on every operation.
+    // Sizes are powers of two, since positions are taken by masking.
+    // Loads are numerator / denominator ratios, so the table computes
+    // its thresholds once per resize and compares integers on insert.
     constexpr static size_t increasing_size = 2;
+    constexpr static size_t decreasing_size = 2;
+    constexpr static size_t max_load_numerator = 3;
+    constexpr static size_t max_load_denominator = 4;
+    constexpr static size_t min_load_numerator = 3;
+    constexpr static size_t min_load_denominator = 16;
+    // Deleted elements are purged when they are at least
+    // allowed_deleted_elements - 1 times as many as live ones.
     constexpr static size_t allowed_deleted_elements = 2;
-    constexpr static double overload_size = 0.75;
+    // If true erase() moves the following elements of the cluster back
+    // instead of leaving a deleted mark, so the table never holds deleted
+    // elements and never has to be rebuilt because of them.
+    // Elements are moved in the table, so their moves mustn't throw.
+    constexpr static bool backward_shift_erase = false;
+    // If false erase() never shrinks the table, only rehash() does.
+    constexpr static bool auto_shrink = true;
+    // Number of slots of the old buffer moved to the new one by every
+    // modifying operation while the table grows, lookups check both buffers
+    // until all are moved. If 0 growing moves all elements at once.
+    constexpr static size_t incremental_rehash_step = 0;
+    // Number of threads moving elements when a table of at least
+    // parallel_rehash_size elements is rebuilt, 0 means one per hardware
+    // thread. Only elements that can't throw while moved are moved
+    // in parallel.
+    constexpr static size_t rehash_threads = 1;
+    constexpr static size_t parallel_rehash_size = size_t(1) << 20;
+    // If true every slot keeps the hash of its element: rebuilding never
+    // calls the hash function and probing compares keys only when their
+    // hashes are equal, at the cost of 8 more bytes per slot.
+    constexpr static bool store_hash = false;
+    // If true elements are kept in robin hood order: an insert takes the
+    // position of the first element that is closer to its home position
+    // than the new one would be and shifts the rest of the cluster
+    // forward, so probe lengths of all elements stay close to each other
+    // and a lookup of a missing key stops at the first element closer
+    // to its home. Distances are taken from the stored hashes, so
+    // store_hash and backward_shift_erase must be set as well.
+    // https://en.wikipedia.org/wiki/Hash_table#Robin_Hood_hashing
+    constexpr static bool robin_hood = false;
+    // If true the table counts probe lengths and resizes, see HashMapStats.
+    // Lookups of a const table update the counters too, so such a table
+    // can't be read by several threads at once, and ConcurrentHashMap and
+    // ReadMostlyHashMap don't take such a policy.
+    constexpr static bool collect_stats = false;
+};
 
-    // Iterator allows to iterate over elements in table and work with them.
-    class iterator {
-     public:
-        // Default constructor.
-        iterator() : pos(0), ptr(nullptr), check(nullptr),
-            is_empty(nullptr) {}
+// Policy for hash functions with weak low bits.
+struct MixedHashMapPolicy : DefaultHashMapPolicy {
+    using mixer = FibonacciHashMixer;
+};
 
-        
-        // Constructor with the given position.
-        iterator(size_t pos_,
-            std::vector<std::pair<KeyType, ValueType>>& ar,
-            std::vector<bool>& used_, std::vector<bool>& is_empty_) :
-            pos(pos_),
-            ptr(reinterpret_cast<std::vector<std::pair<const KeyType, ValueType>>*>(&ar)),
-            check(&used_),
-            is_empty(&is_empty_) {
-            go();
+// Policy for tables with many erases mixed with inserts.
+struct BackwardShiftHashMapPolicy : DefaultHashMapPolicy {
+    constexpr static bool backward_shift_erase = true;
+};
+
+// Policy for tables where a single insert or erase mustn't take O(size) time:
+// grows incrementally, never needs purging of deleted elements and never
+// shrinks automatically. Only explicit rehash() and reserve() rebuild it.
+struct IncrementalHashMapPolicy : DefaultHashMapPolicy {
+    constexpr static bool backward_shift_erase = true;
+    constexpr static bool auto_shrink = false;
+    constexpr static size_t incremental_rehash_step = 16;
+};
+
+// Policy for tables where the slowest lookups matter: keeps probe
+// lengths even and stops lookups of missing keys early.
+struct RobinHoodHashMapPolicy : DefaultHashMapPolicy {
+    constexpr static bool backward_shift_erase = true;
+    constexpr static bool store_hash = true;
+    constexpr static bool robin_hood = true;
+};
+
+// Policy for memory-tight tables: robin hood order keeps probes short
+// at a higher load.
+struct CompactHashMapPolicy : RobinHoodHashMapPolicy {
+    constexpr static size_t max_load_numerator = 9;
+    constexpr static size_t max_load_denominator = 10;
+};
+
+// Policy for keys that are expensive to hash or compare, e.g. long strings.
+struct HashedHashMapPolicy : DefaultHashMapPolicy {
+    constexpr static bool store_hash = true;
+};
+
+// Policy for huge tables: rebuilds them with all hardware threads.
+struct ParallelHashMapPolicy : DefaultHashMapPolicy {
+    constexpr static size_t rehash_threads = 0;
+};
+
+// Policy for tables whose probe lengths and resizes are monitored.
+struct InstrumentedHashMapPolicy : DefaultHashMapPolicy {
+    constexpr static bool collect_stats = true;
+};
+
+// Type of a key argument of lookup functions: K if both hash function and
+// key comparator are transparent (define is_transparent), so lookup by
+// e.g. std::string_view in a table with std::string keys doesn't build
+// a temporary key, otherwise KeyType.
+template<bool transparent>
+struct HashMapKeyArg {
+    template<class K, class KeyType>
+    using type = KeyType;
+};
+
+template<>
+struct HashMapKeyArg<true> {
+    template<class K, class KeyType>
+    using type = K;
+};
+
+// Value is true if T defines is_transparent.
+template<class T, class = void>
+struct IsTransparent : std::false_type {};
+
+template<class T>
+struct IsTransparent<T, typename std::conditional<true, void,
+    typename T::is_transparent>::type> : std::true_type {};
+
+#if __cplusplus >= 201703L
+// Transparent hash function for std::string keys,
+// use it with std::equal_to<> for lookup by std::string_view and C strings.
+struct TransparentStringHash {
+    using is_transparent = void;
+
+    size_t operator()(std::string_view str) const {
+        return std::hash<std::string_view>()(str);
+    }
+};
+#endif
+
+// Memory arena for tables that are freed together, e.g. per request ones.
+// Blocks are cut from large chunks and rounded up to a power of two;
+// a freed block is kept for the next request of the same size, so growing
+// and shrinking tables reuse the buffers they released. All memory
+// is returned at once by release() or the destructor. Not thread-safe.
+class HashMapArena {
+ public:
+    // default_chunk_size - bytes taken from operator new at once.
+    constexpr static size_t default_chunk_size = 64 * 1024;
+
+    explicit HashMapArena(size_t chunk_size_ = default_chunk_size) :
+        chunk_size(chunk_size_), chunks(nullptr), pos(nullptr), left(0) {
+        std::fill(free_blocks, free_blocks + size_classes, nullptr);
+    }
+
+    HashMapArena(const HashMapArena&) = delete;
+    HashMapArena& operator=(const HashMapArena&) = delete;
+
+    ~HashMapArena() {
+        release();
+    }
+
+    // Returns a block of at least the given size aligned
+    // for any scalar type in O(1) amortized.
+    void* allocate(size_t bytes) {
+        size_t size_class = size_class_of(bytes);
+        if (free_blocks[size_class] != nullptr) {
+            free_block* res = free_blocks[size_class];
+            free_blocks[size_class] = res->next;
+            return res;
         }
-        // Pre-increment iterator in O(1) amortized.
-        iterator operator++() {
-            ++pos;
-            go();
-            return (*this);
+        size_t size = block_size(size_class);
+        if (left < size) {
+            add_chunk(size);
+        }
+        void* res = pos;
+        pos += size;
+        left -= size;
+        return res;
+    }
+
+    // Keeps a block of the given size for reuse in O(1).
+    void deallocate(void* block, size_t bytes) {
+        size_t size_class = size_class_of(bytes);
+        free_blocks[size_class] =
+            new (block) free_block{free_blocks[size_class]};
+    }
+
+    // Frees all memory of the arena, blocks given out become invalid.
+    void release() {
+        while (chunks != nullptr) {
+            chunk_header* next = chunks->next;
+            ::operator delete(chunks);
+            chunks = next;
         }
+        pos = nullptr;
+        left = 0;
+        std::fill(free_blocks, free_blocks + size_classes, nullptr);
+    }
 
-        // Post-increment iterator in O(1) amortized.
-        iterator operator++(int) {
-            iterator res = *this;
-            ++pos;
-            go();
-            return res;
+ private:
+    struct free_block {
+        free_block* next;
+    };
+
+    struct alignas(std::max_align_t) chunk_header {
+        chunk_header* next;
+    };
+
+    // Blocks are multiples of min_block_size, so they are all aligned.
+    constexpr static size_t min_block_size = alignof(std::max_align_t);
+    constexpr static size_t size_classes = std::numeric_limits<size_t>::digits;
+    static_assert(min_block_size >= sizeof(free_block),
+        "freed block has to hold a pointer");
+
+    size_t chunk_size;
+    chunk_header* chunks;
+    char* pos;
+    // left - bytes left in the current chunk after pos.
+    size_t left;
+    // free_blocks - lists of freed blocks of every size class.
+    free_block* free_blocks[size_classes];
+
+    // Returns the smallest size class holding the given size in O(log size).
+    static size_t size_class_of(size_t bytes) {
+        size_t res = 0;
+        while (block_size(res) < bytes) {
+            ++res;
+        }
+        return res;
+    }
+
+    // Returns size of blocks of the class in O(1).
+    static size_t block_size(size_t size_class) {
+        return min_block_size << size_class;
+    }
+
+    // Takes a new chunk holding at least the given size from operator new.
+    void add_chunk(size_t size) {
+        size_t bytes = sizeof(chunk_header) + std::max(chunk_size, size);
+        chunk_header* chunk =
+            new (::operator new(bytes)) chunk_header{chunks};
+        chunks = chunk;
+        pos = reinterpret_cast<char*>(chunk + 1);
+        left = bytes - sizeof(chunk_header);
+    }
+};
+
+// Allocator taking memory from a HashMapArena, copies share the arena.
+// Lets tables be built in an arena: HashMap<K, V, Hash, KeyEqual,
+// ArenaAllocator<std::pair<const K, V>>> map(Hash(), KeyEqual(), arena).
+template<class T>
+class ArenaAllocator {
+    static_assert(alignof(T) <= alignof(std::max_align_t),
+        "arena doesn't support over-aligned types");
+
+ public:
+    using value_type = T;
+
+    ArenaAllocator(HashMapArena& arena_) : arena(&arena_) {}
+
+    template<class U>
+    ArenaAllocator(const ArenaAllocator<U>& oth) : arena(oth.arena) {}
+
+    // Returns storage for n objects in O(1) amortized.
+    T* allocate(size_t n) {
+        if (n > std::numeric_limits<size_t>::max() / sizeof(T)) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(arena->allocate(n * sizeof(T)));
+    }
+
+    // Returns storage for n objects to the arena in O(1).
+    void deallocate(T* ptr, size_t n) {
+        arena->deallocate(ptr, n * sizeof(T));
+    }
+
+    template<class U>
+    bool operator==(const ArenaAllocator<U>& oth) const {
+        return arena == oth.arena;
+    }
+
+    template<class U>
+    bool operator!=(const ArenaAllocator<U>& oth) const {
+        return arena != oth.arena;
+    }
+
+ private:
+    template<class U>
+    friend class ArenaAllocator;
+
+    HashMapArena* arena;
+};
+
+// Bit array of slots kept in 64-bit words, so scans skip 64 clear bits
+// at once.
+template<class Allocator>
+class HashMapBitmap {
+    using words_type = std::vector<uint64_t, typename std::allocator_traits<
+        Allocator>::template rebind_alloc<uint64_t>>;
+
+ public:
+    explicit HashMapBitmap(const Allocator& alloc) : words(alloc) {}
+
+    // Makes count clear bits in O(count / 64).
+    void assign(size_t count) {
+        words.assign((count + 63) / 64, 0);
+    }
+
+    // Frees memory of the bits.
+    void release() {
+        words_type(words.get_allocator()).swap(words);
+    }
+
+    bool test(size_t pos) const {
+        return (words[pos / 64] >> (pos % 64)) & 1;
+    }
+
+    void set(size_t pos) {
+        words[pos / 64] |= uint64_t(1) << (pos % 64);
+    }
+
+    void reset(size_t pos) {
+        words[pos / 64] &= ~(uint64_t(1) << (pos % 64));
+    }
+
+    // Hints the processor to load the word of the position.
+    void prefetch(size_t pos) const {
+        prefetch_address(&words[pos / 64]);
+    }
+
+    // Returns the first set position from pos on or count if there is none
+    // in O(1 + distance / 64). Bits from count on must be clear.
+    size_t next(size_t pos, size_t count) const {
+        if (pos >= count) {
+            return count;
+        }
+        size_t index = pos / 64;
+        uint64_t word = words[index] & (~uint64_t(0) << (pos % 64));
+        while (word == 0) {
+            if (++index == words.size()) {
+                return count;
+            }
+            word = words[index];
+        }
+        return index * 64 + size_t(__builtin_ctzll(word));
+    }
+
+    // Swaps bits of two bitmaps in O(1).
+    void swap(HashMapBitmap& oth) {
+        words.swap(oth.words);
+    }
+
+    // Replaces allocator of an empty bitmap.
+    void set_allocator(const Allocator& alloc) {
+        words = words_type(alloc);
+    }
+
+ private:
+    words_type words;
+};
+
+// Slots of HashMap and their states: empty, deleted or live.
+// Both layouts have the same interface. Storage doesn't own memory:
+// table passes the allocator and the number of slots, so the storage
+// of a table and the one of its buffer being migrated cost nothing
+// when unused.
+
+// Keeps states in two bitmaps beside the slots: live and deleted ones.
+// Takes 2 bits per slot, but probing reads three places.
+template<class Slot, class Allocator>
+class HashMapFlagStorage {
+    using slot_traits = std::allocator_traits<Allocator>;
+
+ public:
+    explicit HashMapFlagStorage(const Allocator& alloc) :
+        slots(nullptr), live(alloc), deleted(alloc) {}
+
+    // Takes memory for count empty slots in O(count). Bitmaps are
+    // allocated first, so if taking memory for slots throws nothing
+    // is left to free but what the storage owns.
+    void allocate(Allocator& alloc, size_t count) {
+        live.assign(count);
+        deleted.assign(count);
+        slots = slot_traits::allocate(alloc, count);
+    }
+
+    // Frees memory of count slots, elements must be destroyed.
+    void deallocate(Allocator& alloc, size_t count) {
+        if (slots != nullptr) {
+            slot_traits::deallocate(alloc, slots, count);
+            slots = nullptr;
+        }
+        live.release();
+        deleted.release();
+    }
+
+    // Makes count slots empty keeping their memory in O(count / 64),
+    // elements must be destroyed.
+    void clear(size_t count) {
+        live.assign(count);
+        deleted.assign(count);
+    }
+
+    bool is_empty(size_t pos) const {
+        return !live.test(pos) && !deleted.test(pos);
+    }
+
+    bool is_deleted(size_t pos) const {
+        return deleted.test(pos);
+    }
+
+    bool is_live(size_t pos) const {
+        return live.test(pos);
+    }
+
+    void set_empty(size_t pos) {
+        live.reset(pos);
+        deleted.reset(pos);
+    }
+
+    void set_deleted(size_t pos) {
+        live.reset(pos);
+        deleted.set(pos);
+    }
+
+    void set_live(size_t pos) {
+        live.set(pos);
+        deleted.reset(pos);
+    }
+
+    // Returns the first live position from pos on
+    // or count if there is none, see HashMapBitmap::next.
+    size_t next_live(size_t pos, size_t count) const {
+        return live.next(pos, count);
+    }
+
+    // Hints the processor to load everything probing the position reads:
+    // the slot and the words of both bitmaps.
+    void prefetch(size_t pos) const {
+        prefetch_address(&slots[pos]);
+        live.prefetch(pos);
+        deleted.prefetch(pos);
+    }
+
+    Slot& slot(size_t pos) {
+        return slots[pos];
+    }
+
+    const Slot& slot(size_t pos) const {
+        return slots[pos];
+    }
+
+    // Copies states and elements of other storage of count slots into
+    // this allocated one in O(count) with memcpy. Elements must be
+    // trivially copyable.
+    void copy_from(const HashMapFlagStorage& oth, size_t count,
+        std::true_type) {
+        std::memcpy(static_cast<void*>(slots), oth.slots,
+            count * sizeof(Slot));
+        live = oth.live;
+        deleted = oth.deleted;
+    }
+
+    // Copies states and elements of other storage of count slots into
+    // this allocated one in O(count) with copy constructor. If it throws
+    // only elements copied before are live.
+    void copy_from(const HashMapFlagStorage& oth, size_t count,
+        std::false_type) {
+        deleted = oth.deleted;
+        for (size_t i = oth.next_live(0, count); i < count;
+            i = oth.next_live(i + 1, count)) {
+            slots[i].copy_construct(oth.slots[i]);
+            live.set(i);
+        }
+    }
+
+    // Swaps slots of two storages in O(1).
+    void swap(HashMapFlagStorage& oth) {
+        std::swap(slots, oth.slots);
+        live.swap(oth.live);
+        deleted.swap(oth.deleted);
+    }
+
+    // Replaces allocator of an empty storage.
+    void set_allocator(const Allocator& alloc) {
+        live.set_allocator(alloc);
+        deleted.set_allocator(alloc);
+    }
+
+ private:
+    Slot* slots;
+    HashMapBitmap<Allocator> live, deleted;
+};
+
+// Keeps the state of every slot in a byte array beside the slots, so
+// a probe scans the states of 64 slots in a cache line and reads a slot
+// only when its state is live, and slots take just the size of their
+// elements. A bitmap of live slots is kept for iteration.
+template<class Slot, class Allocator>
+class HashMapByteStorage {
+    using slot_traits = std::allocator_traits<Allocator>;
+    using states_type = std::vector<unsigned char,
+        typename slot_traits::template rebind_alloc<unsigned char>>;
+
+    constexpr static unsigned char state_empty = 0;
+    constexpr static unsigned char state_deleted = 1;
+    constexpr static unsigned char state_live = 2;
+
+ public:
+    explicit HashMapByteStorage(const Allocator& alloc) :
+        slots(nullptr), states(alloc), live(alloc) {}
+
+    // Takes memory for count empty slots in O(count). States are
+    // allocated first, so if taking memory for slots throws nothing
+    // is left to free but what the storage owns.
+    void allocate(Allocator& alloc, size_t count) {
+        states.assign(count, state_empty);
+        live.assign(count);
+        slots = slot_traits::allocate(alloc, count);
+    }
+
+    // Frees memory of count slots, elements must be destroyed.
+    void deallocate(Allocator& alloc, size_t count) {
+        if (slots != nullptr) {
+            slot_traits::deallocate(alloc, slots, count);
+            slots = nullptr;
+        }
+        states_type(states.get_allocator()).swap(states);
+        live.release();
+    }
+
+    // Makes count slots empty keeping their memory in O(count),
+    // elements must be destroyed.
+    void clear(size_t count) {
+        states.assign(count, state_empty);
+        live.assign(count);
+    }
+
+    bool is_empty(size_t pos) const {
+        return states[pos] == state_empty;
+    }
+
+    bool is_deleted(size_t pos) const {
+        return states[pos] == state_deleted;
+    }
+
+    bool is_live(size_t pos) const {
+        return states[pos] == state_live;
+    }
+
+    void set_empty(size_t pos) {
+        states[pos] = state_empty;
+        live.reset(pos);
+    }
+
+    void set_deleted(size_t pos) {
+        states[pos] = state_deleted;
+        live.reset(pos);
+    }
+
+    void set_live(size_t pos) {
+        states[pos] = state_live;
+        live.set(pos);
+    }
+
+    // Returns the first live position from pos on
+    // or count if there is none, see HashMapBitmap::next.
+    size_t next_live(size_t pos, size_t count) const {
+        return live.next(pos, count);
+    }
+
+    // Hints the processor to load the state and the slot of the position.
+    void prefetch(size_t pos) const {
+        prefetch_address(&states[pos]);
+        prefetch_address(&slots[pos]);
+    }
+
+    Slot& slot(size_t pos) {
+        return slots[pos];
+    }
+
+    const Slot& slot(size_t pos) const {
+        return slots[pos];
+    }
+
+    // Copies states and elements of other storage of count slots into
+    // this allocated one in O(count) with memcpy. Elements must be
+    // trivially copyable.
+    void copy_from(const HashMapByteStorage& oth, size_t count,
+        std::true_type) {
+        std::memcpy(static_cast<void*>(slots), oth.slots,
+            count * sizeof(Slot));
+        states = oth.states;
+        live = oth.live;
+    }
+
+    // Copies states and elements of other storage of count slots into
+    // this allocated one in O(count) with copy constructor. If it throws
+    // only elements copied before are live.
+    void copy_from(const HashMapByteStorage& oth, size_t count,
+        std::false_type) {
+        for (size_t i = 0; i < count; ++i) {
+            if (oth.is_live(i)) {
+                slots[i].copy_construct(oth.slots[i]);
+                set_live(i);
+            } else {
+                states[i] = oth.states[i];
+            }
+        }
+    }
+
+    // Swaps slots of two storages in O(1).
+    void swap(HashMapByteStorage& oth) {
+        std::swap(slots, oth.slots);
+        states.swap(oth.states);
+        live.swap(oth.live);
+    }
+
+    // Replaces allocator of an empty storage.
+    void set_allocator(const Allocator& alloc) {
+        states = states_type(alloc);
+        live.set_allocator(alloc);
+    }
+
+ private:
+    Slot* slots;
+    states_type states;
+    HashMapBitmap<Allocator> live;
+};
+
+// Chooses byte states for small trivially copyable elements: probing
+// then scans one byte per slot instead of two bitmaps, so it reads two
+// places instead of three. Larger elements keep the 2 bits per slot
+// of bitmaps. Specialize it to choose the layout of other types.
+template<class KeyType, class ValueType>
+struct HashMapByteStates : std::integral_constant<bool,
+    std::is_trivially_copyable<KeyType>::value &&
+    std::is_trivially_copyable<ValueType>::value &&
+    sizeof(std::pair<KeyType, ValueType>) <= 16> {};
+
+// Element taken out of a table by extract(). Owns the pair, whose key
+// may be changed before the node is inserted into another table.
+template<class KeyType, class ValueType>
+class HashMapNode {
+ public:
+    using key_type = KeyType;
+    using mapped_type = ValueType;
+
+    // Default constructor of an empty node.
+    HashMapNode() : has_value(false) {}
+
+    // Constructor taking the given pair.
+    explicit HashMapNode(std::pair<KeyType, ValueType>&& item) :
+        has_value(true) {
+        new (&slot.mutable_value) std::pair<KeyType, ValueType>(
+            std::move(item));
+    }
+
+    // Move constructor, leaves other node empty.
+    HashMapNode(HashMapNode&& oth) : has_value(false) {
+        (*this) = std::move(oth);
+    }
+
+    // Takes the pair of other node, leaves other node empty.
+    HashMapNode& operator=(HashMapNode&& oth) {
+        if (&oth != this) {
+            reset();
+            if (oth.has_value) {
+                new (&slot.mutable_value) std::pair<KeyType, ValueType>(
+                    std::move(oth.slot.mutable_value));
+                has_value = true;
+                oth.reset();
+            }
+        }
+        return (*this);
+    }
+
+    ~HashMapNode() {
+        reset();
+    }
+
+    // Returns true if there is no pair in the node in O(1).
+    bool empty() const {
+        return !has_value;
+    }
+
+    explicit operator bool() const {
+        return has_value;
+    }
+
+    // Returns reference to the key of the pair in O(1).
+    KeyType& key() {
+        return slot.mutable_value.first;
+    }
+
+    // Returns reference to the value of the pair in O(1).
+    ValueType& mapped() {
+        return slot.mutable_value.second;
+    }
+
+    // Returns reference to the pair to move it out in O(1).
+    std::pair<KeyType, ValueType>& value() {
+        return slot.mutable_value;
+    }
+
+    // Destroys the pair in O(1).
+    void reset() {
+        if (has_value) {
+            slot.mutable_value.~pair();
+            has_value = false;
+        }
+    }
+
+ private:
+    MapSlot<KeyType, ValueType> slot;
+    bool has_value;
+};
+
+// Header of a snapshot of HashMap written by HashMap::save() and read
+// by MappedHashMap. It's followed by the pairs of all positions, zeroed
+// where there is no element, padded to 8 bytes, then by bitmaps of live
+// and of non-empty positions in 64-bit words.
+// Numbers are stored as they are in memory, so a snapshot is read only
+// on machines with the same byte order and type layouts.
+struct HashMapSnapshotHeader {
+    // "HMSNAP01" read as a little-endian number.
+    constexpr static uint64_t signature = 0x3130504153534d48;
+    // Slots start here, so they are aligned in a mapped file.
+    constexpr static size_t slots_offset = 64;
+
+    uint64_t magic;
+    uint64_t key_size;
+    uint64_t value_size;
+    uint64_t slot_size;
+    uint64_t buffer_size;
+    uint64_t size;
+    uint64_t reserved[2];
+
+    // Returns true if the whole snapshot fits in size_t, so its offsets
+    // and size can be computed without overflowing. A slot takes
+    // slot_size bytes and less than a byte of the bitmaps.
+    bool fits() const {
+        constexpr uint64_t max = std::numeric_limits<size_t>::max();
+        return slot_size < max && buffer_size <=
+            (max - slots_offset - 8 - 2 * 8) / (slot_size + 1);
+    }
+
+    // Returns offset of the live bitmap in the snapshot.
+    size_t live_offset() const {
+        return slots_offset + (size_t(buffer_size * slot_size) + 7) / 8 * 8;
+    }
+
+    // Returns number of words of each bitmap.
+    size_t bitmap_words() const {
+        return size_t(buffer_size + 63) / 64;
+    }
+
+    // Returns size of the whole snapshot in bytes.
+    size_t file_size() const {
+        return live_offset() + 2 * 8 * bitmap_words();
+    }
+};
+
+// Counters of a HashMap, collected if Policy::collect_stats is set;
+// HashMap::stats() returns them with the current state of the table.
+// A probe length is the number of slots a lookup or an insert reads in
+// the current buffer: hit_probes[k] and miss_probes[k] count the ones that
+// found and didn't find their key with lengths from 2^k to 2^(k+1) - 1,
+// the last ones count all longer probes. Resizes are counted with the time
+// spent in them: an incremental one only starts then, its moves are done
+// by later operations.
+struct HashMapStats {
+    constexpr static size_t histogram_size = 16;
+
+    size_t size;
+    size_t bucket_count;
+    size_t deleted_elements;
+    double load_factor;
+    size_t hit_probes[histogram_size];
+    size_t miss_probes[histogram_size];
+    size_t hit_probes_sum;
+    size_t miss_probes_sum;
+    // increases, decreases - number of increase_size() and decrease_size()
+    // calls, purges - number of rebuilds dropping deleted elements.
+    size_t increases;
+    size_t decreases;
+    size_t purges;
+    uint64_t resize_nanoseconds;
+
+    // Default constructor, all counters are zero.
+    HashMapStats() : size(0), bucket_count(0), deleted_elements(0),
+        load_factor(0), hit_probes(), miss_probes(), hit_probes_sum(0),
+        miss_probes_sum(0), increases(0), decreases(0), purges(0),
+        resize_nanoseconds(0) {}
+
+    // Counts a probe of the given length that found its key in O(1).
+    void record_hit(size_t probes) {
+        ++hit_probes[histogram_index(probes)];
+        hit_probes_sum += probes;
+    }
+
+    // Counts a probe of the given length that didn't find its key in O(1).
+    void record_miss(size_t probes) {
+        ++miss_probes[histogram_index(probes)];
+        miss_probes_sum += probes;
+    }
+
+    // Counts a resize in the given counter and adds the time from its
+    // construction to its destruction.
+    class resize_timer {
+     public:
+        resize_timer(HashMapStats& stats_, size_t HashMapStats::*counter) :
+            stats(stats_), start(std::chrono::steady_clock::now()) {
+            ++(stats.*counter);
+        }
+
+        resize_timer(const resize_timer&) = delete;
+        resize_timer& operator=(const resize_timer&) = delete;
+
+        ~resize_timer() {
+            stats.resize_nanoseconds += uint64_t(std::chrono::duration_cast<
+                std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+                start).count());
+        }
+
+     private:
+        HashMapStats& stats;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    // Writes all counters in the Prometheus text format, one per line,
+    // with names starting with the prefix. Histograms are cumulative,
+    // bucket le="n" counts probes of at most n slots.
+    void write(std::ostream& out, const char* prefix = "hashmap") const {
+        out << prefix << "_size " << size << '\n';
+        out << prefix << "_bucket_count " << bucket_count << '\n';
+        out << prefix << "_deleted_elements " << deleted_elements << '\n';
+        out << prefix << "_load_factor " << load_factor << '\n';
+        write_histogram(out, prefix, "_hit_probes", hit_probes,
+            hit_probes_sum);
+        write_histogram(out, prefix, "_miss_probes", miss_probes,
+            miss_probes_sum);
+        out << prefix << "_increases_total " << increases << '\n';
+        out << prefix << "_decreases_total " << decreases << '\n';
+        out << prefix << "_purges_total " << purges << '\n';
+        out << prefix << "_resize_seconds_total " <<
+            double(resize_nanoseconds) / 1e9 << '\n';
+    }
+
+ private:
+    // Returns histogram index of the probe length in O(1).
+    static size_t histogram_index(size_t probes) {
+        size_t res = 63 - size_t(__builtin_clzll(uint64_t(probes) | 1));
+        return res < histogram_size ? res : histogram_size - 1;
+    }
+
+    static void write_histogram(std::ostream& out, const char* prefix,
+        const char* name, const size_t* counts, size_t sum) {
+        size_t total = 0;
+        for (size_t i = 0; i + 1 < histogram_size; ++i) {
+            total += counts[i];
+            out << prefix << name << "_bucket{le=\"" <<
+                ((size_t(2) << i) - 1) << "\"} " << total << '\n';
+        }
+        total += counts[histogram_size - 1];
+        out << prefix << name << "_bucket{le=\"+Inf\"} " << total << '\n';
+        out << prefix << name << "_sum " << sum << '\n';
+        out << prefix << name << "_count " << total << '\n';
+    }
+};
+
+// Counters of a HashMap that doesn't collect stats, all of them do nothing.
+struct HashMapNoStats {
+    void record_hit(size_t) {}
+
+    void record_miss(size_t) {}
+
+    class resize_timer {
+     public:
+        resize_timer(HashMapNoStats&, size_t HashMapStats::*) {}
+    };
+};
+
+// Hash table with open addressing, linear probing and lazy deletion
+// (or backward shift deletion, see DefaultHashMapPolicy).
+// Using dynamic rehashing with doubling and halving size
+// and in-place rebuilding when there are too many deleted elements.
+// Size is always a power of two, so positions are taken by masking.
+// Slots are raw storage, so elements are constructed on insert
+// and destroyed on erase and empty slots cost no constructor calls.
+// States of slots are kept in bit arrays or bytes, see HashMapByteStates.
+// https://en.wikipedia.org/wiki/Open_addressing
+template<class KeyType, class ValueType, class Hash = std::hash<KeyType>,
+    class KeyEqual = std::equal_to<KeyType>,
+    class Allocator = std::allocator<std::pair<const KeyType, ValueType>>,
+    class Policy = DefaultHashMapPolicy>
+class HashMap {
+    using hash_stored = std::integral_constant<bool, Policy::store_hash>;
+    using slot_type = typename std::conditional<Policy::store_hash,
+        HashedMapSlot<KeyType, ValueType>, MapSlot<KeyType, ValueType>>::type;
+    using slot_allocator = typename std::allocator_traits<Allocator>::
+        template rebind_alloc<slot_type>;
+    using slot_traits = std::allocator_traits<slot_allocator>;
+    using storage_type = typename std::conditional<
+        HashMapByteStates<KeyType, ValueType>::value,
+        HashMapByteStorage<slot_type, slot_allocator>,
+        HashMapFlagStorage<slot_type, slot_allocator>>::type;
+    using trivially_copyable = std::integral_constant<bool,
+        std::is_trivially_copyable<KeyType>::value &&
+        std::is_trivially_copyable<ValueType>::value>;
+    template<class K>
+    using key_arg = typename HashMapKeyArg<IsTransparent<Hash>::value &&
+        IsTransparent<KeyEqual>::value>::template type<K, KeyType>;
+    using stats_type = typename std::conditional<Policy::collect_stats,
+        HashMapStats, HashMapNoStats>::type;
+    // move_elements - whether rebuilding moves elements instead of copying
+    // them: if their moves are noexcept or they can't be copied.
+    // nothrow_rebuild - whether rebuilding can't throw once the new buffer
+    // is allocated: elements are moved with noexcept moves and hashes are
+    // stored or computed by a noexcept hash function.
+    using move_elements = std::integral_constant<bool,
+        std::is_nothrow_move_constructible<
+        std::pair<KeyType, ValueType>>::value ||
+        !std::is_copy_constructible<std::pair<KeyType, ValueType>>::value>;
+    using nothrow_rebuild = std::integral_constant<bool,
+        std::is_nothrow_move_constructible<
+        std::pair<KeyType, ValueType>>::value && (Policy::store_hash ||
+        noexcept(std::declval<const Hash&>()(std::declval<const KeyType&>())))>;
+
+    static_assert(!Policy::robin_hood ||
+        (Policy::store_hash && Policy::backward_shift_erase),
+        "robin hood order needs stored hashes and backward shift erase");
+    // A move that throws halfway through a shift would leave a hole
+    // in a cluster or a live slot without an element.
+    static_assert(!Policy::backward_shift_erase ||
+        std::is_nothrow_move_constructible<
+        std::pair<KeyType, ValueType>>::value,
+        "shifting elements needs moves of elements that don't throw");
+    static_assert(Policy::default_size >= 2 &&
+        (Policy::default_size & (Policy::default_size - 1)) == 0 &&
+        Policy::increasing_size >= 2 &&
+        (Policy::increasing_size & (Policy::increasing_size - 1)) == 0 &&
+        Policy::decreasing_size >= 2 &&
+        (Policy::decreasing_size & (Policy::decreasing_size - 1)) == 0,
+        "table sizes must be powers of two");
+    static_assert(Policy::max_load_numerator > 0 &&
+        Policy::max_load_numerator < Policy::max_load_denominator,
+        "a table must always have an empty position");
+    static_assert(Policy::min_load_numerator * Policy::decreasing_size *
+        Policy::max_load_denominator < Policy::max_load_numerator *
+        Policy::min_load_denominator,
+        "a shrunk table mustn't be overloaded");
+
+ public:
+    using node_type = HashMapNode<KeyType, ValueType>;
+    using key_type = KeyType;
+    using mapped_type = ValueType;
+    using value_type = std::pair<const KeyType, ValueType>;
+    using size_type = size_t;
+    using difference_type = std::ptrdiff_t;
+    using reference = value_type&;
+    using const_reference = const value_type&;
+    using allocator_type = Allocator;
+
+    // Sizes and loads of the policy, see DefaultHashMapPolicy.
+    constexpr static size_t default_size = Policy::default_size;
+    constexpr static size_t decreasing_size = Policy::decreasing_size;
+    constexpr static size_t increasing_size = Policy::increasing_size;
+    constexpr static size_t allowed_deleted_elements =
+        Policy::allowed_deleted_elements;
+    constexpr static double overload_size =
+        double(Policy::max_load_numerator) / Policy::max_load_denominator;
+    constexpr static double underload_size =
+        double(Policy::min_load_numerator) / Policy::min_load_denominator;
+    // batch_size - number of keys the batched operations hash and
+    // prefetch before probing them, so that their cache misses overlap.
+    constexpr static size_t batch_size = 16;
+    // region_size - smallest number of positions filled by one thread of
+    // a parallel build or rehash. A multiple of 64, so threads never write
+    // the same word of a bitmap.
+    constexpr static size_t region_size = 1024;
+
+    class const_iterator;
+
+    // Iterator allows to iterate over elements in table and work with them.
+    // Positions from buffer_size on are in the buffer being migrated.
+    class iterator {
+     public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::pair<const KeyType, ValueType>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = value_type*;
+        using reference = value_type&;
+
+        // Default constructor.
+        iterator() : pos(0), table(nullptr) {}
+
+        // Constructor with the given position.
+        iterator(size_t pos_, HashMap* table_) :
+            pos(pos_), table(table_) {
+            go();
+        }
+
+        // Pre-increment iterator in O(1) amortized.
+        iterator& operator++() {
+            ++pos;
+            go();
+            return (*this);
+        }
+
+        // Post-increment iterator in O(1) amortized.
+        iterator operator++(int) {
+            iterator res = *this;
+            ++pos;
+            go();
+            return res;
+        }
+
+        // Return true if iterators are the same in O(1).
+        bool operator==(const iterator& oth) const {
+            return pos == oth.pos && table == oth.table;
+        }
+
+        // Return true if iterators are different in O(1).
+        bool operator!=(const iterator& oth) const {
+            return !((*this) == oth);
+        }
+
+        // Returns item reference in O(1) time.
+        pointer operator->() const {
+            return &table->slot_at(pos).value;
+        }
+
+        // Returns item reference in O(1) time.
+        reference operator*() const {
+            return table->slot_at(pos).value;
+        }
+
+     private:
+        friend class const_iterator;
+
+        size_t pos;
+        HashMap* table;
+
+        // Finds the next element in O(1) amortized,
+        // skipping 64 empty positions at once.
+        void go() {
+            pos = table->next_live(pos);
+        }
+    };
+
+    // Const iterator allows to iterate over the elements in table and get
+    // their values but doesn't allow to change them.
+    class const_iterator {
+     public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::pair<const KeyType, ValueType>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const value_type*;
+        using reference = const value_type&;
+
+        // Default constructor.
+        const_iterator() : pos(0), table(nullptr) {}
+
+        // Constructor with the given position.
+        const_iterator(size_t pos_, const HashMap* table_) :
+            pos(pos_), table(table_) {
+            go();
+        }
+
+        // Converts iterator to const_iterator in O(1).
+        const_iterator(const iterator& oth) : pos(oth.pos), table(oth.table) {}
+
+        // Pre-increment iterator in O(1) amortized.
+        const_iterator& operator++() {
+            ++pos;
+            go();
+            return (*this);
+        }
+
+        // Post-increment iterator in O(1) amortized.
+        const_iterator operator++(int) {
+            const_iterator res = *this;
+            ++pos;
+            go();
+            return res;
+        }
+
+        // Return true if iterators are the same in O(1).
+        bool operator==(const const_iterator& oth) const {
+            return pos == oth.pos && table == oth.table;
+        }
+
+        // Return true if iterators are different in O(1).
+        bool operator!=(const const_iterator& oth) const {
+            return !((*this) == oth);
+        }
+
+        // Returns constant item reference in O(1) time.
+        pointer operator->() const {
+            return &table->slot_at(pos).value;
+        }
+
+        // Returns constant item reference in O(1) time.
+        reference operator*() const {
+            return table->slot_at(pos).value;
+        }
+
+     private:
+        size_t pos;
+        const HashMap* table;
+
+        // Finds the next element in O(1) amortized,
+        // skipping 64 empty positions at once.
+        void go() {
+            pos = table->next_live(pos);
+        }
+    };
+
+    // Default constructor with given hash function, key comparator
+    // and allocator.
+    HashMap(Hash hasher_ = Hash(), KeyEqual key_equal_ = KeyEqual(),
+        const Allocator& alloc_ = Allocator()) :
+        hasher(hasher_), key_equal(key_equal_), alloc(alloc_), buf(alloc),
+        old_buf(alloc) {
+        init();
+    }
+
+    // Constructor with given allocator.
+    explicit HashMap(const Allocator& alloc_) :
+        HashMap(Hash(), KeyEqual(), alloc_) {}
+
+    // Constructor for a table with at least the given number of buckets
+    // with given hash function, key comparator and allocator.
+    explicit HashMap(size_t bucket_count_, Hash hasher_ = Hash(),
+        KeyEqual key_equal_ = KeyEqual(),
+        const Allocator& alloc_ = Allocator()) :
+        HashMap(hasher_, key_equal_, alloc_) {
+        rehash(bucket_count_);
+    }
+
+    // Constructor for initializer list with given hash function,
+    // key comparator and allocator.
+    HashMap(std::initializer_list<std::pair<KeyType, ValueType>> list,
+        Hash hasher_ = Hash(), KeyEqual key_equal_ = KeyEqual(),
+        const Allocator& alloc_ = Allocator()) :
+        HashMap(list.begin(), list.end(), hasher_, key_equal_, alloc_) {}
+
+    // Copy constructor, allocator is chosen
+    // by select_on_container_copy_construction.
+    HashMap(const HashMap& oth) : HashMap(oth,
+        Allocator(slot_traits::select_on_container_copy_construction(
+            oth.alloc))) {}
+
+    // Copy constructor with given allocator.
+    // Buffers are copied as they are, see copy_buffers.
+    HashMap(const HashMap& oth, const Allocator& alloc_) :
+        hasher(oth.hasher), key_equal(oth.key_equal), alloc(alloc_),
+        buf(alloc), old_buf(alloc) {
+        try {
+            copy_buffers(oth);
+        } catch (...) {
+            destroy();
+            throw;
+        }
+    }
+
+    // Move constructor, takes buffers and allocator of other table
+    // and leaves it empty without buffers in O(1), see take().
+    // Nothing is allocated, so it doesn't throw unless copying
+    // the hash function or the key comparator does.
+    HashMap(HashMap&& oth) noexcept(
+        std::is_nothrow_copy_constructible<Hash>::value &&
+        std::is_nothrow_copy_constructible<KeyEqual>::value) :
+        hasher(oth.hasher), key_equal(oth.key_equal), alloc(oth.alloc),
+        buf(alloc), old_buf(alloc) {
+        take(oth);
+    }
+
+    // Constructor for given begin and end iterator.
+    // Reserves space for all elements at once for forward iterators.
+    template<typename It>
+    HashMap(It begin, It end, Hash hasher_ = Hash(),
+        KeyEqual key_equal_ = KeyEqual(),
+        const Allocator& alloc_ = Allocator()) :
+        HashMap(hasher_, key_equal_, alloc_) {
+        reserve_for(begin, end,
+            typename std::iterator_traits<It>::iterator_category());
+        while (begin != end) {
+            insert(*begin);
+            ++begin;
+        }
+    }
+
+    // Copies other hash table, allocator is copied
+    // if propagate_on_container_copy_assignment is set.
+    // Elements are copied before this table is changed,
+    // so if copying throws it's left as it was.
+    HashMap& operator=(const HashMap &oth) {
+        if (&oth != this) {
+            HashMap copy(oth, Allocator(
+                slot_traits::propagate_on_container_copy_assignment::value ?
+                oth.alloc : alloc));
+            hasher = oth.hasher;
+            key_equal = oth.key_equal;
+            destroy();
+            propagate_allocator(copy.alloc, std::integral_constant<bool,
+                slot_traits::propagate_on_container_copy_assignment::value>());
+            take(copy);
+        }
+        return (*this);
+    }
+
+    // Takes buffers of other hash table, leaves other table empty.
+    // If allocators aren't equal and propagate_on_container_move_assignment
+    // isn't set, elements are moved one by one in O(size) time instead.
+    // Doesn't throw if the allocator propagates and copying the hash
+    // function and the key comparator doesn't.
+    HashMap& operator=(HashMap&& oth) noexcept(
+        slot_traits::propagate_on_container_move_assignment::value &&
+        std::is_nothrow_copy_assignable<Hash>::value &&
+        std::is_nothrow_copy_assignable<KeyEqual>::value) {
+        if (&oth != this) {
+            hasher = oth.hasher;
+            key_equal = oth.key_equal;
+            destroy();
+            propagate_allocator(oth.alloc, std::integral_constant<bool,
+                slot_traits::propagate_on_container_move_assignment::value>());
+            if (alloc == oth.alloc) {
+                take(oth);
+            } else {
+                init();
+                for (size_t i = 0; i < oth.end_position(); ++i) {
+                    if (oth.is_live(i)) {
+                        insert(std::move(oth.slot_at(i).mutable_value));
+                    }
+                }
+                oth.clear();
+            }
+        }
+        return (*this);
+    }
+
+    ~HashMap() {
+        destroy();
+    }
+
+    // Swaps contents of two tables in O(1). Allocators are swapped
+    // if propagate_on_container_swap is set, otherwise they must be equal.
+    void swap(HashMap& oth) {
+        std::swap(hasher, oth.hasher);
+        std::swap(key_equal, oth.key_equal);
+        swap_allocator(oth, std::integral_constant<bool,
+            slot_traits::propagate_on_container_swap::value>());
+        std::swap(sz, oth.sz);
+        std::swap(buffer_size, oth.buffer_size);
+        std::swap(size_all_non_nullptr, oth.size_all_non_nullptr);
+        std::swap(max_non_empty, oth.max_non_empty);
+        std::swap(min_live, oth.min_live);
+        buf.swap(oth.buf);
+        std::swap(old_sz, oth.old_sz);
+        std::swap(old_buffer_size, oth.old_buffer_size);
+        std::swap(migrate_pos, oth.migrate_pos);
+        old_buf.swap(oth.old_buf);
+        std::swap(counters, oth.counters);
+    }
+
+    // Deletes all elements in table in O(size + buffer_size / 64)
+    // keeping its buffer, so refilling it to the same size doesn't
+    // rebuild it. The buffer being migrated is freed.
+    void clear() {
+        for (size_t i = next_live(0); i < end_position();
+            i = next_live(i + 1)) {
+            slot_at(i).value.~pair();
+        }
+        if (old_buffer_size != 0) {
+            old_buf.deallocate(alloc, old_buffer_size);
+            old_buffer_size = 0;
+        }
+        buf.clear(buffer_size);
+        sz = 0;
+        size_all_non_nullptr = 0;
+        old_sz = 0;
+        migrate_pos = 0;
+    }
+
+    // Rebuilds the table with the smallest size that holds all elements
+    // without growing in O(size) time, if it's larger than that.
+    // Drops all deleted elements then.
+    void shrink_to_fit() {
+        size_t new_buffer_size = buffer_size_for(sz);
+        if (new_buffer_size < buffer_size) {
+            rebuild(new_buffer_size);
+        }
+    }
+
+    // Rebuilds the table if one more element would overload it:
+    // purges deleted elements if there are too many of them,
+    // otherwise calls increase_size().
+    // Returns true if the table was rebuilt.
+    // Elements of the buffer being migrated count as non-empty positions,
+    // the table is overloaded only after they are all moved.
+    bool check_density() {
+        if (size_all_non_nullptr + old_sz < max_non_empty) {
+            return false;
+        }
+        complete_migration();
+        if (!check_deleted_elements()) {
+            increase_size();
+        }
+        return true;
+    }
+
+    // Rebuilds the table keeping its size if deleted elements are at least
+    // allowed_deleted_elements - 1 times as many as live ones.
+    // Returns true if the table was rebuilt.
+    bool check_deleted_elements() {
+        size_t live = sz - old_sz;
+        if (size_all_non_nullptr > live &&
+            size_all_non_nullptr >= allowed_deleted_elements * live) {
+            typename stats_type::resize_timer timer(counters,
+                &HashMapStats::purges);
+            rebuild(buffer_size);
+            return true;
+        }
+        return false;
+    }
+
+    // Calls decrease_size() method of a table if it's underloaded
+    // and automatic shrinking is on. Never shrinks a growing table.
+    // Returns true if the table was rebuilt.
+    bool check_underload() {
+        if (Policy::auto_shrink && old_buffer_size == 0 &&
+            buffer_size > default_size && sz < min_live) {
+            decrease_size();
+            return true;
+        }
+        return false;
+    }
+
+    // Adds a new pair of key and value to the table in O(1) amortized.
+    // Does nothing if key already exists.
+    // Returns iterator to the element with the key
+    // and true if the pair was inserted.
+    std::pair<iterator, bool> insert(
+        const std::pair<KeyType, ValueType>& item) {
+        auto res = prepare_insert(item.first);
+        if (res.second) {
+            construct(res.first, item);
+        }
+        return { iterator(res.first, this), res.second };
+    }
+
+    // Adds a new pair of key and value to the table in O(1) amortized
+    // moving it into the table.
+    // Does nothing if key already exists.
+    std::pair<iterator, bool> insert(std::pair<KeyType, ValueType>&& item) {
+        auto res = prepare_insert(item.first);
+        if (res.second) {
+            construct(res.first, std::move(item));
+        }
+        return { iterator(res.first, this), res.second };
+    }
+
+    // Constructs a pair from the arguments and moves it
+    // into the table in O(1) amortized.
+    // Does nothing if key already exists.
+    template<class... Args>
+    std::pair<iterator, bool> emplace(Args&&... args) {
+        return insert(
+            std::pair<KeyType, ValueType>(std::forward<Args>(args)...));
+    }
+
+    // Adds a value constructed from the arguments with the given key
+    // in O(1) amortized.
+    // Does nothing and doesn't touch the arguments if key already exists.
+    template<class K, class... Args>
+    std::pair<iterator, bool> try_emplace(K&& key, Args&&... args) {
+        auto res = prepare_insert(
+            static_cast<const key_arg<typename std::decay<K>::type>&>(key));
+        if (res.second) {
+            construct(res.first, std::piecewise_construct,
+                std::forward_as_tuple(std::forward<K>(key)),
+                std::forward_as_tuple(std::forward<Args>(args)...));
+        }
+        return { iterator(res.first, this), res.second };
+    }
+
+    // Adds a new pair or assigns the value
+    // if key already exists in O(1) amortized.
+    // Returns iterator to the element and true if the pair was inserted.
+    template<class K, class M>
+    std::pair<iterator, bool> insert_or_assign(K&& key, M&& obj) {
+        auto res = prepare_insert(
+            static_cast<const key_arg<typename std::decay<K>::type>&>(key));
+        if (res.second) {
+            construct(res.first, std::forward<K>(key), std::forward<M>(obj));
+        } else {
+            buf.slot(res.first).value.second = std::forward<M>(obj);
+        }
+        return { iterator(res.first, this), res.second };
+    }
+
+    // Delete an element with the given key in O(1) amortized.
+    // Does nothing if key doesn't exist in table.
+    // Returns number of deleted elements.
+    template<class K = KeyType>
+    size_t erase(const key_arg<K>& key) {
+        migrate();
+        size_t pos = find_position(key);
+        if (pos == end_position()) {
+            return 0;
+        }
+        erase_position(pos);
+        return 1;
+    }
+
+    // Takes the element with the given key out of the table
+    // in O(1) amortized moving it into a node.
+    // Returns empty node if key doesn't exist in table.
+    template<class K = KeyType>
+    node_type extract(const key_arg<K>& key) {
+        migrate();
+        size_t pos = find_position(key);
+        if (pos == end_position()) {
+            return node_type();
+        }
+        node_type res(std::move(slot_at(pos).mutable_value));
+        erase_position(pos);
+        return res;
+    }
+
+    // Moves the pair of the node into the table in O(1) amortized
+    // and leaves the node empty.
+    // Does nothing if the node is empty or key already exists.
+    // Returns iterator to the element with the key
+    // and true if the pair was inserted.
+    std::pair<iterator, bool> insert(node_type&& node) {
+        if (node.empty()) {
+            return { end(), false };
+        }
+        auto res = prepare_insert(node.key());
+        if (res.second) {
+            construct(res.first, std::move(node.value()));
+            node.reset();
+        }
+        return { iterator(res.first, this), res.second };
+    }
+
+    // Moves elements of other table whose keys don't exist in this one
+    // here in O(size of other table) amortized, erasing them from other
+    // table. Space is reserved at once, and keys are not looked up
+    // when this table is empty, since keys of other table are unique.
+    void merge(HashMap& source) {
+        if (&source == this) {
+            return;
+        }
+        bool look_up = sz != 0;
+        reserve(sz + source.sz);
+        size_t moved = 0;
+        for (size_t i = source.next_live(0); i < source.end_position();
+            i = source.next_live(i + 1)) {
+            auto& item = source.slot_at(i).mutable_value;
+            size_t pos;
+            if (look_up) {
+                auto res = prepare_insert(item.first);
+                if (!res.second) {
+                    continue;
+                }
+                pos = res.first;
+            } else {
+                check_density();
+                pos = claim_position(hash_of(item.first));
+                ++sz;
+            }
+            construct(pos, std::move(item));
+            source.release(i);
+            ++moved;
+        }
+        // Positions are only marked deleted while iterating, so elements
+        // left in other table are rebuilt once.
+        if (source.sz == 0) {
+            source.clear();
+        } else if (moved != 0) {
+            source.rebuild(source.buffer_size);
+        }
+    }
+
+    // Same as merge(HashMap&) for a temporary table.
+    void merge(HashMap&& source) {
+        merge(source);
+    }
+
+    // Writes the table to the stream as a snapshot that MappedHashMap
+    // serves without rebuilding it, in O(buffer_size) time.
+    // Positions of elements are kept, so the reading process must use
+    // the same hash function and policy mixer.
+    // Throws std::runtime_error if the stream fails.
+    void save(std::ostream& out) const {
+        static_assert(std::is_trivially_copyable<KeyType>::value &&
+            std::is_trivially_copyable<ValueType>::value,
+            "only tables of trivially copyable types can be saved");
+        if (old_buffer_size != 0) {
+            HashMap copy(*this);
+            copy.complete_migration();
+            copy.write_snapshot(out);
+        } else if (buffer_size == 0) {
+            // Snapshots always have a buffer.
+            HashMap(hasher, key_equal, Allocator(alloc)).write_snapshot(out);
+        } else {
+            write_snapshot(out);
+        }
+        if (!out) {
+            throw std::runtime_error("can't write snapshot");
+        }
+    }
+
+    // Adds the elements of a snapshot written by save() from the stream
+    // in O(buffer size of the snapshot), keys that already exist are
+    // skipped. Elements are inserted by their keys, so the writing table
+    // may have had another size, hash function or policy.
+    // Throws std::runtime_error if the stream fails or doesn't hold
+    // a snapshot of pairs of these types.
+    void load(std::istream& in) {
+        using pair_type = std::pair<KeyType, ValueType>;
+        static_assert(std::is_trivially_copyable<KeyType>::value &&
+            std::is_trivially_copyable<ValueType>::value,
+            "only tables of trivially copyable types can be loaded");
+        HashMapSnapshotHeader header;
+        in.read(reinterpret_cast<char*>(&header), sizeof(header));
+        if (!in || header.magic != HashMapSnapshotHeader::signature ||
+            header.key_size != sizeof(KeyType) ||
+            header.value_size != sizeof(ValueType) ||
+            header.slot_size != sizeof(pair_type) ||
+            header.size > header.buffer_size || !header.fits() ||
+            header.buffer_size >
+            std::numeric_limits<size_t>::max() / 2 / sizeof(pair_type)) {
+            throw std::runtime_error("not a snapshot of this table");
+        }
+        std::vector<char> pairs(header.live_offset() -
+            HashMapSnapshotHeader::slots_offset);
+        in.read(pairs.data(), std::streamsize(pairs.size()));
+        std::vector<uint64_t> live(header.bitmap_words());
+        in.read(reinterpret_cast<char*>(live.data()),
+            std::streamsize(live.size() * 8));
+        // The bitmap of non-empty positions is needed only to probe.
+        in.ignore(std::streamsize(live.size() * 8));
+        if (!in) {
+            throw std::runtime_error("can't read snapshot");
+        }
+        reserve(sz + size_t(header.size));
+        MapSlot<KeyType, ValueType> item;
+        for (size_t i = 0; i < size_t(header.buffer_size); ++i) {
+            if ((live[i / 64] >> (i % 64)) & 1) {
+                std::memcpy(static_cast<void*>(&item.mutable_value),
+                    &pairs[i * sizeof(pair_type)], sizeof(pair_type));
+                insert(item.mutable_value);
+            }
+        }
+    }
+
+    // Returns amount of elements in table in O(1).
+    size_t size() const {
+        return sz;
+    }
+
+    // Returns true if there are no elements in table in O(1).
+    bool empty() const {
+        return sz == 0;
+    }
+
+    // Returns hash function of table in O(1).
+    Hash hash_function() const {
+        return hasher;
+    }
+
+    // Returns key comparator of table in O(1).
+    KeyEqual key_eq() const {
+        return key_equal;
+    }
+
+    // Returns allocator of table in O(1).
+    Allocator get_allocator() const {
+        return Allocator(alloc);
+    }
+
+    // Returns current size of hash table in O(1).
+    size_t bucket_count() const {
+        return buffer_size;
+    }
+
+    // Returns average number of elements per bucket in O(1).
+    float load_factor() const {
+        return buffer_size == 0 ? 0.0f : float(sz) / float(buffer_size);
+    }
+
+    // Returns load factor the table grows at in O(1).
+    float max_load_factor() const {
+        return float(overload_size);
+    }
+
+    // Returns counters of the table in O(1), only the current size,
+    // number of buckets and of deleted elements and load factor are set
+    // if the policy doesn't collect stats.
+    HashMapStats stats() const {
+        HashMapStats res = collected_stats(
+            std::integral_constant<bool, Policy::collect_stats>());
+        res.size = sz;
+        res.bucket_count = buffer_size;
+        res.deleted_elements = size_all_non_nullptr - (sz - old_sz);
+        res.load_factor = load_factor();
+        return res;
+    }
+
+    // Sets all collected counters to zero in O(1).
+    void reset_stats() {
+        counters = stats_type();
+    }
+
+    // Makes the table hold count elements without growing, rebuilds it
+    // in O(size) time if it's not large enough yet.
+    void reserve(size_t count) {
+        size_t new_buffer_size = buffer_size_for(count);
+        if (new_buffer_size > buffer_size) {
+            rebuild(new_buffer_size);
+        }
+    }
+
+    // Rebuilds the table with at least count buckets and enough of them
+    // to hold all elements in O(size) time. Drops all deleted elements.
+    void rehash(size_t count) {
+        size_t new_buffer_size = default_size;
+        while (new_buffer_size < count) {
+            new_buffer_size *= increasing_size;
+        }
+        rebuild(std::max(new_buffer_size, buffer_size_for(sz)));
+    }
+
+    // Returns reference to an object with the given key
+    // in O(1) amortized time.
+    // If key doesn't exist adds a new pair and
+    // retuns reference to it.
+    // Key is converted to KeyType only if it has to be inserted.
+    template<class K = KeyType>
+    ValueType& operator[](const key_arg<K>& key) {
+        return find_or_insert(key);
+    }
+
+    // Same as operator[] above, moves the key into the table
+    // if it doesn't exist.
+    template<class K = KeyType>
+    ValueType& operator[](key_arg<K>&& key) {
+        return find_or_insert(std::forward<key_arg<K>>(key));
+    }
+
+    // Returns reference to an object with the given key
+    // in O(1) amortized time.
+    // If key doesn't exist throws an exception.
+    template<class K = KeyType>
+    const ValueType& at(const key_arg<K>& key) const {
+        size_t pos = find_position(key);
+        if (pos == end_position()) {
+            throw std::out_of_range("out of range");
+        }
+        return slot_at(pos).value.second;
+    }
+
+    // Returns iterator to the first element in O(1) amortized.
+    iterator begin() {
+        return iterator(0, this);
+    }
+
+    // Returns iterator to the end of the table in O(1).
+    iterator end() {
+        return iterator(end_position(), this);
+    }
+
+    // Returns const_iterator to the first element in O(1) amortized.
+    const_iterator begin() const {
+        return const_iterator(0, this);
+    }
+
+    // Returns const_iterator to the end of the table in O(1).
+    const_iterator end() const {
+        return const_iterator(end_position(), this);
+    }
+
+    // Returns iterator to the pair with the given key
+    // or end() if key doesn't exist in O(1) amortized.
+    template<class K = KeyType>
+    iterator find(const key_arg<K>& key) {
+        return iterator(find_position(key), this);
+    }
+
+    // Returns const_iterator to the pair with the given key
+    // or end() if key doesn't exist in O(1) amortized.
+    template<class K = KeyType>
+    const_iterator find(const key_arg<K>& key) const {
+        return const_iterator(find_position(key), this);
+    }
+
+    // Writes iterator to the pair for every key in range of forward
+    // iterators, or end() if it doesn't exist, in O(1) amortized per key.
+    // Keys are hashed and their positions prefetched batch_size at a time
+    // before probing, which hides memory latency on large tables.
+    template<class ForwardIt, class OutputIt>
+    OutputIt find_batch(ForwardIt first, ForwardIt last, OutputIt out) {
+        return find_batch_positions(first, last, out,
+            [this](size_t pos) { return iterator(pos, this); });
+    }
+
+    // Same as find_batch above writing const_iterator.
+    template<class ForwardIt, class OutputIt>
+    OutputIt find_batch(ForwardIt first, ForwardIt last, OutputIt out) const {
+        return find_batch_positions(first, last, out,
+            [this](size_t pos) { return const_iterator(pos, this); });
+    }
+
+    // Adds pairs from range of forward iterators in O(1) amortized
+    // per pair, keys that already exist are skipped.
+    // Keys are hashed and their positions prefetched batch_size at a time
+    // before inserting, which hides memory latency on large tables.
+    // Returns number of inserted pairs.
+    template<class ForwardIt>
+    size_t insert_batch(ForwardIt first, ForwardIt last) {
+        reserve_for(first, last,
+            typename std::iterator_traits<ForwardIt>::iterator_category());
+        size_t hashes[batch_size];
+        size_t res = 0;
+        while (first != last) {
+            ForwardIt batch_first = first;
+            size_t count = prefetch_batch(first, last, hashes,
+                [](const std::pair<KeyType, ValueType>& item)
+                    -> const KeyType& { return item.first; });
+            for (size_t i = 0; i < count; ++i, ++batch_first) {
+                auto pos = prepare_insert(batch_first->first, hashes[i]);
+                if (pos.second) {
+                    construct(pos.first, *batch_first);
+                    ++res;
+                }
+            }
+        }
+        return res;
+    }
+
+    // Adds pairs from range of random access iterators with the given
+    // number of threads, 0 means one per hardware thread, in
+    // O(count / threads) amortized, keys that already exist are skipped.
+    // Space is reserved at once and the table is split into regions by
+    // high bits of home positions, each thread puts the pairs of its
+    // regions there. Pairs whose probe sequences leave their region are
+    // inserted by the calling thread afterwards, as are pairs of a table
+    // smaller than two regions.
+    // Returns number of inserted pairs.
+    template<class RandomIt>
+    size_t build_parallel(RandomIt first, RandomIt last, size_t threads) {
+        threads = threads_for(threads);
+        // Robin hood inserts shift elements of other regions.
+        if (threads == 1 || Policy::robin_hood) {
+            return insert_batch(first, last);
+        }
+        size_t count = size_t(last - first);
+        complete_migration();
+        size_t new_buffer_size = buffer_size_for(sz + count);
+        // Regions are probed without deleted elements, so they are dropped.
+        if (new_buffer_size > buffer_size || size_all_non_nullptr > sz) {
+            rebuild(std::max(new_buffer_size, buffer_size));
+        }
+        return place_parallel(count, threads, false,
+            [](size_t i) { return i; },
+            [this, &first](size_t i) { return hash_of(first[i].first); },
+            [&first](size_t i) -> const KeyType& {
+                return first[i].first;
+            },
+            [this, &first](size_t pos, size_t i) {
+                new (&buf.slot(pos).mutable_value)
+                    std::pair<KeyType, ValueType>(first[i]);
+            },
+            [this, &first](size_t i, size_t hash) {
+                auto pos = prepare_insert(first[i].first, hash);
+                if (pos.second) {
+                    construct(pos.first, first[i]);
+                }
+                return pos.second;
+            });
+    }
+
+ private:
+    Hash hasher;
+    KeyEqual key_equal;
+    // alloc - allocator of all buffers.
+    slot_allocator alloc;
+    // buffer_size - size of current state of hash table.
+    size_t sz, buffer_size, size_all_non_nullptr;
+    // Limits for the current size, see update_limits().
+    size_t max_non_empty, min_live;
+    storage_type buf;
+    // Buffer being migrated by incremental rehashing, see
+    // DefaultHashMapPolicy. old_buffer_size is 0 if there is none.
+    // old_sz - number of live elements left in it.
+    // migrate_pos - position of the next slot to move.
+    size_t old_sz, old_buffer_size, migrate_pos;
+    storage_type old_buf;
+    // Probe and resize counters if the policy collects them.
+    mutable stats_type counters;
+
+    // Returns position of the pair with the given key
+    // or end_position() if key doesn't exist in O(1) amortized.
+    template<class K>
+    size_t find_position(const K& key) const {
+        return find_position(key, hash_of(key));
+    }
+
+    // Same as find_position(key) for the given hash_of(key).
+    template<class K>
+    size_t find_position(const K& key, size_t key_hash) const {
+        size_t hash = key_hash & (buffer_size - 1);
+        size_t i = 0;
+        // The size is checked first, a table without buffers has nothing
+        // to probe.
+        while (i < buffer_size && !buf.is_empty(hash)) {
+            if (Policy::robin_hood && distance(hash) < i) {
+                break;
+            }
+            if (buf.is_live(hash) && may_hold(buf.slot(hash), key_hash) &&
+                key_equal(buf.slot(hash).value.first, key)) {
+                counters.record_hit(i + 1);
+                return hash;
+            }
+            hash = (hash + 1) & (buffer_size - 1);
+            ++i;
+        }
+        counters.record_miss(i + 1);
+        if (old_buffer_size != 0) {
+            size_t old_pos = find_old_position(key, key_hash);
+            if (old_pos != old_buffer_size) {
+                return buffer_size + old_pos;
+            }
+        }
+        return end_position();
+    }
+
+    // Returns position of the key in the buffer being migrated
+    // or old_buffer_size if it's not there in O(1) amortized.
+    template<class K>
+    size_t find_old_position(const K& key, size_t key_hash) const {
+        size_t hash = key_hash & (old_buffer_size - 1);
+        size_t i = 0;
+        while (!old_buf.is_empty(hash) && i < old_buffer_size) {
+            if (old_buf.is_live(hash) &&
+                may_hold(old_buf.slot(hash), key_hash) &&
+                key_equal(old_buf.slot(hash).value.first, key)) {
+                return hash;
+            }
+            hash = (hash + 1) & (old_buffer_size - 1);
+            ++i;
+        }
+        return old_buffer_size;
+    }
+
+    // Returns position past the last one of both buffers in O(1).
+    size_t end_position() const {
+        return buffer_size + old_buffer_size;
+    }
+
+    // Destroys the element in the position, which is in the current buffer
+    // or in the buffer being migrated, and frees the position in O(1)
+    // amortized.
+    void erase_position(size_t pos) {
+        if (pos >= buffer_size) {
+            // Positions of the buffer being migrated are only marked
+            // deleted, so that migration doesn't miss moved elements.
+            release(pos);
+            return;
+        }
+        if (Policy::backward_shift_erase) {
+            slot_at(pos).value.~pair();
+            --sz;
+            backward_shift(pos);
+        } else {
+            release(pos);
+        }
+        check_underload();
+    }
+
+    // Destroys the element in the position and marks the position
+    // deleted in O(1), nothing is moved.
+    void release(size_t pos) {
+        slot_at(pos).value.~pair();
+        --sz;
+        if (pos >= buffer_size) {
+            old_buf.set_deleted(pos - buffer_size);
+            --old_sz;
+        } else {
+            buf.set_deleted(pos);
+        }
+    }
+
+    // Returns the first position of an element from pos on
+    // or end_position() in O(1 + distance / 64).
+    size_t next_live(size_t pos) const {
+        if (pos < buffer_size) {
+            pos = buf.next_live(pos, buffer_size);
+            if (pos < buffer_size || old_buffer_size == 0) {
+                return pos;
+            }
+        }
+        return buffer_size +
+            old_buf.next_live(pos - buffer_size, old_buffer_size);
+    }
+
+    // Returns true if there is an element in the position in O(1).
+    bool is_live(size_t pos) const {
+        if (pos < buffer_size) {
+            return buf.is_live(pos);
+        }
+        return old_buf.is_live(pos - buffer_size);
+    }
+
+    // Returns slot in the position in O(1).
+    slot_type& slot_at(size_t pos) {
+        return pos < buffer_size ? buf.slot(pos)
+            : old_buf.slot(pos - buffer_size);
+    }
+
+    // Returns slot in the position in O(1).
+    const slot_type& slot_at(size_t pos) const {
+        return pos < buffer_size ? buf.slot(pos)
+            : old_buf.slot(pos - buffer_size);
+    }
+
+    // Finds a position for an element with the given key in O(1) amortized.
+    // Returns the position and false if key already exists. Otherwise
+    // marks the position as occupied and returns it and true,
+    // caller has to put the element there.
+    // Probes the table once: the first deleted position seen on the way
+    // is remembered and reused if key doesn't exist.
+    // A key found in the buffer being migrated is moved to the new one.
+    template<class K>
+    std::pair<size_t, bool> prepare_insert(const K& key) {
+        return prepare_insert(key, hash_of(key));
+    }
+
+    // Same as prepare_insert(key) for the given hash_of(key).
+    template<class K>
+    std::pair<size_t, bool> prepare_insert(const K& key, size_t key_hash) {
+        migrate();
+        // A moved-from table gets its buffer on the first insert.
+        if (buffer_size == 0) {
+            rebuild(default_size);
+        }
+        size_t hash = key_hash & (buffer_size - 1);
+        size_t i = 0;
+        // found == true if we want to insert an element to a position
+        // where we have a deleted element.
+        bool found = false;
+        size_t first_deleted = 0;
+        while (!buf.is_empty(hash) && i < buffer_size) {
+            // The key would be before an element closer to its home.
+            if (Policy::robin_hood && distance(hash) < i) {
+                break;
+            }
+            if (buf.is_live(hash)) {
+                if (may_hold(buf.slot(hash), key_hash) &&
+                    key_equal(buf.slot(hash).value.first, key)) {
+                    counters.record_hit(i + 1);
+                    return { hash, false };
+                }
+            } else if (!found) {
+                first_deleted = hash;
+                found = true;
+            }
+            hash = (hash + 1) & (buffer_size - 1);
+            ++i;
+        }
+        counters.record_miss(i + 1);
+
+        if (found) {
+            hash = first_deleted;
+        }
+        if (old_buffer_size != 0) {
+            size_t old_pos = find_old_position(key, key_hash);
+            if (old_pos != old_buffer_size) {
+                move_from_old(old_pos, hash);
+                return { hash, false };
+            }
+        }
+
+        // Rebuilding moves all elements, so the position is searched again,
+        // there are no deleted elements after it.
+        if (check_density()) {
+            hash = free_position(key_hash);
+        }
+        open_position(hash);
+        set_hash(hash, key_hash);
+        ++sz;
+        return { hash, true };
+    }
+
+    // Returns reference to the value with the given key
+    // adding a default one if key doesn't exist in O(1) amortized.
+    template<class K>
+    ValueType& find_or_insert(K&& key) {
+        auto res = prepare_insert(key);
+        if (res.second) {
+            construct(res.first, std::piecewise_construct,
+                std::forward_as_tuple(std::forward<K>(key)),
+                std::forward_as_tuple());
+        }
+        return buf.slot(res.first).value.second;
+    }
+
+    // Hashes up to batch_size keys from first, prefetches their home
+    // positions, with the states the storage keeps beside the slots and
+    // the home positions in the buffer being migrated, and advances
+    // first past them in O(batch_size).
+    // Returns number of hashed keys.
+    // key_of returns key of an element of range.
+    template<class It, class F>
+    size_t prefetch_batch(It& first, It last, size_t* hashes,
+        F key_of) const {
+        size_t count = 0;
+        for (; count < batch_size && first != last; ++count, ++first) {
+            hashes[count] = hash_of(key_of(*first));
+            if (buffer_size != 0) {
+                buf.prefetch(hashes[count] & (buffer_size - 1));
+            }
+            if (old_buffer_size != 0) {
+                old_buf.prefetch(hashes[count] & (old_buffer_size - 1));
+            }
+        }
+        return count;
+    }
+
+    // Returns the key of the batched lookup as it is.
+    struct same_key {
+        template<class K>
+        const K& operator()(const K& key) const {
+            return key;
+        }
+    };
+
+    // Writes result of to_iterator for positions of keys in range
+    // in O(1) amortized per key, see find_batch.
+    template<class ForwardIt, class OutputIt, class F>
+    OutputIt find_batch_positions(ForwardIt first, ForwardIt last,
+        OutputIt out, F to_iterator) const {
+        size_t hashes[batch_size];
+        while (first != last) {
+            ForwardIt batch_first = first;
+            size_t count = prefetch_batch(first, last, hashes, same_key());
+            for (size_t i = 0; i < count; ++i, ++batch_first) {
+                *out = to_iterator(find_position(*batch_first, hashes[i]));
+                ++out;
+            }
+        }
+        return out;
+    }
+
+    // Returns the first empty or deleted position for a key with
+    // the given hash_of(key) in O(1) amortized, or in robin hood order
+    // the position of the first element closer to its home.
+    // Must only be used for a key that doesn't exist in the table.
+    size_t free_position(size_t key_hash) const {
+        size_t hash = key_hash & (buffer_size - 1);
+        size_t i = 0;
+        while (buf.is_live(hash) &&
+            (!Policy::robin_hood || distance(hash) >= i)) {
+            hash = (hash + 1) & (buffer_size - 1);
+            ++i;
+        }
+        return hash;
+    }
+
+    // Returns distance of the element in the position from its home
+    // position in O(1).
+    size_t distance(size_t pos) const {
+        return (pos - slot_hash(buf.slot(pos))) & (buffer_size - 1);
+    }
+
+    // Marks a position returned by free_position() as occupied in O(1)
+    // amortized, shifting the elements from it to the next empty
+    // position forward by one if it's live. The position is left without
+    // an element, caller has to put one there.
+    void open_position(size_t pos) {
+        if (!buf.is_live(pos)) {
+            occupy(pos);
+            return;
+        }
+        size_t mask = buffer_size - 1;
+        size_t last = pos;
+        while (!buf.is_empty(last)) {
+            last = (last + 1) & mask;
+        }
+        occupy(last);
+        for (; last != pos; last = (last - 1) & mask) {
+            move_slot(last, buf.slot((last - 1) & mask));
+        }
+    }
+
+    // Returns an opened position for a key with the given hash_of(key)
+    // that doesn't exist in the table in O(1) amortized, see
+    // open_position(). Doesn't change the number of elements.
+    size_t claim_position(size_t key_hash) {
+        size_t pos = free_position(key_hash);
+        open_position(pos);
+        set_hash(pos, key_hash);
+        return pos;
+    }
+
+    // Fills the hole left by an erased element with the following elements
+    // of its cluster that may be moved there, then marks the last hole
+    // empty in O(1) amortized.
+    // Element may be moved back if the hole is between its home
+    // position and its current one.
+    // In robin hood order the elements up to the first one in its home
+    // position are all moved back by one, which keeps the order.
+    void backward_shift(size_t hole) {
+        size_t mask = buffer_size - 1;
+        size_t pos = (hole + 1) & mask;
+        while (!buf.is_empty(pos)) {
+            size_t start = slot_hash(buf.slot(pos)) & mask;
+            if (((pos - start) & mask) >= ((pos - hole) & mask)) {
+                move_slot(hole, buf.slot(pos));
+                hole = pos;
+            } else if (Policy::robin_hood) {
+                break;
+            }
+            pos = (pos + 1) & mask;
+        }
+        buf.set_empty(hole);
+        --size_all_non_nullptr;
+    }
+
+    // Marks an empty or deleted position as occupied in O(1).
+    // Doesn't change the number of elements.
+    void occupy(size_t pos) {
+        if (buf.is_empty(pos)) {
+            ++size_all_non_nullptr;
+        }
+        buf.set_live(pos);
+    }
+
+    // Returns hash of the key passed through the mixer of the policy in O(1).
+    template<class K>
+    size_t hash_of(const K& key) const {
+        return typename Policy::mixer()(hasher(key));
+    }
+
+    // Returns hash_of the key of an element in O(1), without calling
+    // the hash function if slots keep hashes.
+    size_t slot_hash(const slot_type& slot) const {
+        return slot_hash(slot, hash_stored());
+    }
+
+    size_t slot_hash(const slot_type& slot, std::true_type) const {
+        return slot.hash;
+    }
+
+    size_t slot_hash(const slot_type& slot, std::false_type) const {
+        return hash_of(slot.value.first);
+    }
+
+    // Returns false if the slot surely doesn't hold a key with the given
+    // hash_of(key) in O(1): keys are compared only if the hashes are equal.
+    static bool may_hold(const slot_type& slot, size_t key_hash) {
+        return may_hold(slot, key_hash, hash_stored());
+    }
+
+    static bool may_hold(const slot_type& slot, size_t key_hash,
+        std::true_type) {
+        return slot.hash == key_hash;
+    }
+
+    static bool may_hold(const slot_type&, size_t, std::false_type) {
+        return true;
+    }
+
+    // Keeps hash_of the key of the element put in the position
+    // if slots keep hashes, in O(1).
+    void set_hash(size_t pos, size_t key_hash) {
+        set_hash(buf.slot(pos), key_hash, hash_stored());
+    }
+
+    static void set_hash(slot_type& slot, size_t key_hash, std::true_type) {
+        slot.hash = key_hash;
+    }
+
+    static void set_hash(slot_type&, size_t, std::false_type) {}
+
+    // Returns the smallest size of a table that holds count elements
+    // without growing.
+    static size_t buffer_size_for(size_t count) {
+        size_t res = default_size;
+        while (max_non_empty_for(res) < count) {
+            res *= increasing_size;
+        }
+        return res;
+    }
+
+    // Returns number of non-empty positions a table of the given size
+    // holds without growing in O(1).
+    static size_t max_non_empty_for(size_t size) {
+        return ratio_of(size, Policy::max_load_numerator,
+            Policy::max_load_denominator);
+    }
+
+    // Returns size * numerator / denominator rounded down in O(1)
+    // without overflowing.
+    static size_t ratio_of(size_t size, size_t numerator,
+        size_t denominator) {
+        return size / denominator * numerator +
+            size % denominator * numerator / denominator;
+    }
+
+    // Recomputes limits of non-empty positions and of live elements for
+    // the current size in O(1), must be called whenever it changes.
+    void update_limits() {
+        max_non_empty = max_non_empty_for(buffer_size);
+        min_live = ratio_of(buffer_size, Policy::min_load_numerator,
+            Policy::min_load_denominator);
+    }
+
+    // Reserves space for elements in range for forward iterators.
+    template<typename It>
+    void reserve_for(It begin, It end, std::forward_iterator_tag) {
+        reserve(size_t(std::distance(begin, end)));
+    }
+
+    // Input iterators can be passed only once, so nothing is reserved.
+    template<typename It>
+    void reserve_for(It, It, std::input_iterator_tag) {}
+
+    // Moves the element of the slot to the given position with its hash
+    // and destroys it in the slot in O(1).
+    void move_slot(size_t pos, slot_type& from) {
+        buf.slot(pos).move_construct(from);
+        from.value.~pair();
+    }
+
+    // Constructs an element from the arguments in the position claimed
+    // for it by prepare_insert() or claim_position(). If constructing
+    // throws, the position is given up, so the table is left as it was.
+    template<class... Args>
+    void construct(size_t pos, Args&&... args) {
+        try {
+            new (&buf.slot(pos).mutable_value)
+                std::pair<KeyType, ValueType>(std::forward<Args>(args)...);
+        } catch (...) {
+            abandon(pos);
+            throw;
+        }
+    }
+
+    // Gives up a position claimed for an element that wasn't constructed
+    // in O(1) amortized, as if the element was erased.
+    void abandon(size_t pos) {
+        --sz;
+        if (Policy::backward_shift_erase) {
+            backward_shift(pos);
+        } else {
+            buf.set_deleted(pos);
+        }
+    }
+
+    // Initializes table.
+    void init() {
+        buffer_size = default_size;
+        update_limits();
+        sz = 0;
+        size_all_non_nullptr = 0;
+        buf.allocate(alloc, buffer_size);
+        old_sz = 0;
+        old_buffer_size = 0;
+        migrate_pos = 0;
+    }
+
+    // Destroys all elements and frees the buffers
+    // in O(size + buffer_size / 64).
+    void destroy() {
+        for (size_t i = next_live(0); i < end_position();
+            i = next_live(i + 1)) {
+            slot_at(i).value.~pair();
+        }
+        buf.deallocate(alloc, buffer_size);
+        if (old_buffer_size != 0) {
+            old_buf.deallocate(alloc, old_buffer_size);
+        }
+        // A destroyed table has no positions, so destroying it again
+        // does nothing.
+        drop_buffers();
+    }
+
+    // Makes this table an empty one without buffers in O(1), they must
+    // be freed or taken by another table. It has no positions, lookups
+    // find nothing and the first insert allocates a buffer.
+    void drop_buffers() {
+        sz = 0;
+        buffer_size = 0;
+        update_limits();
+        size_all_non_nullptr = 0;
+        old_sz = 0;
+        old_buffer_size = 0;
+        migrate_pos = 0;
+    }
+
+    // Copies elements of other table into this destroyed one keeping
+    // their positions in O(buffer_size) time, so nothing is rehashed.
+    // Trivially copyable elements are copied with memcpy. Elements of
+    // the buffer being migrated are inserted into the copy instead.
+    // A copy of a table without buffers has none either.
+    void copy_buffers(const HashMap& oth) {
+        drop_buffers();
+        if (oth.buffer_size == 0) {
+            return;
+        }
+        buf.allocate(alloc, oth.buffer_size);
+        buffer_size = oth.buffer_size;
+        update_limits();
+        buf.copy_from(oth.buf, buffer_size, trivially_copyable());
+        size_all_non_nullptr = oth.size_all_non_nullptr;
+        sz = oth.sz - oth.old_sz;
+        for (size_t pos = oth.next_live(oth.buffer_size);
+            pos < oth.end_position(); pos = oth.next_live(pos + 1)) {
+            const value_type& item = oth.slot_at(pos).value;
+            construct(prepare_insert(item.first).first, item);
+        }
+    }
+
+    // Increases the size of a table and reinserts all elements in O(size)
+    // time, or starts moving them incrementally if the policy asks to.
+    void increase_size() {
+        typename stats_type::resize_timer timer(counters,
+            &HashMapStats::increases);
+        if (Policy::incremental_rehash_step == 0) {
+            rebuild(buffer_size * increasing_size);
+            return;
+        }
+        complete_migration();
+        old_buf.allocate(alloc, buffer_size * increasing_size);
+        old_buf.swap(buf);
+        old_buffer_size = buffer_size;
+        old_sz = sz;
+        migrate_pos = 0;
+        buffer_size *= increasing_size;
+        update_limits();
+        size_all_non_nullptr = 0;
+    }
+
+    // Decreases the size of a table and reinserts all elements in O(size) time.
+    void decrease_size() {
+        typename stats_type::resize_timer timer(counters,
+            &HashMapStats::decreases);
+        rebuild(buffer_size / decreasing_size);
+    }
+
+    // Moves the next incremental_rehash_step slots of the buffer being
+    // migrated to the current one in O(incremental_rehash_step) time.
+    void migrate() {
+        migrate_slots(Policy::incremental_rehash_step);
+    }
+
+    // Moves all elements left in the buffer being migrated in O(size) time.
+    void complete_migration() {
+        migrate_slots(old_buffer_size);
+    }
+
+    // Moves count slots of the buffer being migrated to the current one
+    // and frees it when all slots are moved in O(count) time.
+    void migrate_slots(size_t count) {
+        while (old_buffer_size != 0 && count > 0) {
+            if (old_buf.is_live(migrate_pos)) {
+                move_from_old(migrate_pos,
+                    free_position(slot_hash(old_buf.slot(migrate_pos))));
+            }
+            ++migrate_pos;
+            --count;
+            if (migrate_pos == old_buffer_size) {
+                old_buf.deallocate(alloc, old_buffer_size);
+                old_buffer_size = 0;
+                migrate_pos = 0;
+            }
+        }
+    }
+
+    // Moves an element of the buffer being migrated to the given empty or
+    // deleted position of the current one in O(1), copying it unless
+    // move_elements is set. An empty or deleted position is occupied only
+    // after that, so if copying throws the element stays where it was.
+    void move_from_old(size_t old_pos, size_t pos) {
+        if (buf.is_live(pos)) {
+            open_position(pos);
+        }
+        transfer_slot(buf.slot(pos), old_buf.slot(old_pos), move_elements());
+        old_buf.slot(old_pos).value.~pair();
+        occupy(pos);
+        old_buf.set_deleted(old_pos);
+        --old_sz;
+    }
+
+    // Moves all elements to a new buffer of the given size in O(size) time.
+    // Only live elements are moved, empty slots are never constructed.
+    // The new buffer replaces the current one only when it holds all
+    // elements, so if allocating, hashing or copying throws the table
+    // is left unchanged.
+    // Large tables are rebuilt in parallel if the policy asks to.
+    void rebuild(size_t new_buffer_size) {
+        size_t threads = threads_for(Policy::rehash_threads);
+        if (threads > 1 && !Policy::robin_hood &&
+            sz >= Policy::parallel_rehash_size &&
+            std::is_nothrow_move_constructible<
+                std::pair<KeyType, ValueType>>::value) {
+            rebuild_parallel(new_buffer_size, threads);
+            return;
+        }
+        complete_migration();
+        rebuild(new_buffer_size, nothrow_rebuild());
+    }
+
+    // Same as rebuild() for elements whose moves and hashes can't throw,
+    // so only allocating the new buffer may, before anything is changed.
+    void rebuild(size_t new_buffer_size, std::true_type) {
+        storage_type prev(alloc);
+        prev.allocate(alloc, new_buffer_size);
+        prev.swap(buf);
+        size_t past_buffer_size = buffer_size;
+        buffer_size = new_buffer_size;
+        update_limits();
+        size_all_non_nullptr = 0;
+        for (size_t i = prev.next_live(0, past_buffer_size);
+            i < past_buffer_size; i = prev.next_live(i + 1, past_buffer_size)) {
+            size_t pos = free_position(slot_hash(prev.slot(i)));
+            open_position(pos);
+            move_slot(pos, prev.slot(i));
+        }
+        prev.deallocate(alloc, past_buffer_size);
+    }
+
+    // Same as rebuild() for elements whose moves or hashes may throw,
+    // in O(size + new_buffer_size) time and memory: first finds positions
+    // of all elements in the new buffer, then copies every element to its
+    // position, or moves it if move_elements is set. If a copy throws,
+    // the copies are destroyed and the current buffer is kept.
+    void rebuild(size_t new_buffer_size, std::false_type) {
+        std::vector<size_t> sources(new_buffer_size, buffer_size);
+        place_elements(sources);
+        storage_type next(alloc);
+        next.allocate(alloc, new_buffer_size);
+        try {
+            for (size_t pos = 0; pos < new_buffer_size; ++pos) {
+                if (sources[pos] != buffer_size) {
+                    transfer_slot(next.slot(pos), buf.slot(sources[pos]),
+                        move_elements());
+                    next.set_live(pos);
+                }
+            }
+        } catch (...) {
+            for (size_t pos = next.next_live(0, new_buffer_size);
+                pos < new_buffer_size;
+                pos = next.next_live(pos + 1, new_buffer_size)) {
+                next.slot(pos).value.~pair();
+            }
+            next.deallocate(alloc, new_buffer_size);
+            throw;
+        }
+        for (size_t i = next_live(0); i < buffer_size; i = next_live(i + 1)) {
+            buf.slot(i).value.~pair();
+        }
+        next.swap(buf);
+        next.deallocate(alloc, buffer_size);
+        buffer_size = new_buffer_size;
+        update_limits();
+        size_all_non_nullptr = sz;
+    }
+
+    // Finds positions of all live elements in a buffer of sources.size()
+    // without touching them in O(size + sources.size()) amortized time,
+    // probing as free_position() and open_position() do in an empty one.
+    // Sets sources[pos] to the position of the element that would be in
+    // pos, sources must be filled with buffer_size.
+    void place_elements(std::vector<size_t>& sources) const {
+        size_t mask = sources.size() - 1;
+        // Homes of the placed elements, robin hood order compares their
+        // distances.
+        std::vector<size_t> homes(Policy::robin_hood ? sources.size() : 0);
+        for (size_t i = next_live(0); i < buffer_size; i = next_live(i + 1)) {
+            size_t home = slot_hash(buf.slot(i)) & mask;
+            size_t pos = home;
+            size_t dist = 0;
+            while (sources[pos] != buffer_size && (!Policy::robin_hood ||
+                ((pos - homes[pos]) & mask) >= dist)) {
+                pos = (pos + 1) & mask;
+                ++dist;
+            }
+            // In robin hood order the rest of the cluster is shifted.
+            size_t item = i;
+            while (sources[pos] != buffer_size) {
+                std::swap(item, sources[pos]);
+                std::swap(home, homes[pos]);
+                pos = (pos + 1) & mask;
+            }
+            sources[pos] = item;
+            if (Policy::robin_hood) {
+                homes[pos] = home;
+            }
+        }
+    }
+
+    // Constructs the element of a slot with its hash in an empty slot,
+    // moving it.
+    static void transfer_slot(slot_type& to, slot_type& from,
+        std::true_type) {
+        to.move_construct(from);
+    }
+
+    // Same as above copying it.
+    static void transfer_slot(slot_type& to, slot_type& from,
+        std::false_type) {
+        to.copy_construct(from);
+    }
+
+    // Same as rebuild() moving elements with the given number of threads
+    // in O(size / threads + buffer_size / 64) time. Only hashing may throw,
+    // before any element is moved, then the current buffer is kept.
+    void rebuild_parallel(size_t new_buffer_size, size_t threads) {
+        complete_migration();
+        storage_type prev(alloc);
+        prev.allocate(alloc, new_buffer_size);
+        prev.swap(buf);
+        size_t past_buffer_size = buffer_size;
+        size_t past_non_empty = size_all_non_nullptr;
+        buffer_size = new_buffer_size;
+        update_limits();
+        size_all_non_nullptr = 0;
+        try {
+            rebuild_parallel(prev, past_buffer_size, threads);
+        } catch (...) {
+            prev.swap(buf);
+            prev.deallocate(alloc, buffer_size);
+            buffer_size = past_buffer_size;
+            update_limits();
+            size_all_non_nullptr = past_non_empty;
+            throw;
+        }
+        prev.deallocate(alloc, past_buffer_size);
+    }
+
+    // Moves all elements of the previous buffer of the given size into
+    // the current empty one with the given number of threads. The caller
+    // owns the previous buffer and frees it.
+    void rebuild_parallel(storage_type& prev, size_t past_buffer_size,
+        size_t threads) {
+        place_parallel(past_buffer_size, threads, true,
+            [&prev, past_buffer_size](size_t i) {
+                return prev.next_live(i, past_buffer_size);
+            },
+            [this, &prev](size_t i) { return slot_hash(prev.slot(i)); },
+            [&prev](size_t i) -> const KeyType& {
+                return prev.slot(i).value.first;
+            },
+            [this, &prev](size_t pos, size_t i) {
+                move_slot(pos, prev.slot(i));
+            },
+            [this, &prev](size_t i, size_t hash) {
+                size_t pos = free_position(hash);
+                occupy(pos);
+                move_slot(pos, prev.slot(i));
+                return true;
+            });
+    }
+
+    // Writes the buffer of a table that isn't growing incrementally
+    // as a snapshot in O(buffer_size), see HashMapSnapshotHeader.
+    void write_snapshot(std::ostream& out) const {
+        using pair_type = std::pair<KeyType, ValueType>;
+        HashMapSnapshotHeader header = {HashMapSnapshotHeader::signature,
+            sizeof(KeyType), sizeof(ValueType), sizeof(pair_type),
+            buffer_size, sz, {0, 0}};
+        static_assert(sizeof(header) == HashMapSnapshotHeader::slots_offset,
+            "slots must follow the header");
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        // Slots are copied through a chunk, so empty ones are written
+        // zeroed whatever the layout of the storage is.
+        constexpr size_t chunk_slots = 4096;
+        std::vector<char> chunk(chunk_slots * sizeof(pair_type));
+        for (size_t first = 0; first < buffer_size; first += chunk_slots) {
+            size_t count = std::min(chunk_slots, buffer_size - first);
+            std::memset(chunk.data(), 0, count * sizeof(pair_type));
+            for (size_t i = buf.next_live(first, first + count);
+                i < first + count; i = buf.next_live(i + 1, first + count)) {
+                std::memcpy(&chunk[(i - first) * sizeof(pair_type)],
+                    &buf.slot(i).value, sizeof(pair_type));
+            }
+            out.write(chunk.data(), std::streamsize(count * sizeof(pair_type)));
+        }
+        const char padding[8] = {};
+        out.write(padding, std::streamsize(header.live_offset() -
+            HashMapSnapshotHeader::slots_offset - buffer_size *
+            sizeof(pair_type)));
+
+        std::vector<uint64_t> live(header.bitmap_words());
+        std::vector<uint64_t> non_empty(header.bitmap_words());
+        for (size_t i = 0; i < buffer_size; ++i) {
+            if (buf.is_live(i)) {
+                live[i / 64] |= uint64_t(1) << (i % 64);
+            }
+            if (!buf.is_empty(i)) {
+                non_empty[i / 64] |= uint64_t(1) << (i % 64);
+            }
+        }
+        out.write(reinterpret_cast<const char*>(live.data()),
+            std::streamsize(live.size() * 8));
+        out.write(reinterpret_cast<const char*>(non_empty.data()),
+            std::streamsize(non_empty.size() * 8));
+    }
+
+    // Returns number of threads to use for the requested one,
+    // 0 means one per hardware thread.
+    static size_t threads_for(size_t threads) {
+        if (threads == 0) {
+            threads = std::thread::hardware_concurrency();
+        }
+        return std::max(threads, size_t(1));
+    }
+
+    // Calls task(i) for every i below threads, all but the first in
+    // new threads, and waits for them to finish. Tasks that don't get
+    // a thread are called in this one after the first.
+    // Returns the first exception thrown by a task, if any.
+    template<class F>
+    static std::exception_ptr run_parallel(size_t threads, F task) {
+        std::vector<std::exception_ptr> errors(threads);
+        auto run = [&errors, &task](size_t i) {
+            try {
+                task(i);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        };
+        std::vector<std::thread> workers;
+        try {
+            workers.reserve(threads - 1);
+            for (size_t i = 1; i < threads; ++i) {
+                workers.emplace_back(run, i);
+            }
+        } catch (...) {
+            // No more threads can be started, the rest run here.
+        }
+        run(0);
+        for (size_t i = workers.size() + 1; i < threads; ++i) {
+            run(i);
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        for (auto& error : errors) {
+            if (error) {
+                return error;
+            }
+        }
+        return nullptr;
+    }
+
+    // Puts up to count elements into the table with the given number of
+    // threads in O(count / threads) amortized, the table must be large
+    // enough to hold them and have no deleted elements.
+    // Elements are numbered below count, next(i) returns the first one
+    // from i on or count, hash_at(i) returns hash_of its key, key_of(i)
+    // returns the key and put(pos, i) constructs it in the empty position.
+    // Threads first hash the elements of equal parts of the numbers and
+    // group them by regions of the table, then put the groups each into
+    // its own region in order of the numbers, so no two threads write the
+    // same position. Keys that already exist are skipped unless unique is
+    // set. Elements whose probe sequences leave their region are passed to
+    // spill(i, hash) by the calling thread in order of the regions,
+    // it returns true if the element is inserted. They are kept in their
+    // groups, so nothing is allocated once elements are put and only
+    // hashing, put and spill may throw after that.
+    // Returns number of inserted elements.
+    template<class Next, class HashAt, class KeyOf, class Put, class Spill>
+    size_t place_parallel(size_t count, size_t threads, bool unique,
+        Next next, HashAt hash_at, KeyOf key_of, Put put, Spill spill) {
+        size_t regions = 1;
+        size_t shift = 0;
+        while (regions < threads && buffer_size / regions >= 2 * region_size) {
+            regions *= 2;
+        }
+        while ((buffer_size >> shift) > regions) {
+            ++shift;
+        }
+        using item = std::pair<size_t, size_t>;
+        // groups[part * regions + region] - numbers and hashes of
+        // the elements of a part in a region.
+        std::vector<std::vector<item>> groups(threads * regions);
+        std::exception_ptr error = run_parallel(threads,
+            [&](size_t part) {
+                size_t end = count * (part + 1) / threads;
+                for (size_t i = next(count * part / threads); i < end;
+                    i = next(i + 1)) {
+                    size_t hash = hash_at(i);
+                    groups[part * regions +
+                        ((hash & (buffer_size - 1)) >> shift)].push_back(
+                        item(i, hash));
+                }
+            });
+        if (error) {
+            std::rethrow_exception(error);
+        }
+
+        std::vector<size_t> placed(threads);
+        error = run_parallel(threads, [&](size_t worker) {
+            for (size_t region = worker; region < regions;
+                region += threads) {
+                size_t region_end = (region + 1) << shift;
+                for (size_t part = 0; part < threads; ++part) {
+                    std::vector<item>& group = groups[part * regions + region];
+                    size_t spilled = 0;
+                    for (const item& it : group) {
+                        size_t pos = it.second & (buffer_size - 1);
+                        while (!buf.is_empty(pos) && (unique ||
+                            !may_hold(buf.slot(pos), it.second) ||
+                            !key_equal(buf.slot(pos).value.first,
+                            key_of(it.first)))) {
+                            if (++pos == region_end) {
+                                break;
+                            }
+                        }
+                        if (pos == region_end) {
+                            group[spilled++] = it;
+                        } else if (buf.is_empty(pos)) {
+                            put(pos, it.first);
+                            set_hash(pos, it.second);
+                            buf.set_live(pos);
+                            ++placed[worker];
+                        }
+                    }
+                    group.resize(spilled);
+                }
+            }
+        });
+        size_t res = 0;
+        for (size_t n : placed) {
+            res += n;
+        }
+        size_all_non_nullptr += res;
+        if (!unique) {
+            sz += res;
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        for (size_t region = 0; region < regions; ++region) {
+            for (size_t part = 0; part < threads; ++part) {
+                for (const item& it : groups[part * regions + region]) {
+                    res += spill(it.first, it.second);
+                }
+            }
+        }
+        return res;
+    }
+
+    // Takes buffers of other table, this one must be destroyed
+    // and have an equal allocator. Leaves other table empty without
+    // buffers in O(1), nothing is allocated.
+    void take(HashMap& oth) {
+        sz = oth.sz;
+        buffer_size = oth.buffer_size;
+        update_limits();
+        size_all_non_nullptr = oth.size_all_non_nullptr;
+        buf.swap(oth.buf);
+        old_sz = oth.old_sz;
+        old_buffer_size = oth.old_buffer_size;
+        migrate_pos = oth.migrate_pos;
+        old_buf.swap(oth.old_buf);
+        oth.drop_buffers();
+    }
+
+    // Returns collected counters in O(1).
+    HashMapStats collected_stats(std::true_type) const {
+        return counters;
+    }
+
+    HashMapStats collected_stats(std::false_type) const {
+        return HashMapStats();
+    }
+
+    // Replaces allocator of a destroyed table and of its buffers
+    // if the allocator propagates on assignment.
+    void propagate_allocator(const slot_allocator& alloc_, std::true_type) {
+        alloc = alloc_;
+        buf.set_allocator(alloc);
+        old_buf.set_allocator(alloc);
+    }
+
+    void propagate_allocator(const slot_allocator&, std::false_type) {}
+
+    // Swaps allocators of two tables if the allocator propagates on swap.
+    void swap_allocator(HashMap& oth, std::true_type) {
+        std::swap(alloc, oth.alloc);
+    }
+
+    void swap_allocator(HashMap&, std::false_type) {}
+};
+
+
+#if __cplusplus >= 201703L
+// HashMap with buffers taken from a std::pmr::memory_resource,
+// e.g. std::pmr::monotonic_buffer_resource for per request tables.
+template<class KeyType, class ValueType, class Hash = std::hash<KeyType>,
+    class KeyEqual = std::equal_to<KeyType>,
+    class Policy = DefaultHashMapPolicy>
+using PmrHashMap = HashMap<KeyType, ValueType, Hash, KeyEqual,
+    std::pmr::polymorphic_allocator<std::pair<const KeyType, ValueType>>,
+    Policy>;
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+// Read-only view of a snapshot written by HashMap::save(), served straight
+// from the memory-mapped file: opening costs O(1) whatever the size is and
+// pages are read by the system when lookups touch them.
+// Hash, KeyEqual and Policy must be the ones of the saved table.
+template<class KeyType, class ValueType, class Hash = std::hash<KeyType>,
+    class KeyEqual = std::equal_to<KeyType>,
+    class Policy = DefaultHashMapPolicy>
+class MappedHashMap {
+    static_assert(std::is_trivially_copyable<KeyType>::value &&
+        std::is_trivially_copyable<ValueType>::value,
+        "only tables of trivially copyable types can be mapped");
+
+    template<class K>
+    using key_arg = typename HashMapKeyArg<IsTransparent<Hash>::value &&
+        IsTransparent<KeyEqual>::value>::template type<K, KeyType>;
+
+ public:
+    using key_type = KeyType;
+    using mapped_type = ValueType;
+    using value_type = std::pair<const KeyType, ValueType>;
+    using size_type = size_t;
+    using difference_type = std::ptrdiff_t;
+    using reference = const value_type&;
+    using const_reference = const value_type&;
+
+    // Iterator allows to iterate over elements of the file.
+    class const_iterator {
+     public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::pair<const KeyType, ValueType>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const value_type*;
+        using reference = const value_type&;
+
+        // Default constructor.
+        const_iterator() : pos(0), table(nullptr) {}
+
+        // Constructor with the given position.
+        const_iterator(size_t pos_, const MappedHashMap* table_) :
+            pos(pos_), table(table_) {
+            go();
+        }
+
+        // Pre-increment iterator in O(1) amortized.
+        const_iterator& operator++() {
+            ++pos;
+            go();
+            return (*this);
+        }
+
+        // Post-increment iterator in O(1) amortized.
+        const_iterator operator++(int) {
+            const_iterator res = *this;
+            ++pos;
+            go();
+            return res;
+        }
+
+        // Return true if iterators are the same in O(1).
+        bool operator==(const const_iterator& oth) const {
+            return pos == oth.pos && table == oth.table;
+        }
+
+        // Return true if iterators are different in O(1).
+        bool operator!=(const const_iterator& oth) const {
+            return !((*this) == oth);
+        }
+
+        // Returns constant item reference in O(1) time.
+        pointer operator->() const {
+            return &table->slots[pos];
+        }
+
+        // Returns constant item reference in O(1) time.
+        reference operator*() const {
+            return table->slots[pos];
+        }
+
+     private:
+        size_t pos;
+        const MappedHashMap* table;
+
+        // Finds the next element in O(1) amortized,
+        // skipping 64 empty positions at once.
+        void go() {
+            pos = table->next_live(pos);
+        }
+    };
+
+    using iterator = const_iterator;
+
+    // Maps the snapshot in the given file in O(1).
+    // Throws std::runtime_error if the file can't be mapped
+    // or holds no snapshot of this type.
+    explicit MappedHashMap(const char* path, Hash hasher_ = Hash(),
+        KeyEqual key_equal_ = KeyEqual()) :
+        hasher(hasher_), key_equal(key_equal_) {
+        int fd = open(path, O_RDONLY);
+        if (fd == -1) {
+            throw std::runtime_error("can't open snapshot");
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 ||
+            size_t(info.st_size) < sizeof(HashMapSnapshotHeader)) {
+            close(fd);
+            throw std::runtime_error("not a snapshot");
+        }
+        length = size_t(info.st_size);
+        data = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            throw std::runtime_error("can't map snapshot");
+        }
+        const auto& header =
+            *static_cast<const HashMapSnapshotHeader*>(data);
+        if (header.magic != HashMapSnapshotHeader::signature ||
+            header.key_size != sizeof(KeyType) ||
+            header.value_size != sizeof(ValueType) ||
+            header.slot_size != sizeof(value_type) ||
+            header.buffer_size == 0 ||
+            (header.buffer_size & (header.buffer_size - 1)) != 0 ||
+            !header.fits() || header.file_size() != length) {
+            munmap(data, length);
+            throw std::runtime_error("not a snapshot of this table type");
+        }
+        const char* bytes = static_cast<const char*>(data);
+        buffer_size = size_t(header.buffer_size);
+        sz = size_t(header.size);
+        slots = reinterpret_cast<const value_type*>(
+            bytes + HashMapSnapshotHeader::slots_offset);
+        live = reinterpret_cast<const uint64_t*>(
+            bytes + header.live_offset());
+        non_empty = live + header.bitmap_words();
+    }
+
+    MappedHashMap(const MappedHashMap&) = delete;
+    MappedHashMap& operator=(const MappedHashMap&) = delete;
+
+    // Takes the mapping of other view, which is left without one.
+    MappedHashMap(MappedHashMap&& oth) : hasher(oth.hasher),
+        key_equal(oth.key_equal), data(oth.data), length(oth.length),
+        slots(oth.slots), live(oth.live), non_empty(oth.non_empty),
+        sz(oth.sz), buffer_size(oth.buffer_size) {
+        oth.data = nullptr;
+    }
+
+    // Unmaps the file and takes the mapping of other view.
+    MappedHashMap& operator=(MappedHashMap&& oth) {
+        if (&oth != this) {
+            unmap();
+            hasher = oth.hasher;
+            key_equal = oth.key_equal;
+            data = oth.data;
+            length = oth.length;
+            slots = oth.slots;
+            live = oth.live;
+            non_empty = oth.non_empty;
+            sz = oth.sz;
+            buffer_size = oth.buffer_size;
+            oth.data = nullptr;
+        }
+        return *this;
+    }
+
+    // Unmaps the file.
+    ~MappedHashMap() {
+        unmap();
+    }
+
+    // Returns const_iterator to the first element in O(1) amortized.
+    const_iterator begin() const {
+        return const_iterator(0, this);
+    }
+
+    // Returns const_iterator to the end of the table in O(1).
+    const_iterator end() const {
+        return const_iterator(buffer_size, this);
+    }
+
+    // Returns const_iterator to the first element in O(1) amortized.
+    const_iterator cbegin() const {
+        return begin();
+    }
+
+    // Returns const_iterator to the end of the table in O(1).
+    const_iterator cend() const {
+        return end();
+    }
+
+    // Returns const_iterator to the pair with the given key
+    // or end() if key doesn't exist in O(1) amortized.
+    template<class K = KeyType>
+    const_iterator find(const key_arg<K>& key) const {
+        return const_iterator(find_position(key), this);
+    }
+
+    // Returns true if key exists in O(1) amortized.
+    template<class K = KeyType>
+    bool contains(const key_arg<K>& key) const {
+        return find_position(key) != buffer_size;
+    }
+
+    // Returns reference to an object with the given key
+    // in O(1) amortized time.
+    // If key doesn't exist throws an exception.
+    template<class K = KeyType>
+    const ValueType& at(const key_arg<K>& key) const {
+        size_t pos = find_position(key);
+        if (pos == buffer_size) {
+            throw std::out_of_range("out of range");
+        }
+        return slots[pos].second;
+    }
+
+    // Returns amount of elements in table in O(1).
+    size_t size() const {
+        return sz;
+    }
+
+    // Returns true if there are no elements in table in O(1).
+    bool empty() const {
+        return sz == 0;
+    }
+
+    // Returns size of the saved hash table in O(1).
+    size_t bucket_count() const {
+        return buffer_size;
+    }
+
+    // Returns hash function of table in O(1).
+    Hash hash_function() const {
+        return hasher;
+    }
+
+    // Returns key comparator of table in O(1).
+    KeyEqual key_eq() const {
+        return key_equal;
+    }
+
+ private:
+    Hash hasher;
+    KeyEqual key_equal;
+    // data - start of the mapping of length bytes, nullptr if there is
+    // none. slots, live and non_empty point into it.
+    void* data;
+    size_t length;
+    const value_type* slots;
+    const uint64_t* live;
+    const uint64_t* non_empty;
+    size_t sz, buffer_size;
+
+    // Returns true if the position holds an element in O(1).
+    bool is_live(size_t pos) const {
+        return (live[pos / 64] >> (pos % 64)) & 1;
+    }
+
+    // Returns true if the position holds an element or a deleted mark,
+    // so probing goes on after it, in O(1).
+    bool is_occupied(size_t pos) const {
+        return (non_empty[pos / 64] >> (pos % 64)) & 1;
+    }
+
+    // Returns the first position of an element from pos on
+    // or buffer_size in O(1 + distance / 64).
+    size_t next_live(size_t pos) const {
+        if (pos >= buffer_size) {
+            return buffer_size;
+        }
+        size_t index = pos / 64;
+        uint64_t word = live[index] & (~uint64_t(0) << (pos % 64));
+        while (word == 0) {
+            if (++index * 64 >= buffer_size) {
+                return buffer_size;
+            }
+            word = live[index];
+        }
+        return index * 64 + size_t(__builtin_ctzll(word));
+    }
+
+    // Returns position of the element with the given key or buffer_size
+    // if key doesn't exist in O(1) amortized, probing as HashMap does.
+    template<class K>
+    size_t find_position(const K& key) const {
+        size_t hash = typename Policy::mixer()(hasher(key)) &
+            (buffer_size - 1);
+        for (size_t i = 0; i < buffer_size && is_occupied(hash); ++i) {
+            if (is_live(hash) && key_equal(slots[hash].first, key)) {
+                return hash;
+            }
+            hash = (hash + 1) & (buffer_size - 1);
+        }
+        return buffer_size;
+    }
+
+    // Unmaps the file if there is a mapping.
+    void unmap() {
+        if (data != nullptr) {
+            munmap(data, length);
+            data = nullptr;
+        }
+    }
+};
+#endif
+
+// Hash table for maps that usually hold a few elements: up to capacity
+// elements live inside the object, unordered, and are found by comparing
+// keys one by one, so such a map never allocates. Inserting one more
+// moves them to a HashMap built in place, which is used until clear().
+// Has the same interface as HashMap, except the batched, node, merge and
+// snapshot operations. Iterators are invalidated by erase of inline
+// elements, since the last one fills the hole.
+template<class KeyType, class ValueType, size_t capacity = 8,
+    class Hash = std::hash<KeyType>, class KeyEqual = std::equal_to<KeyType>,
+    class Allocator = std::allocator<std::pair<const KeyType, ValueType>>,
+    class Policy = DefaultHashMapPolicy>
+class SmallHashMap {
+    static_assert(capacity > 0, "a small table holds at least one element");
+
+    using slot_type = MapSlot<KeyType, ValueType>;
+    template<class K>
+    using key_arg = typename HashMapKeyArg<IsTransparent<Hash>::value &&
+        IsTransparent<KeyEqual>::value>::template type<K, KeyType>;
+    // move_elements - whether inline elements are moved to the heap table
+    // instead of copied: if their moves and hashes are noexcept, so
+    // nothing throws once the table is reserved, or they can't be copied.
+    using move_elements = std::integral_constant<bool,
+        (std::is_nothrow_move_constructible<
+        std::pair<KeyType, ValueType>>::value &&
+        noexcept(std::declval<const Hash&>()(
+        std::declval<const KeyType&>()))) ||
+        !std::is_copy_constructible<std::pair<KeyType, ValueType>>::value>;
+
+ public:
+    using map_type =
+        HashMap<KeyType, ValueType, Hash, KeyEqual, Allocator, Policy>;
+    using key_type = KeyType;
+    using mapped_type = ValueType;
+    using value_type = std::pair<const KeyType, ValueType>;
+    using size_type = size_t;
+    using difference_type = std::ptrdiff_t;
+    using reference = value_type&;
+    using const_reference = const value_type&;
+    using allocator_type = Allocator;
+
+ private:
+    using map_allocator = typename std::allocator_traits<Allocator>::
+        template rebind_alloc<map_type>;
+    using map_traits = std::allocator_traits<map_allocator>;
+
+ public:
+    class const_iterator;
+
+    // Iterator allows to iterate over elements of table
+    // and work with them.
+    class iterator {
+        friend class const_iterator;
+
+     public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::pair<const KeyType, ValueType>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = value_type*;
+        using reference = value_type&;
+
+        // Default constructor.
+        iterator() : pos(0), table(nullptr) {}
+
+        // Constructor with the given inline position.
+        iterator(size_t pos_, SmallHashMap* table_) :
+            pos(pos_), table(table_) {}
+
+        // Constructor with the given iterator of the heap table.
+        iterator(typename map_type::iterator it_, SmallHashMap* table_) :
+            pos(0), it(it_), table(table_) {}
+
+        // Pre-increment iterator in O(1) amortized.
+        iterator& operator++() {
+            if (table->on_heap) {
+                ++it;
+            } else {
+                ++pos;
+            }
+            return (*this);
+        }
+
+        // Post-increment iterator in O(1) amortized.
+        iterator operator++(int) {
+            iterator res = *this;
+            ++(*this);
+            return res;
+        }
+
+        // Return true if iterators are the same in O(1).
+        bool operator==(const iterator& oth) const {
+            return pos == oth.pos && it == oth.it && table == oth.table;
+        }
+
+        // Return true if iterators are different in O(1).
+        bool operator!=(const iterator& oth) const {
+            return !((*this) == oth);
+        }
+
+        // Returns item reference in O(1) time.
+        pointer operator->() const {
+            return &**this;
+        }
+
+        // Returns item reference in O(1) time.
+        reference operator*() const {
+            return table->on_heap ? *it : table->inline_slots[pos].value;
+        }
+
+     private:
+        size_t pos;
+        typename map_type::iterator it;
+        SmallHashMap* table;
+    };
+
+    // Iterator allows to iterate over elements of constant table.
+    class const_iterator {
+     public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::pair<const KeyType, ValueType>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const value_type*;
+        using reference = const value_type&;
+
+        // Default constructor.
+        const_iterator() : pos(0), table(nullptr) {}
+
+        // Constructor with the given inline position.
+        const_iterator(size_t pos_, const SmallHashMap* table_) :
+            pos(pos_), table(table_) {}
+
+        // Constructor with the given iterator of the heap table.
+        const_iterator(typename map_type::const_iterator it_,
+            const SmallHashMap* table_) : pos(0), it(it_), table(table_) {}
+
+        // Converts iterator to const_iterator in O(1).
+        const_iterator(const iterator& oth) :
+            pos(oth.pos), it(oth.it), table(oth.table) {}
+
+        // Pre-increment iterator in O(1) amortized.
+        const_iterator& operator++() {
+            if (table->on_heap) {
+                ++it;
+            } else {
+                ++pos;
+            }
+            return (*this);
+        }
+
+        // Post-increment iterator in O(1) amortized.
+        const_iterator operator++(int) {
+            const_iterator res = *this;
+            ++(*this);
+            return res;
+        }
+
+        // Return true if iterators are the same in O(1).
+        bool operator==(const const_iterator& oth) const {
+            return pos == oth.pos && it == oth.it && table == oth.table;
+        }
+
+        // Return true if iterators are different in O(1).
+        bool operator!=(const const_iterator& oth) const {
+            return !((*this) == oth);
+        }
+
+        // Returns constant item reference in O(1) time.
+        pointer operator->() const {
+            return &**this;
+        }
+
+        // Returns constant item reference in O(1) time.
+        reference operator*() const {
+            return table->on_heap ? *it : table->inline_slots[pos].value;
+        }
+
+     private:
+        size_t pos;
+        typename map_type::const_iterator it;
+        const SmallHashMap* table;
+    };
+
+    // Default constructor with given hash function, key comparator
+    // and allocator. Allocates nothing.
+    SmallHashMap(Hash hasher_ = Hash(), KeyEqual key_equal_ = KeyEqual(),
+        const Allocator& alloc_ = Allocator()) :
+        hasher(hasher_), key_equal(key_equal_), alloc(alloc_),
+        inline_size(0), on_heap(false) {}
+
+    // Constructor with given allocator.
+    explicit SmallHashMap(const Allocator& alloc_) :
+        SmallHashMap(Hash(), KeyEqual(), alloc_) {}
+
+    // Constructor for initializer list with given hash function,
+    // key comparator and allocator.
+    SmallHashMap(std::initializer_list<std::pair<KeyType, ValueType>> list,
+        Hash hasher_ = Hash(), KeyEqual key_equal_ = KeyEqual(),
+        const Allocator& alloc_ = Allocator()) :
+        SmallHashMap(list.begin(), list.end(), hasher_, key_equal_,
+            alloc_) {}
+
+    // Constructor for given begin and end iterator.
+    template<typename It>
+    SmallHashMap(It begin, It end, Hash hasher_ = Hash(),
+        KeyEqual key_equal_ = KeyEqual(),
+        const Allocator& alloc_ = Allocator()) :
+        SmallHashMap(hasher_, key_equal_, alloc_) {
+        while (begin != end) {
+            insert(*begin);
+            ++begin;
+        }
+    }
+
+    // Copy constructor in O(size). The table is constructed before
+    // elements are copied, so if copying throws the copies are destroyed.
+    SmallHashMap(const SmallHashMap& oth) :
+        SmallHashMap(oth.hasher, oth.key_equal, std::allocator_traits<
+        Allocator>::select_on_container_copy_construction(oth.alloc)) {
+        copy_from(oth);
+    }
+
+    // Move constructor in O(capacity), takes the heap table of other
+    // one, which is left empty. Allocator is copied, so the heap table
+    // is taken as it is and nothing is allocated: it doesn't throw unless
+    // moving inline elements or copying the hash function or the key
+    // comparator does.
+    SmallHashMap(SmallHashMap&& oth) noexcept(
+        std::is_nothrow_move_constructible<
+        std::pair<KeyType, ValueType>>::value &&
+        std::is_nothrow_copy_constructible<Hash>::value &&
+        std::is_nothrow_copy_constructible<KeyEqual>::value) :
+        hasher(oth.hasher), key_equal(oth.key_equal), alloc(oth.alloc),
+        inline_size(0), on_heap(false) {
+        take(oth);
+    }
+
+    // Copies other table in O(size). Elements are copied into
+    // a temporary first and then moved here, so if copying throws
+    // this table is left as it was.
+    SmallHashMap& operator=(const SmallHashMap& oth) {
+        if (&oth != this) {
+            SmallHashMap copy(oth);
+            *this = std::move(copy);
+        }
+        return *this;
+    }
+
+    // Moves other table in O(capacity), leaving it empty. Allocator
+    // is taken if propagate_on_container_move_assignment is set,
+    // otherwise elements of a heap table with another allocator are
+    // moved one by one. Doesn't throw if the allocator propagates
+    // and moving inline elements and copying the hash function and
+    // the key comparator doesn't.
+    SmallHashMap& operator=(SmallHashMap&& oth) noexcept(
+        std::allocator_traits<Allocator>::
+        propagate_on_container_move_assignment::value &&
+        std::is_nothrow_move_constructible<
+        std::pair<KeyType, ValueType>>::value &&
+        std::is_nothrow_copy_assignable<Hash>::value &&
+        std::is_nothrow_copy_assignable<KeyEqual>::value) {
+        if (&oth != this) {
+            clear();
+            hasher = oth.hasher;
+            key_equal = oth.key_equal;
+            propagate_allocator(oth.alloc, std::integral_constant<bool,
+                std::allocator_traits<Allocator>::
+                propagate_on_container_move_assignment::value>());
+            take(oth);
+        }
+        return *this;
+    }
+
+    // Destructor in O(size).
+    ~SmallHashMap() {
+        clear();
+    }
+
+    // Swaps contents of two tables in O(capacity).
+    void swap(SmallHashMap& oth) {
+        SmallHashMap tmp(std::move(oth));
+        oth = std::move(*this);
+        *this = std::move(tmp);
+    }
+
+    // Deletes all elements in table in O(size) and frees the heap table,
+    // so the elements live inline again.
+    void clear() {
+        if (on_heap) {
+            delete_heap(heap_table);
+            on_heap = false;
+        }
+        for (size_t i = 0; i < inline_size; ++i) {
+            inline_slots[i].value.~pair();
+        }
+        inline_size = 0;
+    }
+
+    // Adds a new pair of key and value to the table in O(1) amortized.
+    // Does nothing if key already exists.
+    // Returns iterator to the element with the key
+    // and true if the pair was inserted.
+    std::pair<iterator, bool> insert(
+        const std::pair<KeyType, ValueType>& item) {
+        auto res = prepare_insert(item.first);
+        if (!on_heap) {
+            if (res.second) {
+                construct(item);
+            }
+            return { iterator(res.first, this), res.second };
+        }
+        auto heap_res = heap().insert(item);
+        return { iterator(heap_res.first, this), heap_res.second };
+    }
+
+    // Adds a new pair of key and value to the table in O(1) amortized
+    // moving it into the table.
+    // Does nothing if key already exists.
+    std::pair<iterator, bool> insert(std::pair<KeyType, ValueType>&& item) {
+        auto res = prepare_insert(item.first);
+        if (!on_heap) {
+            if (res.second) {
+                construct(std::move(item));
+            }
+            return { iterator(res.first, this), res.second };
+        }
+        auto heap_res = heap().insert(std::move(item));
+        return { iterator(heap_res.first, this), heap_res.second };
+    }
+
+    // Constructs a pair from the arguments and moves it
+    // into the table in O(1) amortized.
+    // Does nothing if key already exists.
+    template<class... Args>
+    std::pair<iterator, bool> emplace(Args&&... args) {
+        return insert(
+            std::pair<KeyType, ValueType>(std::forward<Args>(args)...));
+    }
+
+    // Adds a value constructed from the arguments with the given key
+    // in O(1) amortized.
+    // Does nothing and doesn't touch the arguments if key already exists.
+    template<class K, class... Args>
+    std::pair<iterator, bool> try_emplace(K&& key, Args&&... args) {
+        auto res = prepare_insert(
+            static_cast<const key_arg<typename std::decay<K>::type>&>(key));
+        if (!on_heap) {
+            if (res.second) {
+                construct(std::piecewise_construct,
+                    std::forward_as_tuple(std::forward<K>(key)),
+                    std::forward_as_tuple(std::forward<Args>(args)...));
+            }
+            return { iterator(res.first, this), res.second };
+        }
+        auto heap_res = heap().try_emplace(std::forward<K>(key),
+            std::forward<Args>(args)...);
+        return { iterator(heap_res.first, this), heap_res.second };
+    }
+
+    // Adds a new pair or assigns the value
+    // if key already exists in O(1) amortized.
+    // Returns iterator to the element and true if the pair was inserted.
+    template<class K, class M>
+    std::pair<iterator, bool> insert_or_assign(K&& key, M&& obj) {
+        auto res = prepare_insert(
+            static_cast<const key_arg<typename std::decay<K>::type>&>(key));
+        if (!on_heap) {
+            if (res.second) {
+                construct(std::forward<K>(key), std::forward<M>(obj));
+            } else {
+                inline_slots[res.first].value.second = std::forward<M>(obj);
+            }
+            return { iterator(res.first, this), res.second };
+        }
+        auto heap_res = heap().insert_or_assign(std::forward<K>(key),
+            std::forward<M>(obj));
+        return { iterator(heap_res.first, this), heap_res.second };
+    }
+
+    // Delete an element with the given key in O(1) amortized.
+    // Does nothing if key doesn't exist in table.
+    // Returns number of deleted elements.
+    template<class K = KeyType>
+    size_t erase(const key_arg<K>& key) {
+        if (on_heap) {
+            return heap().erase(key);
+        }
+        size_t pos = find_inline(key);
+        if (pos == inline_size) {
+            return 0;
+        }
+        inline_slots[pos].value.~pair();
+        --inline_size;
+        if (pos != inline_size) {
+            new (&inline_slots[pos].mutable_value) std::pair<KeyType,
+                ValueType>(std::move(inline_slots[inline_size].mutable_value));
+            inline_slots[inline_size].value.~pair();
+        }
+        return 1;
+    }
+
+    // Returns amount of elements in table in O(1).
+    size_t size() const {
+        return on_heap ? heap().size() : inline_size;
+    }
+
+    // Returns true if there are no elements in table in O(1).
+    bool empty() const {
+        return size() == 0;
+    }
+
+    // Returns true if the elements live in a heap table in O(1).
+    bool is_on_heap() const {
+        return on_heap;
+    }
+
+    // Returns hash function of table in O(1).
+    Hash hash_function() const {
+        return hasher;
+    }
+
+    // Returns key comparator of table in O(1).
+    KeyEqual key_eq() const {
+        return key_equal;
+    }
+
+    // Returns allocator of table in O(1).
+    Allocator get_allocator() const {
+        return alloc;
+    }
+
+    // Makes the table hold count elements without growing, moves the
+    // elements to a heap table in O(size) time if they don't fit inline.
+    void reserve(size_t count) {
+        if (on_heap) {
+            heap().reserve(count);
+        } else if (count > capacity) {
+            move_to_heap(count);
+        }
+    }
+
+    // Returns reference to an object with the given key
+    // in O(1) amortized time.
+    // If key doesn't exist adds a new pair and
+    // retuns reference to it.
+    // Key is converted to KeyType only if it has to be inserted.
+    template<class K = KeyType>
+    ValueType& operator[](const key_arg<K>& key) {
+        return try_emplace(key).first->second;
+    }
+
+    // Same as operator[] above, moves the key into the table
+    // if it doesn't exist.
+    template<class K = KeyType>
+    ValueType& operator[](key_arg<K>&& key) {
+        return try_emplace(std::move(key)).first->second;
+    }
+
+    // Returns reference to an object with the given key
+    // in O(1) amortized time.
+    // If key doesn't exist throws an exception.
+    template<class K = KeyType>
+    const ValueType& at(const key_arg<K>& key) const {
+        if (on_heap) {
+            return heap().at(key);
+        }
+        size_t pos = find_inline(key);
+        if (pos == inline_size) {
+            throw std::out_of_range("out of range");
+        }
+        return inline_slots[pos].value.second;
+    }
+
+    // Returns iterator to the first element in O(1) amortized.
+    iterator begin() {
+        return on_heap ? iterator(heap().begin(), this) : iterator(0, this);
+    }
+
+    // Returns iterator to the end of the table in O(1).
+    iterator end() {
+        return on_heap ? iterator(heap().end(), this)
+            : iterator(inline_size, this);
+    }
+
+    // Returns const_iterator to the first element in O(1) amortized.
+    const_iterator begin() const {
+        return on_heap ? const_iterator(heap().begin(), this)
+            : const_iterator(0, this);
+    }
+
+    // Returns const_iterator to the end of the table in O(1).
+    const_iterator end() const {
+        return on_heap ? const_iterator(heap().end(), this)
+            : const_iterator(inline_size, this);
+    }
+
+    // Returns iterator to the pair with the given key
+    // or end() if key doesn't exist in O(1) amortized.
+    template<class K = KeyType>
+    iterator find(const key_arg<K>& key) {
+        return on_heap ? iterator(heap().find(key), this)
+            : iterator(find_inline(key), this);
+    }
+
+    // Returns const_iterator to the pair with the given key
+    // or end() if key doesn't exist in O(1) amortized.
+    template<class K = KeyType>
+    const_iterator find(const key_arg<K>& key) const {
+        return on_heap ? const_iterator(heap().find(key), this)
+            : const_iterator(find_inline(key), this);
+    }
+
+ private:
+    Hash hasher;
+    KeyEqual key_equal;
+    Allocator alloc;
+    // inline_slots - the first inline_size of them hold elements
+    // unless on_heap is set, then the heap table in heap_table does.
+    // The heap table is allocated and its pointer shares memory with
+    // the inline slots, so a small table costs its slots and nothing
+    // for the heap table it may never need.
+    union {
+        slot_type inline_slots[capacity];
+        map_type* heap_table;
+    };
+    size_t inline_size;
+    bool on_heap;
+
+    // Returns the heap table, on_heap must be set.
+    map_type& heap() {
+        return *heap_table;
+    }
+
+    const map_type& heap() const {
+        return *heap_table;
+    }
+
+    // Allocates a heap table constructed from the arguments. If
+    // constructing throws, its memory is freed.
+    template<class... Args>
+    map_type* new_heap(Args&&... args) {
+        map_allocator map_alloc(alloc);
+        map_type* res = map_traits::allocate(map_alloc, 1);
+        try {
+            new (res) map_type(std::forward<Args>(args)...);
+        } catch (...) {
+            map_traits::deallocate(map_alloc, res, 1);
+            throw;
+        }
+        return res;
+    }
+
+    // Destroys a heap table and frees its memory in O(size).
+    void delete_heap(map_type* table) {
+        map_allocator map_alloc(alloc);
+        table->~map_type();
+        map_traits::deallocate(map_alloc, table, 1);
+    }
+
+    // Returns inline position of the key or inline_size if it doesn't
+    // exist in O(capacity).
+    template<class K>
+    size_t find_inline(const K& key) const {
+        for (size_t i = 0; i < inline_size; ++i) {
+            if (key_equal(inline_slots[i].value.first, key)) {
+                return i;
+            }
+        }
+        return inline_size;
+    }
+
+    // Finds an inline position for an element with the given key
+    // in O(capacity). Returns the position and false if key already
+    // exists, otherwise the next free one and true, caller has to
+    // construct the element there. If there is none the elements are
+    // moved to the heap table, which caller has to use from then on,
+    // as it does when on_heap is already set.
+    template<class K>
+    std::pair<size_t, bool> prepare_insert(const K& key) {
+        if (on_heap) {
+            return { 0, false };
+        }
+        size_t pos = find_inline(key);
+        if (pos != inline_size) {
+            return { pos, false };
+        }
+        if (inline_size == capacity) {
+            move_to_heap(capacity + 1);
+        }
+        return { inline_size, true };
+    }
+
+    // Constructs an element from the arguments in the next inline
+    // position.
+    template<class... Args>
+    void construct(Args&&... args) {
+        new (&inline_slots[inline_size].mutable_value)
+            std::pair<KeyType, ValueType>(std::forward<Args>(args)...);
+        ++inline_size;
+    }
+
+    // Moves inline elements to a new heap table holding count elements
+    // without growing in O(count) time. Elements are copied unless
+    // move_elements is set and destroyed inline only when the heap table
+    // holds all of them, so if that throws the table is left unchanged.
+    // The pointer to the heap table takes the place of the inline slots,
+    // so it's set only after they are destroyed.
+    void move_to_heap(size_t count) {
+        map_type* res = new_heap(hasher, key_equal, alloc);
+        try {
+            res->reserve(count);
+            for (size_t i = 0; i < inline_size; ++i) {
+                res->insert(transfer(inline_slots[i], move_elements()));
+            }
+        } catch (...) {
+            delete_heap(res);
+            throw;
+        }
+        for (size_t i = 0; i < inline_size; ++i) {
+            inline_slots[i].value.~pair();
+        }
+        inline_size = 0;
+        heap_table = res;
+        on_heap = true;
+    }
+
+    // Returns the element of the slot to be moved to the heap table.
+    static std::pair<KeyType, ValueType>&& transfer(slot_type& slot,
+        std::true_type) {
+        return std::move(slot.mutable_value);
+    }
+
+    // Same as above to be copied.
+    static const std::pair<KeyType, ValueType>& transfer(slot_type& slot,
+        std::false_type) {
+        return slot.mutable_value;
+    }
+
+    // Copies elements of other table into this empty one in O(size).
+    void copy_from(const SmallHashMap& oth) {
+        if (oth.on_heap) {
+            heap_table = new_heap(oth.heap(), alloc);
+            on_heap = true;
+            return;
+        }
+        for (size_t i = 0; i < oth.inline_size; ++i) {
+            construct(oth.inline_slots[i].value);
+        }
+    }
+
+    // Moves elements of other table into this empty one in O(capacity),
+    // leaving other one empty. The heap table is taken as it is
+    // in O(1) if allocators are equal.
+    void take(SmallHashMap& oth) {
+        if (oth.on_heap && alloc == oth.alloc) {
+            heap_table = oth.heap_table;
+            on_heap = true;
+            oth.on_heap = false;
+        } else if (oth.on_heap) {
+            map_type* res = new_heap(hasher, key_equal, alloc);
+            try {
+                *res = std::move(oth.heap());
+            } catch (...) {
+                delete_heap(res);
+                throw;
+            }
+            heap_table = res;
+            on_heap = true;
+        } else {
+            for (size_t i = 0; i < oth.inline_size; ++i) {
+                construct(std::move(oth.inline_slots[i].mutable_value));
+            }
+        }
+        oth.clear();
+    }
+
+    // Replaces allocator of an empty table if the allocator propagates
+    // on move assignment.
+    void propagate_allocator(const Allocator& alloc_, std::true_type) {
+        alloc = alloc_;
+    }
+
+    void propagate_allocator(const Allocator&, std::false_type) {}
+};
+
+// Hash table keeping elements densely in insertion order. Elements are
+// appended to an array and an index with open addressing and linear
+// probing maps hashes to their positions, so iteration costs O(size)
+// whatever the number of buckets is.
+// Erased elements leave holes that are skipped 64 at once and are
+// compacted when there are many of them or the array is full.
+// Iterators are invalidated by an insert of a new key and by erase,
+// which may compact the array.
+// Has the same interface as HashMap.
+template<class KeyType, class ValueType, class Hash = std::hash<KeyType>,
+    class KeyEqual = std::equal_to<KeyType>,
+    class Allocator = std::allocator<std::pair<const KeyType, ValueType>>>
+class OrderedHashMap {
+    using slot_type = MapSlot<KeyType, ValueType>;
+
+    // Element with its hash, so the index is rebuilt without hashing.
+    struct entry {
+        slot_type slot;
+        size_t hash;
+    };
+
+    using entry_allocator = typename std::allocator_traits<Allocator>::
+        template rebind_alloc<entry>;
+    using entry_traits = std::allocator_traits<entry_allocator>;
+    using index_type = std::vector<size_t, typename std::allocator_traits<
+        Allocator>::template rebind_alloc<size_t>>;
+    template<class K>
+    using key_arg = typename HashMapKeyArg<IsTransparent<Hash>::value &&
+        IsTransparent<KeyEqual>::value>::template type<K, KeyType>;
+
+ public:
+    using key_type = KeyType;
+    using mapped_type = ValueType;
+    using value_type = std::pair<const KeyType, ValueType>;
+    using size_type = size_t;
+    using difference_type = std::ptrdiff_t;
+    using reference = value_type&;
+    using const_reference = const value_type&;
+    using allocator_type = Allocator;
+
+    // default_size - size of the index when first initialized or cleared.
+    constexpr static size_t default_size = 8;
+    constexpr static size_t increasing_size = 2;
+    // Array holds overload_size of the index size elements, erased included.
+    constexpr static double overload_size = 0.75;
+    // Holes are compacted on erase when they are allowed_holes times
+    // as many as elements.
+    constexpr static size_t allowed_holes = 3;
+
+    class const_iterator;
+
+    // Iterator allows to iterate over elements in insertion order
+    // and work with them.
+    class iterator {
+     public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::pair<const KeyType, ValueType>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = value_type*;
+        using reference = value_type&;
+
+        // Default constructor.
+        iterator() : pos(0), table(nullptr) {}
+
+        // Constructor with the given position.
+        iterator(size_t pos_, OrderedHashMap* table_) :
+            pos(pos_), table(table_) {
+            go();
+        }
+
+        // Pre-increment iterator in O(1) amortized.
+        iterator& operator++() {
+            ++pos;
+            go();
+            return (*this);
+        }
+
+        // Post-increment iterator in O(1) amortized.
+        iterator operator++(int) {
+            iterator res = *this;
+            ++pos;
+            go();
+            return res;
+        }
+
+        // Return true if iterators are the same in O(1).
+        bool operator==(const iterator& oth) const {
+            return pos == oth.pos && table == oth.table;
+        }
+
+        // Return true if iterators are different in O(1).
+        bool operator!=(const iterator& oth) const {
+            return !((*this) == oth);
+        }
+
+        // Returns item reference in O(1) time.
+        pointer operator->() const {
+            return &table->entries[pos].slot.value;
+        }
+
+        // Returns item reference in O(1) time.
+        reference operator*() const {
+            return table->entries[pos].slot.value;
+        }
+
+     private:
+        friend class const_iterator;
+
+        size_t pos;
+        OrderedHashMap* table;
+
+        // Skips holes in O(1) amortized.
+        void go() {
+            pos = table->live.next(pos, table->entries_size);
+        }
+    };
+
+    // Const iterator allows to iterate over the elements in insertion
+    // order and get their values but doesn't allow to change them.
+    class const_iterator {
+     public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::pair<const KeyType, ValueType>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const value_type*;
+        using reference = const value_type&;
+
+        // Default constructor.
+        const_iterator() : pos(0), table(nullptr) {}
+
+        // Constructor with the given position.
+        const_iterator(size_t pos_, const OrderedHashMap* table_) :
+            pos(pos_), table(table_) {
+            go();
+        }
+
+        // Converts iterator to const_iterator in O(1).
+        const_iterator(const iterator& oth) : pos(oth.pos), table(oth.table) {}
+
+        // Pre-increment iterator in O(1) amortized.
+        const_iterator& operator++() {
+            ++pos;
+            go();
+            return (*this);
+        }
+
+        // Post-increment iterator in O(1) amortized.
+        const_iterator operator++(int) {
+            const_iterator res = *this;
+            ++pos;
+            go();
+            return res;
+        }
+
+        // Return true if iterators are the same in O(1).
+        bool operator==(const const_iterator& oth) const {
+            return pos == oth.pos && table == oth.table;
+        }
+
+        // Return true if iterators are different in O(1).
+        bool operator!=(const const_iterator& oth) const {
+            return !((*this) == oth);
+        }
+
+        // Returns constant item reference in O(1) time.
+        pointer operator->() const {
+            return &table->entries[pos].slot.value;
+        }
+
+        // Returns constant item reference in O(1) time.
+        reference operator*() const {
+            return table->entries[pos].slot.value;
+        }
+
+     private:
+        size_t pos;
+        const OrderedHashMap* table;
+
+        // Skips holes in O(1) amortized.
+        void go() {
+            pos = table->live.next(pos, table->entries_size);
+        }
+    };
+
+    // Default constructor with given hash function, key comparator
+    // and allocator.
+    OrderedHashMap(Hash hasher_ = Hash(), KeyEqual key_equal_ = KeyEqual(),
+        const Allocator& alloc_ = Allocator()) :
+        hasher(hasher_), key_equal(key_equal_), alloc(alloc_), index(alloc),
+        live(alloc) {
+        init();
+    }
+
+    // Constructor with given allocator.
+    explicit OrderedHashMap(const Allocator& alloc_) :
+        OrderedHashMap(Hash(), KeyEqual(), alloc_) {}
+
+    // Constructor for initializer list with given hash function,
+    // key comparator and allocator.
+    OrderedHashMap(std::initializer_list<std::pair<KeyType, ValueType>> list,
+        Hash hasher_ = Hash(), KeyEqual key_equal_ = KeyEqual(),
+        const Allocator& alloc_ = Allocator()) :
+        OrderedHashMap(list.begin(), list.end(), hasher_, key_equal_,
+            alloc_) {}
+
+    // Copy constructor, allocator is chosen
+    // by select_on_container_copy_construction.
+    OrderedHashMap(const OrderedHashMap& oth) :
+        OrderedHashMap(oth,
+            Allocator(entry_traits::select_on_container_copy_construction(
+                oth.alloc))) {}
+
+    // Copy constructor with given allocator.
+    // Elements are copied as they are, see copy_from.
+    OrderedHashMap(const OrderedHashMap& oth, const Allocator& alloc_) :
+        OrderedHashMap(oth.hasher, oth.key_equal, alloc_, no_array()) {
+        copy_from(oth);
+    }
+
+    // Move constructor, takes elements and allocator of other table
+    // and leaves it empty without an array in O(1), see take().
+    // Nothing is allocated, so it doesn't throw unless copying
+    // the hash function or the key comparator does.
+    OrderedHashMap(OrderedHashMap&& oth) noexcept(
+        std::is_nothrow_copy_constructible<Hash>::value &&
+        std::is_nothrow_copy_constructible<KeyEqual>::value) :
+        OrderedHashMap(oth.hasher, oth.key_equal, oth.alloc, no_array()) {
+        take(oth);
+    }
+
+    // Constructor for given begin and end iterator.
+    // Reserves space for all elements at once for forward iterators.
+    template<typename It>
+    OrderedHashMap(It begin, It end, Hash hasher_ = Hash(),
+        KeyEqual key_equal_ = KeyEqual(),
+        const Allocator& alloc_ = Allocator()) :
+        OrderedHashMap(hasher_, key_equal_, alloc_) {
+        reserve_for(begin, end,
+            typename std::iterator_traits<It>::iterator_category());
+        while (begin != end) {
+            insert(*begin);
+            ++begin;
+        }
+    }
+
+    // Copies other hash table, allocator is copied
+    // if propagate_on_container_copy_assignment is set.
+    // Elements are copied before this table is changed,
+    // so if copying throws it's left as it was.
+    OrderedHashMap& operator=(const OrderedHashMap& oth) {
+        if (&oth != this) {
+            OrderedHashMap copy(oth, Allocator(
+                entry_traits::propagate_on_container_copy_assignment::value ?
+                oth.alloc : alloc));
+            hasher = oth.hasher;
+            key_equal = oth.key_equal;
+            destroy();
+            propagate_allocator(copy.alloc, std::integral_constant<bool,
+                entry_traits::propagate_on_container_copy_assignment::value>());
+            take(copy);
+        }
+        return (*this);
+    }
+
+    // Takes elements of other hash table, leaves other table empty.
+    // If allocators aren't equal and propagate_on_container_move_assignment
+    // isn't set, elements are moved one by one in O(size) time instead.
+    // Doesn't throw if the allocator propagates and copying the hash
+    // function and the key comparator doesn't.
+    OrderedHashMap& operator=(OrderedHashMap&& oth) noexcept(
+        entry_traits::propagate_on_container_move_assignment::value &&
+        std::is_nothrow_copy_assignable<Hash>::value &&
+        std::is_nothrow_copy_assignable<KeyEqual>::value) {
+        if (&oth != this) {
+            hasher = oth.hasher;
+            key_equal = oth.key_equal;
+            destroy();
+            propagate_allocator(oth.alloc, std::integral_constant<bool,
+                entry_traits::propagate_on_container_move_assignment::value>());
+            if (alloc == oth.alloc) {
+                take(oth);
+            } else {
+                init();
+                reserve(oth.sz);
+                for (size_t i = oth.live.next(0, oth.entries_size);
+                    i < oth.entries_size;
+                    i = oth.live.next(i + 1, oth.entries_size)) {
+                    insert(std::move(oth.entries[i].slot.mutable_value));
+                }
+                oth.clear();
+            }
+        }
+        return (*this);
+    }
+
+    ~OrderedHashMap() {
+        destroy();
+    }
+
+    // Swaps contents of two tables in O(1). Allocators are swapped
+    // if propagate_on_container_swap is set, otherwise they must be equal.
+    void swap(OrderedHashMap& oth) {
+        std::swap(hasher, oth.hasher);
+        std::swap(key_equal, oth.key_equal);
+        swap_allocator(oth, std::integral_constant<bool,
+            entry_traits::propagate_on_container_swap::value>());
+        std::swap(entries, oth.entries);
+        std::swap(sz, oth.sz);
+        std::swap(entries_size, oth.entries_size);
+        std::swap(entries_capacity, oth.entries_capacity);
+        index.swap(oth.index);
+        live.swap(oth.live);
+    }
+
+    // Deletes all elements in table in O(size)
+    // and resets table to its beginning conditions.
+    void clear() {
+        destroy();
+        init();
+    }
+
+    // Adds a new pair of key and value to the end of the table
+    // in O(1) amortized.
+    // Does nothing if key already exists.
+    // Returns iterator to the element with the key
+    // and true if the pair was inserted.
+    std::pair<iterator, bool> insert(
+        const std::pair<KeyType, ValueType>& item) {
+        auto res = prepare_insert(item.first);
+        if (res.second) {
+            append(res.first, item);
+        }
+        return { iterator(res.first, this), res.second };
+    }
+
+    // Adds a new pair of key and value to the end of the table
+    // in O(1) amortized moving it into the table.
+    // Does nothing if key already exists.
+    std::pair<iterator, bool> insert(std::pair<KeyType, ValueType>&& item) {
+        auto res = prepare_insert(item.first);
+        if (res.second) {
+            append(res.first, std::move(item));
+        }
+        return { iterator(res.first, this), res.second };
+    }
+
+    // Constructs a pair from the arguments and moves it
+    // into the table in O(1) amortized.
+    // Does nothing if key already exists.
+    template<class... Args>
+    std::pair<iterator, bool> emplace(Args&&... args) {
+        return insert(
+            std::pair<KeyType, ValueType>(std::forward<Args>(args)...));
+    }
+
+    // Adds a value constructed from the arguments with the given key
+    // in O(1) amortized.
+    // Does nothing and doesn't touch the arguments if key already exists.
+    template<class K, class... Args>
+    std::pair<iterator, bool> try_emplace(K&& key, Args&&... args) {
+        auto res = prepare_insert(
+            static_cast<const key_arg<typename std::decay<K>::type>&>(key));
+        if (res.second) {
+            append(res.first, std::piecewise_construct,
+                std::forward_as_tuple(std::forward<K>(key)),
+                std::forward_as_tuple(std::forward<Args>(args)...));
+        }
+        return { iterator(res.first, this), res.second };
+    }
+
+    // Adds a new pair or assigns the value keeping its place
+    // if key already exists in O(1) amortized.
+    // Returns iterator to the element and true if the pair was inserted.
+    template<class K, class M>
+    std::pair<iterator, bool> insert_or_assign(K&& key, M&& obj) {
+        auto res = prepare_insert(
+            static_cast<const key_arg<typename std::decay<K>::type>&>(key));
+        if (res.second) {
+            append(res.first, std::forward<K>(key), std::forward<M>(obj));
+        } else {
+            entries[res.first].slot.value.second = std::forward<M>(obj);
+        }
+        return { iterator(res.first, this), res.second };
+    }
+
+    // Delete an element with the given key in O(1) amortized.
+    // Does nothing if key doesn't exist in table.
+    // Returns number of deleted elements.
+    template<class K = KeyType>
+    size_t erase(const key_arg<K>& key) {
+        size_t i = find_index(key, hash_of(key));
+        if (i == index.size()) {
+            return 0;
+        }
+        size_t pos = index[i] - 1;
+        entries[pos].slot.value.~pair();
+        live.reset(pos);
+        --sz;
+        remove_index(i);
+        // Holes at the end are given back at once.
+        while (entries_size != 0 && !live.test(entries_size - 1)) {
+            --entries_size;
+        }
+        if (entries_size - sz >= default_size &&
+            entries_size - sz > allowed_holes * sz) {
+            rebuild(index.size());
+        }
+        return 1;
+    }
+
+    // Returns amount of elements in table in O(1).
+    size_t size() const {
+        return sz;
+    }
+
+    // Returns true if there are no elements in table in O(1).
+    bool empty() const {
+        return sz == 0;
+    }
+
+    // Returns hash function of table in O(1).
+    Hash hash_function() const {
+        return hasher;
+    }
+
+    // Returns key comparator of table in O(1).
+    KeyEqual key_eq() const {
+        return key_equal;
+    }
+
+    // Returns allocator of table in O(1).
+    Allocator get_allocator() const {
+        return Allocator(alloc);
+    }
+
+    // Returns current size of the index in O(1).
+    size_t bucket_count() const {
+        return index.size();
+    }
+
+    // Makes the table hold count elements without growing, rebuilds it
+    // in O(size) time if it's not large enough yet.
+    void reserve(size_t count) {
+        if (count > entries_capacity) {
+            rebuild(index_size_for(count));
+        }
+    }
+
+    // If key doesn't exist adds a new pair and
+    // returns a reference to its value in O(1) amortized.
+    template<class K = KeyType>
+    ValueType& operator[](const key_arg<K>& key) {
+        return find_or_insert(key);
+    }
+
+    // If key doesn't exist moves key into a new pair and
+    // returns a reference to its value in O(1) amortized.
+    template<class K = KeyType>
+    ValueType& operator[](key_arg<K>&& key) {
+        return find_or_insert(std::move(key));
+    }
+
+    // Returns reference to the value with the given key in O(1) amortized.
+    // If key doesn't exist throws an exception.
+    template<class K = KeyType>
+    ValueType& at(const key_arg<K>& key) {
+        size_t pos = find_position(key);
+        if (pos == entries_size) {
+            throw std::out_of_range("out of range");
+        }
+        return entries[pos].slot.value.second;
+    }
+
+    // Returns const reference to the value with the given key
+    // in O(1) amortized.
+    // If key doesn't exist throws an exception.
+    template<class K = KeyType>
+    const ValueType& at(const key_arg<K>& key) const {
+        size_t pos = find_position(key);
+        if (pos == entries_size) {
+            throw std::out_of_range("out of range");
+        }
+        return entries[pos].slot.value.second;
+    }
+
+    // Returns iterator to the first element in O(1) amortized.
+    iterator begin() {
+        return iterator(0, this);
+    }
+
+    // Returns iterator to the end of the table in O(1).
+    iterator end() {
+        return iterator(entries_size, this);
+    }
+
+    // Returns const_iterator to the first element in O(1) amortized.
+    const_iterator begin() const {
+        return const_iterator(0, this);
+    }
+
+    // Returns const_iterator to the end of the table in O(1).
+    const_iterator end() const {
+        return const_iterator(entries_size, this);
+    }
+
+    // Returns iterator to the pair with the given key
+    // or end() if key doesn't exist in O(1) amortized.
+    template<class K = KeyType>
+    iterator find(const key_arg<K>& key) {
+        return iterator(find_position(key), this);
+    }
+
+    // Returns const_iterator to the pair with the given key
+    // or end() if key doesn't exist in O(1) amortized.
+    template<class K = KeyType>
+    const_iterator find(const key_arg<K>& key) const {
+        return const_iterator(find_position(key), this);
+    }
+
+ private:
+    Hash hasher;
+    KeyEqual key_equal;
+    entry_allocator alloc;
+    entry* entries;
+    // entries_size - number of used positions of entries, holes included.
+    // entries_capacity - number of allocated positions.
+    size_t sz, entries_size, entries_capacity;
+    // index - positions of elements plus one, 0 if the bucket is empty.
+    index_type index;
+    // live - positions of entries with elements.
+    HashMapBitmap<entry_allocator> live;
+
+    // Returns hash of the key passed through a mixer in O(1),
+    // the index takes its low bits.
+    template<class K>
+    size_t hash_of(const K& key) const {
+        return FibonacciHashMixer()(hasher(key));
+    }
+
+    // Returns bucket of the index with the given key
+    // or index.size() if key doesn't exist in O(1) amortized.
+    // A moved-from table has an empty index and holds nothing.
+    template<class K>
+    size_t find_index(const K& key, size_t hash) const {
+        if (index.empty()) {
+            return 0;
+        }
+        size_t mask = index.size() - 1;
+        size_t i = hash & mask;
+        while (index[i] != 0) {
+            const entry& item = entries[index[i] - 1];
+            if (item.hash == hash && key_equal(item.slot.value.first, key)) {
+                return i;
+            }
+            i = (i + 1) & mask;
+        }
+        return index.size();
+    }
+
+    // Returns position of the pair with the given key
+    // or entries_size if key doesn't exist in O(1) amortized.
+    template<class K>
+    size_t find_position(const K& key) const {
+        size_t i = find_index(key, hash_of(key));
+        return i == index.size() ? entries_size : index[i] - 1;
+    }
+
+    // Finds a position for an element with the given key in O(1) amortized.
+    // Returns the position and false if key already exists. Otherwise
+    // makes room at the end and returns the position there and true,
+    // caller has to put the element there with append().
+    template<class K>
+    std::pair<size_t, bool> prepare_insert(const K& key) {
+        size_t hash = hash_of(key);
+        size_t i = find_index(key, hash);
+        if (i != index.size()) {
+            return { index[i] - 1, false };
+        }
+        if (entries_size == entries_capacity) {
+            // A moved-from table gets its array on the first insert.
+            // Compacting is enough if at least half of the array is holes.
+            rebuild(index.empty() ? default_size
+                : entries_size - sz >= entries_capacity / 2 ? index.size()
+                : index.size() * increasing_size);
+        }
+        entries[entries_size].hash = hash;
+        return { entries_size, true };
+    }
+
+    // Returns reference to the value with the given key
+    // adding a default one if key doesn't exist in O(1) amortized.
+    template<class K>
+    ValueType& find_or_insert(K&& key) {
+        auto res = prepare_insert(key);
+        if (res.second) {
+            append(res.first, std::piecewise_construct,
+                std::forward_as_tuple(std::forward<K>(key)),
+                std::forward_as_tuple());
+        }
+        return entries[res.first].slot.value.second;
+    }
+
+    // Puts the position into the first empty bucket
+    // for its hash in O(1) amortized.
+    void insert_index(size_t pos) {
+        size_t mask = index.size() - 1;
+        size_t i = entries[pos].hash & mask;
+        while (index[i] != 0) {
+            i = (i + 1) & mask;
+        }
+        index[i] = pos + 1;
+    }
+
+    // Empties the bucket moving back the following positions of its
+    // cluster that may be moved there in O(1) amortized,
+    // see HashMap::backward_shift.
+    void remove_index(size_t hole) {
+        size_t mask = index.size() - 1;
+        size_t i = (hole + 1) & mask;
+        while (index[i] != 0) {
+            size_t start = entries[index[i] - 1].hash & mask;
+            if (((i - start) & mask) >= ((i - hole) & mask)) {
+                index[hole] = index[i];
+                hole = i;
+            }
+            i = (i + 1) & mask;
+        }
+        index[hole] = 0;
+    }
+
+    // Constructs an element from the arguments in the given position.
+    template<class... Args>
+    void construct(size_t pos, Args&&... args) {
+        new (&entries[pos].slot.mutable_value)
+            std::pair<KeyType, ValueType>(std::forward<Args>(args)...);
+    }
+
+    // Constructs an element from the arguments in the position returned
+    // by prepare_insert() and adds it to the table in O(1) amortized.
+    // The element is added only once it's constructed, so if constructing
+    // throws the table is left without it.
+    template<class... Args>
+    void append(size_t pos, Args&&... args) {
+        construct(pos, std::forward<Args>(args)...);
+        ++entries_size;
+        insert_index(pos);
+        live.set(pos);
+        ++sz;
+    }
+
+    // Returns number of elements an index of the given size holds.
+    static size_t capacity_for(size_t index_size) {
+        return size_t(overload_size * index_size);
+    }
+
+    // Returns the smallest size of an index that holds count elements.
+    static size_t index_size_for(size_t count) {
+        size_t res = default_size;
+        while (capacity_for(res) < count) {
+            res *= increasing_size;
+        }
+        return res;
+    }
+
+    // Reserves space for elements in range for forward iterators.
+    template<typename It>
+    void reserve_for(It begin, It end, std::forward_iterator_tag) {
+        reserve(size_t(std::distance(begin, end)));
+    }
+
+    // Input iterators can be passed only once, so nothing is reserved.
+    template<typename It>
+    void reserve_for(It, It, std::input_iterator_tag) {}
+
+    // Initializes table.
+    void init() {
+        sz = 0;
+        entries_size = 0;
+        entries_capacity = capacity_for(default_size);
+        entries = entry_traits::allocate(alloc, entries_capacity);
+        index.assign(default_size, 0);
+        live.assign(entries_capacity);
+    }
+
+    // Destroys all elements and frees the buffers in O(size).
+    // Destroying a destroyed table does nothing.
+    void destroy() {
+        for (size_t i = live.next(0, entries_size); i < entries_size;
+            i = live.next(i + 1, entries_size)) {
+            entries[i].slot.value.~pair();
+        }
+        if (entries != nullptr) {
+            entry_traits::deallocate(alloc, entries, entries_capacity);
+            entries = nullptr;
+        }
+        sz = 0;
+        entries_size = 0;
+        entries_capacity = 0;
+        index_type(index.get_allocator()).swap(index);
+        live.release();
+    }
+
+    // Copies elements of other table into this destroyed one keeping
+    // their positions in O(size) time: the index is copied as it is
+    // and nothing is rehashed. Trivially copyable elements are copied
+    // with memcpy. A copy of a moved-from table has no array either.
+    void copy_from(const OrderedHashMap& oth) {
+        sz = 0;
+        entries_size = 0;
+        entries_capacity = 0;
+        if (oth.entries == nullptr) {
+            return;
+        }
+        entries = entry_traits::allocate(alloc, oth.entries_capacity);
+        entries_capacity = oth.entries_capacity;
+        index = oth.index;
+        live.assign(entries_capacity);
+        copy_entries(oth, std::integral_constant<bool,
+            std::is_trivially_copyable<KeyType>::value &&
+            std::is_trivially_copyable<ValueType>::value>());
+    }
+
+    // Copies entries of other table with memcpy in O(size).
+    void copy_entries(const OrderedHashMap& oth, std::true_type) {
+        std::memcpy(static_cast<void*>(entries), oth.entries,
+            oth.entries_size * sizeof(entry));
+        live = oth.live;
+        entries_size = oth.entries_size;
+        sz = oth.sz;
+    }
+
+    // Copies entries of other table with copy constructor in O(size).
+    // If it throws, only elements copied before are live.
+    void copy_entries(const OrderedHashMap& oth, std::false_type) {
+        for (size_t i = 0; i < oth.entries_size; ++i) {
+            entries[i].hash = oth.entries[i].hash;
+            if (oth.live.test(i)) {
+                construct(i, oth.entries[i].slot.value);
+                live.set(i);
+                ++sz;
+            }
+            entries_size = i + 1;
+        }
+    }
+
+    // Moves elements to a new array for an index of the given size
+    // keeping their order and removing holes in O(size) time.
+    // Elements are copied unless their moves are noexcept, and the new
+    // array, bitmap and index replace the current ones only when they
+    // hold all elements, so if allocating or copying throws the table
+    // is left unchanged.
+    void rebuild(size_t new_index_size) {
+        size_t next_capacity = capacity_for(new_index_size);
+        index_type next_index(new_index_size, 0, index.get_allocator());
+        HashMapBitmap<entry_allocator> next_live(alloc);
+        next_live.assign(next_capacity);
+        entry* next = entry_traits::allocate(alloc, next_capacity);
+        size_t next_size = 0;
+        try {
+            for (size_t i = live.next(0, entries_size); i < entries_size;
+                i = live.next(i + 1, entries_size)) {
+                next[next_size].hash = entries[i].hash;
+                new (&next[next_size].slot.mutable_value)
+                    std::pair<KeyType, ValueType>(std::move_if_noexcept(
+                    entries[i].slot.mutable_value));
+                ++next_size;
+            }
+        } catch (...) {
+            for (size_t pos = 0; pos < next_size; ++pos) {
+                next[pos].slot.value.~pair();
+            }
+            entry_traits::deallocate(alloc, next, next_capacity);
+            throw;
+        }
+        for (size_t i = live.next(0, entries_size); i < entries_size;
+            i = live.next(i + 1, entries_size)) {
+            entries[i].slot.value.~pair();
+        }
+        if (entries != nullptr) {
+            entry_traits::deallocate(alloc, entries, entries_capacity);
+        }
+        entries = next;
+        entries_size = next_size;
+        entries_capacity = next_capacity;
+        index.swap(next_index);
+        live.swap(next_live);
+        for (size_t pos = 0; pos < entries_size; ++pos) {
+            insert_index(pos);
+            live.set(pos);
+        }
+    }
+
+    // Takes elements of other table, this one must be destroyed
+    // and have an equal allocator. Leaves other table empty without
+    // an array and an index in O(1), nothing is allocated.
+    void take(OrderedHashMap& oth) {
+        entries = oth.entries;
+        sz = oth.sz;
+        entries_size = oth.entries_size;
+        entries_capacity = oth.entries_capacity;
+        index.swap(oth.index);
+        live.swap(oth.live);
+        oth.entries = nullptr;
+        oth.sz = 0;
+        oth.entries_size = 0;
+        oth.entries_capacity = 0;
+    }
+
+    // Replaces allocator of a destroyed table and of its buffers
+    // if the allocator propagates on assignment.
+    void propagate_allocator(const entry_allocator& alloc_, std::true_type) {
+        alloc = alloc_;
+        index = index_type(alloc);
+        live.set_allocator(alloc);
+    }
+
+    void propagate_allocator(const entry_allocator&, std::false_type) {}
+
+    // Swaps allocators of two tables if the allocator propagates on swap.
+    void swap_allocator(OrderedHashMap& oth, std::true_type) {
+        std::swap(alloc, oth.alloc);
+    }
+
+    void swap_allocator(OrderedHashMap&, std::false_type) {}
+
+    // Tag of the constructor of a table without an array.
+    struct no_array {};
+
+    // Constructor of an empty table without an array and an index,
+    // as a moved-from one is, allocates nothing.
+    OrderedHashMap(const Hash& hasher_, const KeyEqual& key_equal_,
+        const entry_allocator& alloc_, no_array) noexcept(
+        std::is_nothrow_copy_constructible<Hash>::value &&
+        std::is_nothrow_copy_constructible<KeyEqual>::value) :
+        hasher(hasher_), key_equal(key_equal_), alloc(alloc_),
+        entries(nullptr), sz(0), entries_size(0), entries_capacity(0),
+        index(alloc), live(alloc) {}
+};
+
+
+// Hash table with open addressing over groups of 16 slots (Swiss table).
+// Every slot has one control byte: empty, deleted or 7 bits of the key hash.
+// Lookup compares the control bytes of a whole group at once (SSE2, NEON or
+// a portable fallback) and touches slots only when a hash fragment matches.
+// Has the interface of HashMap, except the batched, node, merge
+// and snapshot operations, so they can be swapped for comparison.
+// https://abseil.io/about/design/swisstables
+template<class KeyType, class ValueType, class Hash = std::hash<KeyType>,
+    class KeyEqual = std::equal_to<KeyType>,
+    class Allocator = std::allocator<std::pair<const KeyType, ValueType>>>
+class SwissHashMap {
+ public:
+    using key_type = KeyType;
+    using mapped_type = ValueType;
+    using value_type = std::pair<const KeyType, ValueType>;
+    using size_type = size_t;
+    using difference_type = std::ptrdiff_t;
+    using reference = value_type&;
+    using const_reference = const value_type&;
+    using allocator_type = Allocator;
+
+    // group_width - number of slots scanned by one group compare.
+    constexpr static size_t group_width = 16;
+    // default_size - size of hash table
+    // when first initialized or cleared.
+    constexpr static size_t default_size = group_width;
+    // Table is rehashed when full and deleted slots exceed
+    // max_load_numerator / max_load_denominator of its size.
+    constexpr static size_t max_load_numerator = 7;
+    constexpr static size_t max_load_denominator = 8;
+
+ private:
+    using ctrl_t = int8_t;
+    constexpr static ctrl_t ctrl_empty = -128;
+    constexpr static ctrl_t ctrl_deleted = -2;
+
+    using slot_type = MapSlot<KeyType, ValueType>;
+    using slot_allocator = typename std::allocator_traits<Allocator>::
+        template rebind_alloc<slot_type>;
+    using slot_traits = std::allocator_traits<slot_allocator>;
+    using ctrl_type = std::vector<ctrl_t, typename std::allocator_traits<
+        Allocator>::template rebind_alloc<ctrl_t>>;
+
+ public:
+    class const_iterator;
+
+    // Iterator allows to iterate over elements in table and work with them.
+    class iterator {
+     public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::pair<const KeyType, ValueType>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = value_type*;
+        using reference = value_type&;
+
+        // Default constructor.
+        iterator() : pos(0), table(nullptr) {}
+
+        // Constructor with the given position.
+        iterator(size_t pos_, SwissHashMap* table_) :
+            pos(pos_), table(table_) {
+            go();
+        }
+
+        // Pre-increment iterator in O(1) amortized.
+        iterator& operator++() {
+            ++pos;
+            go();
+            return (*this);
+        }
+
+        // Post-increment iterator in O(1) amortized.
+        iterator operator++(int) {
+            iterator res = *this;
+            ++pos;
+            go();
+            return res;
+        }
+
+        // Return true if iterators are the same in O(1).
+        bool operator==(const iterator& oth) const {
+            return pos == oth.pos && table == oth.table;
+        }
+
+        // Return true if iterators are different in O(1).
+        bool operator!=(const iterator& oth) const {
+            return !((*this) == oth);
+        }
+
+        // Returns item reference in O(1) time.
+        pointer operator->() const {
+            return &table->slots[pos].value;
+        }
+
+        // Returns item reference in O(1) time.
+        reference operator*() const {
+            return table->slots[pos].value;
+        }
+
+     private:
+        friend class const_iterator;
+
+        size_t pos;
+        SwissHashMap* table;
+
+        // Finds the next element in O(1) amortized.
+        void go() {
+            pos = table->next_full(pos);
+        }
+    };
+
+    // Const iterator allows to iterate over the elements in table and get
+    // their values but doesn't allow to change them.
+    class const_iterator {
+     public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::pair<const KeyType, ValueType>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const value_type*;
+        using reference = const value_type&;
+
+        // Default constructor.
+        const_iterator() : pos(0), table(nullptr) {}
+
+        // Constructor with the given position.
+        const_iterator(size_t pos_, const SwissHashMap* table_) :
+            pos(pos_), table(table_) {
+            go();
+        }
+
+        // Converts iterator to const_iterator in O(1).
+        const_iterator(const iterator& oth) : pos(oth.pos), table(oth.table) {}
+
+        // Pre-increment iterator in O(1) amortized.
+        const_iterator& operator++() {
+            ++pos;
+            go();
+            return (*this);
+        }
+
+        // Post-increment iterator in O(1) amortized.
+        const_iterator operator++(int) {
+            const_iterator res = *this;
+            ++pos;
+            go();
+            return res;
+        }
+
+        // Return true if iterators are the same in O(1).
+        bool operator==(const const_iterator& oth) const {
+            return pos == oth.pos && table == oth.table;
+        }
+
+        // Return true if iterators are different in O(1).
+        bool operator!=(const const_iterator& oth) const {
+            return !((*this) == oth);
+        }
+
+        // Returns constant item reference in O(1) time.
+        pointer operator->() const {
+            return &table->slots[pos].value;
+        }
+
+        // Returns constant item reference in O(1) time.
+        reference operator*() const {
+            return table->slots[pos].value;
+        }
+
+     private:
+        size_t pos;
+        const SwissHashMap* table;
+
+        // Finds the next element in O(1) amortized.
+        void go() {
+            pos = table->next_full(pos);
+        }
+    };
+
+    // Default constructor with given hash function, key comparator
+    // and allocator.
+    SwissHashMap(Hash hasher_ = Hash(), KeyEqual key_equal_ = KeyEqual(),
+        const Allocator& alloc_ = Allocator()) :
+        SwissHashMap(default_size, hasher_, key_equal_, alloc_) {}
+
+    // Constructor with given allocator.
+    explicit SwissHashMap(const Allocator& alloc_) :
+        SwissHashMap(Hash(), KeyEqual(), alloc_) {}
+
+    // Constructor for a table with at least the given number of buckets
+    // with given hash function, key comparator and allocator.
+    explicit SwissHashMap(size_t bucket_count_, Hash hasher_ = Hash(),
+        KeyEqual key_equal_ = KeyEqual(),
+        const Allocator& alloc_ = Allocator()) :
+        hasher(hasher_), key_equal(key_equal_), alloc(alloc_), ctrl(alloc) {
+        init(capacity_for_buckets(bucket_count_));
+    }
+
+    // Constructor for initializer list with given hash function,
+    // key comparator and allocator.
+    SwissHashMap(std::initializer_list<std::pair<KeyType, ValueType>> list,
+        Hash hasher_ = Hash(), KeyEqual key_equal_ = KeyEqual(),
+        const Allocator& alloc_ = Allocator()) :
+        SwissHashMap(list.begin(), list.end(), hasher_, key_equal_,
+            alloc_) {}
+
+    // Copy constructor, allocator is chosen
+    // by select_on_container_copy_construction.
+    SwissHashMap(const SwissHashMap& oth) :
+        SwissHashMap(oth,
+            Allocator(slot_traits::select_on_container_copy_construction(
+                oth.alloc))) {}
+
+    // Copy constructor with given allocator. The table is constructed
+    // before elements are copied, so if copying throws the copies
+    // are destroyed.
+    SwissHashMap(const SwissHashMap& oth, const Allocator& alloc_) :
+        SwissHashMap(oth.capacity, oth.hasher, oth.key_equal, alloc_) {
+        for (auto it = oth.begin(); it != oth.end(); ++it) {
+            try_emplace(it->first, it->second);
+        }
+    }
+
+    // Move constructor, takes slots and allocator of other table
+    // and leaves it empty without slots in O(1), see take().
+    // Nothing is allocated, so it doesn't throw unless copying
+    // the hash function or the key comparator does.
+    SwissHashMap(SwissHashMap&& oth) noexcept(
+        std::is_nothrow_copy_constructible<Hash>::value &&
+        std::is_nothrow_copy_constructible<KeyEqual>::value) :
+        hasher(oth.hasher), key_equal(oth.key_equal), alloc(oth.alloc),
+        ctrl(alloc) {
+        take(oth);
+    }
+
+    // Constructor for given begin and end iterator.
+    // Reserves space for all elements at once for forward iterators.
+    template<typename It>
+    SwissHashMap(It begin, It end, Hash hasher_ = Hash(),
+        KeyEqual key_equal_ = KeyEqual(),
+        const Allocator& alloc_ = Allocator()) :
+        SwissHashMap(hasher_, key_equal_, alloc_) {
+        reserve_for(begin, end,
+            typename std::iterator_traits<It>::iterator_category());
+        while (begin != end) {
+            insert(*begin);
+            ++begin;
+        }
+    }
+
+    // Copies other hash table, allocator is copied
+    // if propagate_on_container_copy_assignment is set.
+    // Elements are copied before this table is changed,
+    // so if copying throws it's left as it was.
+    SwissHashMap& operator=(const SwissHashMap& oth) {
+        if (&oth != this) {
+            SwissHashMap copy(oth, Allocator(
+                slot_traits::propagate_on_container_copy_assignment::value ?
+                oth.alloc : alloc));
+            hasher = oth.hasher;
+            key_equal = oth.key_equal;
+            destroy();
+            propagate_allocator(copy.alloc, std::integral_constant<bool,
+                slot_traits::propagate_on_container_copy_assignment::value>());
+            take(copy);
+        }
+        return (*this);
+    }
+
+    // Takes slots of other hash table, leaves other table empty
+    // without slots. If allocators aren't equal and
+    // propagate_on_container_move_assignment isn't set, elements are
+    // moved one by one in O(size) time instead.
+    // Doesn't throw if the allocator propagates and copying the hash
+    // function and the key comparator doesn't.
+    SwissHashMap& operator=(SwissHashMap&& oth) noexcept(
+        slot_traits::propagate_on_container_move_assignment::value &&
+        std::is_nothrow_copy_assignable<Hash>::value &&
+        std::is_nothrow_copy_assignable<KeyEqual>::value) {
+        if (&oth != this) {
+            hasher = oth.hasher;
+            key_equal = oth.key_equal;
+            destroy();
+            propagate_allocator(oth.alloc, std::integral_constant<bool,
+                slot_traits::propagate_on_container_move_assignment::value>());
+            if (alloc == oth.alloc) {
+                take(oth);
+            } else {
+                init(capacity_for(oth.sz));
+                for (size_t i = 0; i < oth.capacity; ++i) {
+                    if (oth.ctrl[i] >= 0) {
+                        insert(std::move(oth.slots[i].mutable_value));
+                    }
+                }
+                oth.clear();
+            }
+        }
+        return (*this);
+    }
+
+    ~SwissHashMap() {
+        destroy();
+    }
+
+    // Swaps contents of two tables in O(1). Allocators are swapped
+    // if propagate_on_container_swap is set, otherwise they must be equal.
+    void swap(SwissHashMap& oth) {
+        std::swap(hasher, oth.hasher);
+        std::swap(key_equal, oth.key_equal);
+        swap_allocator(oth, std::integral_constant<bool,
+            slot_traits::propagate_on_container_swap::value>());
+        std::swap(sz, oth.sz);
+        std::swap(capacity, oth.capacity);
+        std::swap(growth_left, oth.growth_left);
+        std::swap(ctrl, oth.ctrl);
+        std::swap(slots, oth.slots);
+    }
+
+    // Deletes all elements in table in O(size)
+    // and resets table to its beginning conditions.
+    void clear() {
+        destroy();
+        init(default_size);
+    }
+
+    // Adds a new pair of key and value to the table in O(1) amortized.
+    // Does nothing if key already exists.
+    // Returns iterator to the element with the key
+    // and true if the pair was inserted.
+    std::pair<iterator, bool> insert(
+        const std::pair<KeyType, ValueType>& item) {
+        auto res = find_or_prepare_insert(item.first);
+        if (res.second) {
+            construct(res.first, item);
+        }
+        return { iterator_at(res.first), res.second };
+    }
+
+    // Adds a new pair of key and value to the table in O(1) amortized
+    // moving it into the table.
+    // Does nothing if key already exists.
+    std::pair<iterator, bool> insert(std::pair<KeyType, ValueType>&& item) {
+        auto res = find_or_prepare_insert(item.first);
+        if (res.second) {
+            construct(res.first, std::move(item));
+        }
+        return { iterator_at(res.first), res.second };
+    }
+
+    // Constructs a pair from the arguments and moves it
+    // into the table in O(1) amortized.
+    // Does nothing if key already exists.
+    template<class... Args>
+    std::pair<iterator, bool> emplace(Args&&... args) {
+        return insert(
+            std::pair<KeyType, ValueType>(std::forward<Args>(args)...));
+    }
+
+    // Adds a value constructed in place from the arguments with the given
+    // key in O(1) amortized.
+    // Does nothing and doesn't touch the arguments if key already exists.
+    template<class K, class... Args>
+    std::pair<iterator, bool> try_emplace(K&& key, Args&&... args) {
+        auto res = find_or_prepare_insert(key);
+        if (res.second) {
+            construct(res.first, std::piecewise_construct,
+                std::forward_as_tuple(std::forward<K>(key)),
+                std::forward_as_tuple(std::forward<Args>(args)...));
+        }
+        return { iterator_at(res.first), res.second };
+    }
+
+    // Adds a new pair or assigns the value
+    // if key already exists in O(1) amortized.
+    // Returns iterator to the element and true if the pair was inserted.
+    template<class K, class M>
+    std::pair<iterator, bool> insert_or_assign(K&& key, M&& obj) {
+        auto res = find_or_prepare_insert(key);
+        if (res.second) {
+            construct(res.first, std::forward<K>(key), std::forward<M>(obj));
+        } else {
+            slots[res.first].value.second = std::forward<M>(obj);
+        }
+        return { iterator_at(res.first), res.second };
+    }
+
+    // Delete an element with the given key in O(1) amortized.
+    // Does nothing if key doesn't exist in table.
+    // Returns number of deleted elements.
+    size_t erase(const KeyType& key) {
+        size_t idx = find_index(key);
+        if (idx == capacity) {
+            return 0;
+        }
+        slots[idx].value.~pair();
+        release(idx);
+        return 1;
+    }
+
+    // Returns amount of elements in table in O(1).
+    size_t size() const {
+        return sz;
+    }
+
+    // Returns true if there are no elements in table in O(1).
+    bool empty() const {
+        return sz == 0;
+    }
+
+    // Returns hash function of table in O(1).
+    Hash hash_function() const {
+        return hasher;
+    }
+
+    // Returns key comparator of table in O(1).
+    KeyEqual key_eq() const {
+        return key_equal;
+    }
+
+    // Returns allocator of table in O(1).
+    Allocator get_allocator() const {
+        return Allocator(alloc);
+    }
+
+    // Returns number of slots in O(1).
+    size_t bucket_count() const {
+        return capacity;
+    }
+
+    // Makes the table hold count elements without rehashing, rehashes it
+    // in O(size) time if it's not large enough yet.
+    void reserve(size_t count) {
+        size_t new_capacity = capacity_for(count);
+        if (new_capacity > capacity) {
+            resize(new_capacity);
+        }
+    }
+
+    // Rehashes the table with at least count slots and enough of them
+    // to hold all elements in O(size) time. Drops all deleted slots.
+    void rehash(size_t count) {
+        resize(std::max(capacity_for_buckets(count), capacity_for(sz)));
+    }
+
+    // Returns reference to an object with the given key
+    // in O(1) amortized time.
+    // If key doesn't exist adds a new pair and
+    // retuns reference to it.
+    ValueType& operator[](const KeyType& key) {
+        auto res = find_or_prepare_insert(key);
+        if (res.second) {
+            construct(res.first, key, ValueType());
+        }
+        return slots[res.first].value.second;
+    }
+
+    // Returns reference to an object with the given key
+    // in O(1) amortized time.
+    // If key doesn't exist throws an exception.
+    const ValueType& at(const KeyType& key) const {
+        size_t idx = find_index(key);
+        if (idx == capacity) {
+            throw std::out_of_range("out of range");
+        }
+        return slots[idx].value.second;
+    }
+
+    // Returns iterator to the first element in O(1) amortized.
+    iterator begin() {
+        return iterator(0, this);
+    }
+
+    // Returns iterator to the end of the table in O(1).
+    iterator end() {
+        return iterator(capacity, this);
+    }
+
+    // Returns const_iterator to the first element in O(1) amortized.
+    const_iterator begin() const {
+        return const_iterator(0, this);
+    }
+
+    // Returns const_iterator to the end of the table in O(1).
+    const_iterator end() const {
+        return const_iterator(capacity, this);
+    }
+
+    // Returns iterator to the pair with the given key
+    // or end() if key doesn't exist in O(1) amortized.
+    iterator find(const KeyType& key) {
+        return iterator(find_index(key), this);
+    }
+
+    // Returns const_iterator to the pair with the given key
+    // or end() if key doesn't exist in O(1) amortized.
+    const_iterator find(const KeyType& key) const {
+        return const_iterator(find_index(key), this);
+    }
+
+ private:
+    // Set of slots in a group selected by a compare.
+    // Every slot takes mask_shift bits, only the top one may be set.
+    class bit_mask {
+     public:
+#if !defined(__SSE2__) && defined(__ARM_NEON)
+        constexpr static int mask_shift = 2;
+#else
+        constexpr static int mask_shift = 0;
+#endif
+
+        explicit bit_mask(uint64_t bits_) : bits(bits_) {}
+
+        explicit operator bool() const {
+            return bits != 0;
+        }
+
+        // Returns index of the first selected slot in the group.
+        size_t lowest() const {
+            return size_t(__builtin_ctzll(bits)) >> mask_shift;
+        }
+
+        // Removes the first selected slot from the set.
+        void next() {
+            bits &= bits - 1;
+        }
+
+        // Removes the first count slots of the group from the set.
+        void skip(size_t count) {
+            bits &= ~uint64_t(0) << (count << mask_shift);
+        }
+
+     private:
+        uint64_t bits;
+    };
+
+    // Control bytes of group_width consecutive slots.
+    class group {
+     public:
+#if defined(__SSE2__)
+        explicit group(const ctrl_t* pos) :
+            data(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pos))) {}
+
+        // Returns slots whose hash fragment equals h2.
+        bit_mask match(ctrl_t h2) const {
+            return bit_mask(uint32_t(_mm_movemask_epi8(
+                _mm_cmpeq_epi8(_mm_set1_epi8(h2), data))));
+        }
+
+        // Returns empty slots.
+        bit_mask match_empty() const {
+            return match(ctrl_empty);
+        }
+
+        // Returns empty and deleted slots, they are the negative ones.
+        bit_mask match_empty_or_deleted() const {
+            return bit_mask(uint32_t(_mm_movemask_epi8(data)));
+        }
+
+        // Returns full slots, they are the non-negative ones.
+        bit_mask match_full() const {
+            return bit_mask(uint32_t(_mm_movemask_epi8(data)) ^ 0xFFFF);
+        }
+
+     private:
+        __m128i data;
+#elif defined(__ARM_NEON)
+        explicit group(const ctrl_t* pos) : data(vld1q_s8(pos)) {}
+
+        // Returns slots whose hash fragment equals h2.
+        bit_mask match(ctrl_t h2) const {
+            return to_mask(vceqq_s8(vdupq_n_s8(h2), data));
+        }
+
+        // Returns empty slots.
+        bit_mask match_empty() const {
+            return match(ctrl_empty);
+        }
+
+        // Returns empty and deleted slots, they are the negative ones.
+        bit_mask match_empty_or_deleted() const {
+            return to_mask(vcltq_s8(data, vdupq_n_s8(0)));
+        }
+
+        // Returns full slots, they are the non-negative ones.
+        bit_mask match_full() const {
+            return to_mask(vcgeq_s8(data, vdupq_n_s8(0)));
+        }
+
+     private:
+        int8x16_t data;
+
+        // Narrows a byte-per-slot compare result to 4 bits per slot.
+        static bit_mask to_mask(uint8x16_t cmp) {
+            uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(
+                vshrn_n_u16(vreinterpretq_u16_u8(cmp), 4)), 0);
+            return bit_mask(bits & 0x8888888888888888ull);
+        }
+#else
+        explicit group(const ctrl_t* pos) : data(pos) {}
+
+        // Returns slots whose hash fragment equals h2.
+        bit_mask match(ctrl_t h2) const {
+            uint64_t bits = 0;
+            for (size_t i = 0; i < group_width; ++i) {
+                bits |= uint64_t(data[i] == h2) << i;
+            }
+            return bit_mask(bits);
+        }
+
+        // Returns empty slots.
+        bit_mask match_empty() const {
+            return match(ctrl_empty);
+        }
+
+        // Returns empty and deleted slots, they are the negative ones.
+        bit_mask match_empty_or_deleted() const {
+            uint64_t bits = 0;
+            for (size_t i = 0; i < group_width; ++i) {
+                bits |= uint64_t(data[i] < 0) << i;
+            }
+            return bit_mask(bits);
+        }
+
+        // Returns full slots, they are the non-negative ones.
+        bit_mask match_full() const {
+            uint64_t bits = 0;
+            for (size_t i = 0; i < group_width; ++i) {
+                bits |= uint64_t(data[i] >= 0) << i;
+            }
+            return bit_mask(bits);
+        }
+
+     private:
+        const ctrl_t* data;
+#endif
+    };
+
+    Hash hasher;
+    KeyEqual key_equal;
+    slot_allocator alloc;
+    // capacity - number of slots, a power of two not less than group_width,
+    // or 0 for a moved-from table, which gets slots on the first insert.
+    // growth_left - number of empty slots that may still be filled
+    // before the table has to be rehashed.
+    size_t sz, capacity, growth_left;
+    ctrl_type ctrl;
+    slot_type* slots;
+
+    // Returns iterator to the slot with the given index in O(1).
+    iterator iterator_at(size_t idx) {
+        return iterator(idx, this);
+    }
+
+    // Returns index of the first full slot from pos on or capacity
+    // if there is none in O(1 + distance / group_width), skipping
+    // a group without full slots with one compare.
+    size_t next_full(size_t pos) const {
+        while (pos < capacity) {
+            size_t start = pos - pos % group_width;
+            bit_mask m = group(&ctrl[start]).match_full();
+            m.skip(pos - start);
+            if (m) {
+                return start + m.lowest();
+            }
+            pos = start + group_width;
+        }
+        return capacity;
+    }
+
+    // Returns hash of the key with bits mixed, so that both
+    // the group index and the 7-bit fragment depend on all of them.
+    size_t hash_of(const KeyType& key) const {
+        return FibonacciHashMixer()(hasher(key));
+    }
+
+    // Returns index of the slot with the given key
+    // or capacity if key doesn't exist in O(1) amortized.
+    size_t find_index(const KeyType& key) const {
+        size_t hash = hash_of(key);
+        ctrl_t h2 = ctrl_t(hash & 0x7F);
+        size_t group_mask = capacity / group_width - 1;
+        size_t pos = (hash >> 7) & group_mask;
+        // Triangular steps visit every group once.
+        for (size_t step = 1; step <= group_mask + 1; ++step) {
+            group grp(&ctrl[pos * group_width]);
+            for (bit_mask m = grp.match(h2); m; m.next()) {
+                size_t idx = pos * group_width + m.lowest();
+                if (key_equal(slots[idx].value.first, key)) {
+                    return idx;
+                }
+            }
+            if (grp.match_empty()) {
+                break;
+            }
+            pos = (pos + step) & group_mask;
+        }
+        return capacity;
+    }
+
+    // Returns index of the slot with the given key and false if it exists.
+    // Otherwise marks a free slot as full and returns its index and true,
+    // caller has to put an element there with construct().
+    std::pair<size_t, bool> find_or_prepare_insert(const KeyType& key) {
+        size_t idx = find_index(key);
+        if (idx != capacity) {
+            return { idx, false };
+        }
+        if (growth_left == 0) {
+            rehash_and_grow();
+        }
+        return { prepare_insert(hash_of(key)), true };
+    }
+
+    // Returns index of the first free slot in the probe sequence
+    // of the hash in control bytes of the given capacity in O(1) amortized.
+    static size_t find_free(const ctrl_type& ctrl_,
+        size_t capacity_, size_t hash) {
+        size_t group_mask = capacity_ / group_width - 1;
+        size_t pos = (hash >> 7) & group_mask;
+        for (size_t step = 1; ; ++step) {
+            bit_mask m =
+                group(&ctrl_[pos * group_width]).match_empty_or_deleted();
+            if (m) {
+                return pos * group_width + m.lowest();
+            }
+            pos = (pos + step) & group_mask;
+        }
+    }
+
+    // Marks the first free slot in the probe sequence of the hash as full
+    // and returns its index in O(1) amortized.
+    size_t prepare_insert(size_t hash) {
+        size_t idx = find_free(ctrl, capacity, hash);
+        if (ctrl[idx] == ctrl_empty) {
+            --growth_left;
+        }
+        ctrl[idx] = ctrl_t(hash & 0x7F);
+        ++sz;
+        return idx;
+    }
+
+    // Constructs an element from the arguments in the slot marked full
+    // by prepare_insert(). If constructing throws, the slot is given up,
+    // so the table is left without the element.
+    template<class... Args>
+    void construct(size_t idx, Args&&... args) {
+        try {
+            new (&slots[idx].mutable_value)
+                std::pair<KeyType, ValueType>(std::forward<Args>(args)...);
+        } catch (...) {
+            release(idx);
+            throw;
+        }
+    }
+
+    // Frees a full slot whose element is destroyed or wasn't constructed
+    // in O(1). A probe only stops in a group with an empty slot, so a group
+    // that still has one was never passed and needs no tombstone.
+    void release(size_t idx) {
+        --sz;
+        if (group(&ctrl[idx - idx % group_width]).match_empty()) {
+            ctrl[idx] = ctrl_empty;
+            ++growth_left;
+        } else {
+            ctrl[idx] = ctrl_deleted;
+        }
+    }
+
+    // Returns number of slots that may be full or deleted
+    // in a table with the given capacity.
+    static size_t max_load(size_t capacity_) {
+        return capacity_ / max_load_denominator * max_load_numerator;
+    }
+
+    // Returns the smallest capacity that holds count elements
+    // without rehashing.
+    static size_t capacity_for(size_t count) {
+        size_t res = default_size;
+        while (max_load(res) < count) {
+            res *= 2;
+        }
+        return res;
+    }
+
+    // Returns the smallest valid capacity not less than count.
+    static size_t capacity_for_buckets(size_t count) {
+        size_t res = default_size;
+        while (res < count) {
+            res *= 2;
+        }
+        return res;
+    }
+
+    // Reserves space for elements in range for forward iterators.
+    template<typename It>
+    void reserve_for(It begin, It end, std::forward_iterator_tag) {
+        reserve(size_t(std::distance(begin, end)));
+    }
+
+    // Input iterators can be passed only once, so nothing is reserved.
+    template<typename It>
+    void reserve_for(It, It, std::input_iterator_tag) {}
+
+    // Allocates an empty table with the given capacity.
+    void init(size_t capacity_) {
+        ctrl.assign(capacity_, ctrl_empty);
+        slots = slot_traits::allocate(alloc, capacity_);
+        sz = 0;
+        capacity = capacity_;
+        growth_left = max_load(capacity);
+    }
+
+    // Destroys all elements and frees the slots in O(capacity), leaving
+    // the table without slots. Destroying a destroyed table does nothing.
+    void destroy() {
+        for (size_t i = 0; i < capacity; ++i) {
+            if (ctrl[i] >= 0) {
+                slots[i].value.~pair();
+            }
+        }
+        if (slots != nullptr) {
+            slot_traits::deallocate(alloc, slots, capacity);
+            slots = nullptr;
+        }
+        sz = 0;
+        capacity = 0;
+        growth_left = 0;
+        ctrl_type(ctrl.get_allocator()).swap(ctrl);
+    }
+
+    // Rehashes a table that has no empty slots left in O(size) time.
+    // Keeps the size if it's enough to drop deleted slots,
+    // otherwise doubles it.
+    void rehash_and_grow() {
+        if (capacity == 0) {
+            resize(default_size);
+        } else if (sz >= max_load(capacity) / 2) {
+            resize(capacity * 2);
+        } else {
+            resize(capacity);
+        }
+    }
+
+    // Moves all elements to a new buffer of the given capacity
+    // in O(size) time. Elements are copied unless their moves are
+    // noexcept, and a slot of the new buffer is marked full only once its
+    // element is constructed. The new buffer replaces the current one
+    // when it holds all elements, so if allocating, hashing or copying
+    // throws the table is left unchanged.
+    void resize(size_t new_capacity) {
+        ctrl_type next_ctrl(new_capacity, ctrl_empty, ctrl.get_allocator());
+        slot_type* next_slots = slot_traits::allocate(alloc, new_capacity);
+        try {
+            for (size_t i = 0; i < capacity; ++i) {
+                if (ctrl[i] >= 0) {
+                    size_t hash = hash_of(slots[i].value.first);
+                    size_t idx = find_free(next_ctrl, new_capacity, hash);
+                    new (&next_slots[idx].mutable_value)
+                        std::pair<KeyType, ValueType>(std::move_if_noexcept(
+                        slots[i].mutable_value));
+                    next_ctrl[idx] = ctrl_t(hash & 0x7F);
+                }
+            }
+        } catch (...) {
+            for (size_t i = 0; i < new_capacity; ++i) {
+                if (next_ctrl[i] >= 0) {
+                    next_slots[i].value.~pair();
+                }
+            }
+            slot_traits::deallocate(alloc, next_slots, new_capacity);
+            throw;
+        }
+        size_t count = sz;
+        destroy();
+        ctrl.swap(next_ctrl);
+        slots = next_slots;
+        sz = count;
+        capacity = new_capacity;
+        growth_left = max_load(capacity) - sz;
+    }
+
+    // Takes slots of other table, this one must be destroyed
+    // and have an equal allocator. Leaves other table empty without slots
+    // in O(1): its lookups find nothing and the first insert allocates
+    // slots.
+    void take(SwissHashMap& oth) {
+        sz = oth.sz;
+        capacity = oth.capacity;
+        growth_left = oth.growth_left;
+        ctrl.swap(oth.ctrl);
+        slots = oth.slots;
+        oth.sz = 0;
+        oth.capacity = 0;
+        oth.growth_left = 0;
+        oth.slots = nullptr;
+    }
+
+    // Replaces allocator of a destroyed table and of its control bytes
+    // if the allocator propagates on assignment.
+    void propagate_allocator(const slot_allocator& alloc_, std::true_type) {
+        alloc = alloc_;
+        ctrl = ctrl_type(alloc);
+    }
+
+    void propagate_allocator(const slot_allocator&, std::false_type) {}
+
+    // Swaps allocators of two tables if the allocator propagates on swap.
+    void swap_allocator(SwissHashMap& oth, std::true_type) {
+        std::swap(alloc, oth.alloc);
+    }
+
+    void swap_allocator(SwissHashMap&, std::false_type) {}
+};
+
+// Pool of memory for objects of type T of one table. Memory is taken from
+// the allocator in chunks whose sizes double up to max_chunk_size objects,
+// and a freed block is kept in a list for the next allocation, so nodes
+// cost one allocation per chunk and are freed together with the pool.
+template<class T, class Allocator>
+class HashMapNodePool {
+    union block {
+        block* next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    struct chunk {
+        block* blocks;
+        size_t count;
+    };
+
+    using block_allocator = typename std::allocator_traits<Allocator>::
+        template rebind_alloc<block>;
+    using block_traits = std::allocator_traits<block_allocator>;
+    using chunk_allocator = typename std::allocator_traits<Allocator>::
+        template rebind_alloc<chunk>;
+
+ public:
+    constexpr static size_t first_chunk_size = 16;
+    constexpr static size_t max_chunk_size = 4096;
+
+    explicit HashMapNodePool(const Allocator& alloc_) : alloc(alloc_),
+        chunks(chunk_allocator(alloc_)), free_blocks(nullptr),
+        next_chunk_size(first_chunk_size) {}
+
+    HashMapNodePool(const HashMapNodePool&) = delete;
+    HashMapNodePool& operator=(const HashMapNodePool&) = delete;
+
+    ~HashMapNodePool() {
+        release();
+    }
+
+    // Returns memory for one object in O(1) amortized.
+    T* allocate() {
+        if (free_blocks == nullptr) {
+            add_chunk();
+        }
+        block* res = free_blocks;
+        free_blocks = res->next;
+        return reinterpret_cast<T*>(res->storage);
+    }
+
+    // Keeps memory of an object, which must be destroyed, for the next
+    // allocation in O(1).
+    void deallocate(T* ptr) {
+        block* res = reinterpret_cast<block*>(ptr);
+        res->next = free_blocks;
+        free_blocks = res;
+    }
+
+    // Frees all chunks in O(number of chunks), objects must be destroyed.
+    void release() {
+        for (const chunk& it : chunks) {
+            block_traits::deallocate(alloc, it.blocks, it.count);
+        }
+        chunks.clear();
+        free_blocks = nullptr;
+        next_chunk_size = first_chunk_size;
+    }
+
+    // Swaps memory and allocators of two pools in O(1).
+    void swap(HashMapNodePool& oth) {
+        std::swap(alloc, oth.alloc);
+        chunks.swap(oth.chunks);
+        std::swap(free_blocks, oth.free_blocks);
+        std::swap(next_chunk_size, oth.next_chunk_size);
+    }
+
+ private:
+    block_allocator alloc;
+    std::vector<chunk, chunk_allocator> chunks;
+    block* free_blocks;
+    size_t next_chunk_size;
+
+    // Allocates the next chunk and adds its blocks to the free ones
+    // in O(chunk size).
+    void add_chunk() {
+        chunks.reserve(chunks.size() + 1);
+        size_t count = next_chunk_size;
+        block* blocks = block_traits::allocate(alloc, count);
+        chunks.push_back(chunk{ blocks, count });
+        for (size_t i = count; i > 0; --i) {
+            blocks[i - 1].next = free_blocks;
+            free_blocks = &blocks[i - 1];
+        }
+        next_chunk_size = std::min(next_chunk_size * 2, max_chunk_size);
+    }
+};
+
+// Hash table keeping every element in its own node, taken from a pool of
+// the table, while a slot holds only the hash of the key and a pointer to
+// the node. Slots take 16 bytes whatever the size of elements is, so
+// resizes move only them and never call the hash function, and empty
+// slots take no memory for elements. References and pointers to elements
+// stay valid until they are erased, across inserts and resizes.
+// Probing is linear and erase shifts the following elements back, see
+// DefaultHashMapPolicy::backward_shift_erase. Sizes, loads, the mixer and
+// auto_shrink are taken from the policy, its other options don't apply.
+// Has the same interface as HashMap, except the batched, node, merge and
+// snapshot operations.
+template<class KeyType, class ValueType, class Hash = std::hash<KeyType>,
+    class KeyEqual = std::equal_to<KeyType>,
+    class Allocator = std::allocator<std::pair<const KeyType, ValueType>>,
+    class Policy = DefaultHashMapPolicy>
+class NodeHashMap {
+    using element_type = MapSlot<KeyType, ValueType>;
+
+    // Slot of the table: hash_of the key of the element and its node,
+    // which is nullptr in an empty slot.
+    struct slot_type {
+        size_t hash;
+        element_type* element;
+    };
+
+    using slot_allocator = typename std::allocator_traits<Allocator>::
+        template rebind_alloc<slot_type>;
+    using slot_traits = std::allocator_traits<slot_allocator>;
+    using pool_type = HashMapNodePool<element_type, Allocator>;
+    template<class K>
+    using key_arg = typename HashMapKeyArg<IsTransparent<Hash>::value &&
+        IsTransparent<KeyEqual>::value>::template type<K, KeyType>;
+
+    static_assert(Policy::default_size >= 2 &&
+        (Policy::default_size & (Policy::default_size - 1)) == 0 &&
+        Policy::increasing_size >= 2 &&
+        (Policy::increasing_size & (Policy::increasing_size - 1)) == 0 &&
+        Policy::decreasing_size >= 2 &&
+        (Policy::decreasing_size & (Policy::decreasing_size - 1)) == 0,
+        "table sizes must be powers of two");
+    static_assert(Policy::max_load_numerator > 0 &&
+        Policy::max_load_numerator < Policy::max_load_denominator,
+        "a table must always have an empty position");
+    static_assert(Policy::min_load_numerator * Policy::decreasing_size *
+        Policy::max_load_denominator < Policy::max_load_numerator *
+        Policy::min_load_denominator,
+        "a shrunk table mustn't be overloaded");
+
+ public:
+    using key_type = KeyType;
+    using mapped_type = ValueType;
+    using value_type = std::pair<const KeyType, ValueType>;
+    using size_type = size_t;
+    using difference_type = std::ptrdiff_t;
+    using reference = value_type&;
+    using const_reference = const value_type&;
+    using allocator_type = Allocator;
+
+    // Sizes of the policy, see DefaultHashMapPolicy.
+    constexpr static size_t default_size = Policy::default_size;
+    constexpr static size_t decreasing_size = Policy::decreasing_size;
+    constexpr static size_t increasing_size = Policy::increasing_size;
+
+    class const_iterator;
+
+    // Iterator allows to iterate over elements in table and work with them.
+    class iterator {
+     public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::pair<const KeyType, ValueType>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = value_type*;
+        using reference = value_type&;
+
+        // Default constructor.
+        iterator() : pos(0), table(nullptr) {}
+
+        // Constructor with the given position.
+        iterator(size_t pos_, NodeHashMap* table_) :
+            pos(pos_), table(table_) {
+            go();
+        }
+
+        // Pre-increment iterator in O(1) amortized.
+        iterator& operator++() {
+            ++pos;
+            go();
+            return (*this);
+        }
+
+        // Post-increment iterator in O(1) amortized.
+        iterator operator++(int) {
+            iterator res = *this;
+            ++pos;
+            go();
+            return res;
+        }
+
+        // Return true if iterators are the same in O(1).
+        bool operator==(const iterator& oth) const {
+            return pos == oth.pos && table == oth.table;
+        }
+
+        // Return true if iterators are different in O(1).
+        bool operator!=(const iterator& oth) const {
+            return !((*this) == oth);
+        }
+
+        // Returns item reference in O(1) time.
+        pointer operator->() const {
+            return &table->slots[pos].element->value;
+        }
+
+        // Returns item reference in O(1) time.
+        reference operator*() const {
+            return table->slots[pos].element->value;
+        }
+
+     private:
+        friend class const_iterator;
+
+        size_t pos;
+        NodeHashMap* table;
+
+        // Finds the next element in O(1) amortized.
+        void go() {
+            while (pos < table->buffer_size &&
+                table->slots[pos].element == nullptr) {
+                ++pos;
+            }
+        }
+    };
+
+    // Const iterator allows to iterate over the elements in table and get
+    // their values but doesn't allow to change them.
+    class const_iterator {
+     public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::pair<const KeyType, ValueType>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const value_type*;
+        using reference = const value_type&;
+
+        // Default constructor.
+        const_iterator() : pos(0), table(nullptr) {}
+
+        // Constructor with the given position.
+        const_iterator(size_t pos_, const NodeHashMap* table_) :
+            pos(pos_), table(table_) {
+            go();
+        }
+
+        // Converts iterator to const_iterator in O(1).
+        const_iterator(const iterator& oth) : pos(oth.pos), table(oth.table) {}
+
+        // Pre-increment iterator in O(1) amortized.
+        const_iterator& operator++() {
+            ++pos;
+            go();
+            return (*this);
+        }
+
+        // Post-increment iterator in O(1) amortized.
+        const_iterator operator++(int) {
+            const_iterator res = *this;
+            ++pos;
+            go();
+            return res;
+        }
+
+        // Return true if iterators are the same in O(1).
+        bool operator==(const const_iterator& oth) const {
+            return pos == oth.pos && table == oth.table;
+        }
+
+        // Return true if iterators are different in O(1).
+        bool operator!=(const const_iterator& oth) const {
+            return !((*this) == oth);
+        }
+
+        // Returns constant item reference in O(1) time.
+        pointer operator->() const {
+            return &table->slots[pos].element->value;
+        }
+
+        // Returns constant item reference in O(1) time.
+        reference operator*() const {
+            return table->slots[pos].element->value;
+        }
+
+     private:
+        size_t pos;
+        const NodeHashMap* table;
+
+        // Finds the next element in O(1) amortized.
+        void go() {
+            while (pos < table->buffer_size &&
+                table->slots[pos].element == nullptr) {
+                ++pos;
+            }
+        }
+    };
+
+    // Default constructor with given hash function, key comparator
+    // and allocator.
+    NodeHashMap(Hash hasher_ = Hash(), KeyEqual key_equal_ = KeyEqual(),
+        const Allocator& alloc_ = Allocator()) :
+        hasher(hasher_), key_equal(key_equal_), alloc(alloc_), pool(alloc_) {
+        init(default_size);
+    }
+
+    // Constructor with given allocator.
+    explicit NodeHashMap(const Allocator& alloc_) :
+        NodeHashMap(Hash(), KeyEqual(), alloc_) {}
+
+    // Constructor for initializer list with given hash function,
+    // key comparator and allocator.
+    NodeHashMap(std::initializer_list<std::pair<KeyType, ValueType>> list,
+        Hash hasher_ = Hash(), KeyEqual key_equal_ = KeyEqual(),
+        const Allocator& alloc_ = Allocator()) :
+        NodeHashMap(list.begin(), list.end(), hasher_, key_equal_, alloc_) {}
+
+    // Constructor for given begin and end iterator.
+    // Reserves space for all elements at once for forward iterators.
+    template<typename It>
+    NodeHashMap(It begin, It end, Hash hasher_ = Hash(),
+        KeyEqual key_equal_ = KeyEqual(),
+        const Allocator& alloc_ = Allocator()) :
+        NodeHashMap(hasher_, key_equal_, alloc_) {
+        reserve_for(begin, end,
+            typename std::iterator_traits<It>::iterator_category());
+        while (begin != end) {
+            insert(*begin);
+            ++begin;
+        }
+    }
+
+    // Copy constructor, keeps positions of elements in O(buffer_size).
+    NodeHashMap(const NodeHashMap& oth) : NodeHashMap(oth,
+        std::allocator_traits<Allocator>::
+        select_on_container_copy_construction(oth.get_allocator())) {}
+
+    // Copy constructor with given allocator.
+    NodeHashMap(const NodeHashMap& oth, const Allocator& alloc_) :
+        hasher(oth.hasher), key_equal(oth.key_equal), alloc(alloc_),
+        pool(alloc_) {
+        init(oth.buffer_size);
+        try {
+            for (size_t i = 0; i < buffer_size; ++i) {
+                if (oth.slots[i].element != nullptr) {
+                    slots[i].hash = oth.slots[i].hash;
+                    slots[i].element =
+                        make_element(oth.slots[i].element->value);
+                    ++sz;
+                }
+            }
+        } catch (...) {
+            destroy();
+            throw;
+        }
+    }
+
+    // Move constructor, takes slots and nodes of other table in O(1)
+    // and leaves it empty without slots, see take(). Nothing is allocated,
+    // so it doesn't throw unless copying the hash function or the key
+    // comparator does.
+    NodeHashMap(NodeHashMap&& oth) noexcept(
+        std::is_nothrow_copy_constructible<Hash>::value &&
+        std::is_nothrow_copy_constructible<KeyEqual>::value) :
+        hasher(oth.hasher), key_equal(oth.key_equal), alloc(oth.alloc),
+        pool(oth.get_allocator()), slots(nullptr), sz(0), buffer_size(0) {
+        update_limits();
+        take(oth);
+    }
+
+    // Copies other table, the allocator is replaced only if it propagates
+    // on copy assignment.
+    NodeHashMap& operator=(const NodeHashMap& oth) {
+        if (&oth != this) {
+            NodeHashMap copy(oth, std::allocator_traits<Allocator>::
+                propagate_on_container_copy_assignment::value ?
+                oth.get_allocator() : get_allocator());
+            swap(copy);
+        }
+        return (*this);
+    }
+
+    // Takes slots and nodes of other table in O(1), leaves other table
+    // empty. If allocators aren't equal and
+    // propagate_on_container_move_assignment isn't set, elements are moved
+    // one by one in O(size) time instead.
+    // Doesn't throw if the allocator propagates and copying the hash
+    // function and the key comparator doesn't.
+    NodeHashMap& operator=(NodeHashMap&& oth) noexcept(
+        std::allocator_traits<Allocator>::
+            propagate_on_container_move_assignment::value &&
+        std::is_nothrow_copy_assignable<Hash>::value &&
+        std::is_nothrow_copy_assignable<KeyEqual>::value) {
+        if (&oth != this) {
+            hasher = oth.hasher;
+            key_equal = oth.key_equal;
+            if (std::allocator_traits<Allocator>::
+                propagate_on_container_move_assignment::value ||
+                get_allocator() == oth.get_allocator()) {
+                destroy();
+                alloc = oth.alloc;
+                take(oth);
+            } else {
+                clear();
+                reserve(oth.sz);
+                for (size_t i = 0; i < oth.buffer_size; ++i) {
+                    if (oth.slots[i].element != nullptr) {
+                        insert(std::move(oth.slots[i].element->mutable_value));
+                    }
+                }
+                oth.clear();
+            }
+        }
+        return (*this);
+    }
+
+    ~NodeHashMap() {
+        destroy();
+    }
+
+    // Swaps contents of two tables in O(1), node pointers stay valid.
+    void swap(NodeHashMap& oth) {
+        std::swap(hasher, oth.hasher);
+        std::swap(key_equal, oth.key_equal);
+        std::swap(alloc, oth.alloc);
+        pool.swap(oth.pool);
+        std::swap(slots, oth.slots);
+        std::swap(sz, oth.sz);
+        std::swap(buffer_size, oth.buffer_size);
+        std::swap(max_live, oth.max_live);
+        std::swap(min_live, oth.min_live);
+    }
+
+    // Deletes all elements in table in O(size + buffer_size) keeping its
+    // slots and the nodes in the pool.
+    void clear() {
+        destroy_elements();
+        sz = 0;
+    }
+
+    // Rebuilds the table with the smallest size that holds all elements
+    // without growing in O(buffer_size) time, if it's larger than that.
+    void shrink_to_fit() {
+        size_t new_buffer_size = buffer_size_for(sz);
+        if (new_buffer_size < buffer_size) {
+            rebuild(new_buffer_size);
+        }
+    }
+
+    // Adds a new pair of key and value to the table in O(1) amortized.
+    // Does nothing if key already exists.
+    // Returns iterator to the element with the key
+    // and true if the pair was inserted.
+    std::pair<iterator, bool> insert(
+        const std::pair<KeyType, ValueType>& item) {
+        auto res = prepare_insert(item.first);
+        if (res.second) {
+            place(res.first, make_element(item));
+        }
+        return { iterator(res.first, this), res.second };
+    }
+
+    // Adds a new pair of key and value to the table in O(1) amortized
+    // moving it into the table.
+    // Does nothing if key already exists.
+    std::pair<iterator, bool> insert(std::pair<KeyType, ValueType>&& item) {
+        auto res = prepare_insert(item.first);
+        if (res.second) {
+            place(res.first, make_element(std::move(item)));
+        }
+        return { iterator(res.first, this), res.second };
+    }
+
+    // Constructs a pair from the arguments in a new node and adds it
+    // to the table in O(1) amortized, so the pair is never moved.
+    // Does nothing if key already exists, the node is freed then.
+    template<class... Args>
+    std::pair<iterator, bool> emplace(Args&&... args) {
+        element_type* element = make_element(std::forward<Args>(args)...);
+        std::pair<size_t, bool> res;
+        try {
+            res = prepare_insert(element->value.first);
+        } catch (...) {
+            drop(element);
+            throw;
+        }
+        if (res.second) {
+            place(res.first, element);
+        } else {
+            drop(element);
+        }
+        return { iterator(res.first, this), res.second };
+    }
+
+    // Adds a value constructed in place from the arguments with the given
+    // key in O(1) amortized.
+    // Does nothing and doesn't touch the arguments if key already exists.
+    template<class K, class... Args>
+    std::pair<iterator, bool> try_emplace(K&& key, Args&&... args) {
+        auto res = prepare_insert(
+            static_cast<const key_arg<typename std::decay<K>::type>&>(key));
+        if (res.second) {
+            place(res.first, make_element(std::piecewise_construct,
+                std::forward_as_tuple(std::forward<K>(key)),
+                std::forward_as_tuple(std::forward<Args>(args)...)));
+        }
+        return { iterator(res.first, this), res.second };
+    }
+
+    // Adds a new pair or assigns the value
+    // if key already exists in O(1) amortized.
+    // Returns iterator to the element and true if the pair was inserted.
+    template<class K, class M>
+    std::pair<iterator, bool> insert_or_assign(K&& key, M&& obj) {
+        auto res = prepare_insert(
+            static_cast<const key_arg<typename std::decay<K>::type>&>(key));
+        if (res.second) {
+            place(res.first,
+                make_element(std::forward<K>(key), std::forward<M>(obj)));
+        } else {
+            slots[res.first].element->value.second = std::forward<M>(obj);
+        }
+        return { iterator(res.first, this), res.second };
+    }
+
+    // Delete an element with the given key in O(1) amortized.
+    // Does nothing if key doesn't exist in table.
+    // Returns number of deleted elements.
+    // Doesn't throw unless hashing or comparing keys does, see shrink().
+    template<class K = KeyType>
+    size_t erase(const key_arg<K>& key) {
+        size_t pos = find_position(key);
+        if (pos == buffer_size) {
+            return 0;
+        }
+        drop(slots[pos].element);
+        --sz;
+        backward_shift(pos);
+        if (Policy::auto_shrink && buffer_size > default_size &&
+            sz < min_live) {
+            shrink();
+        }
+        return 1;
+    }
+
+    // Returns amount of elements in table in O(1).
+    size_t size() const {
+        return sz;
+    }
+
+    // Returns true if there are no elements in table in O(1).
+    bool empty() const {
+        return sz == 0;
+    }
+
+    // Returns hash function of table in O(1).
+    Hash hash_function() const {
+        return hasher;
+    }
+
+    // Returns key comparator of table in O(1).
+    KeyEqual key_eq() const {
+        return key_equal;
+    }
+
+    // Returns allocator of table in O(1).
+    Allocator get_allocator() const {
+        return Allocator(alloc);
+    }
+
+    // Returns current size of hash table in O(1).
+    size_t bucket_count() const {
+        return buffer_size;
+    }
+
+    // Returns average number of elements per bucket in O(1).
+    float load_factor() const {
+        return buffer_size == 0 ? 0.0f : float(sz) / float(buffer_size);
+    }
+
+    // Makes the table hold count elements without growing, rebuilds it
+    // in O(buffer_size) time if it's not large enough yet.
+    void reserve(size_t count) {
+        size_t new_buffer_size = buffer_size_for(count);
+        if (new_buffer_size > buffer_size) {
+            rebuild(new_buffer_size);
+        }
+    }
+
+    // Rebuilds the table with at least count buckets and enough of them
+    // to hold all elements in O(buffer_size) time.
+    void rehash(size_t count) {
+        size_t new_buffer_size = default_size;
+        while (new_buffer_size < count) {
+            new_buffer_size *= increasing_size;
+        }
+        rebuild(std::max(new_buffer_size, buffer_size_for(sz)));
+    }
+
+    // Returns reference to an object with the given key
+    // in O(1) amortized time.
+    // If key doesn't exist adds a new pair and
+    // retuns reference to it.
+    // Key is converted to KeyType only if it has to be inserted.
+    template<class K = KeyType>
+    ValueType& operator[](const key_arg<K>& key) {
+        return try_emplace(key).first->second;
+    }
+
+    // Same as operator[] above, moves the key into the table
+    // if it doesn't exist.
+    template<class K = KeyType>
+    ValueType& operator[](key_arg<K>&& key) {
+        return try_emplace(std::move(key)).first->second;
+    }
+
+    // Returns reference to an object with the given key
+    // in O(1) amortized time.
+    // If key doesn't exist throws an exception.
+    template<class K = KeyType>
+    const ValueType& at(const key_arg<K>& key) const {
+        size_t pos = find_position(key);
+        if (pos == buffer_size) {
+            throw std::out_of_range("out of range");
+        }
+        return slots[pos].element->value.second;
+    }
+
+    // Returns iterator to the first element in O(1) amortized.
+    iterator begin() {
+        return iterator(0, this);
+    }
+
+    // Returns iterator to the end of the table in O(1).
+    iterator end() {
+        return iterator(buffer_size, this);
+    }
+
+    // Returns const_iterator to the first element in O(1) amortized.
+    const_iterator begin() const {
+        return const_iterator(0, this);
+    }
+
+    // Returns const_iterator to the end of the table in O(1).
+    const_iterator end() const {
+        return const_iterator(buffer_size, this);
+    }
+
+    // Returns iterator to the pair with the given key
+    // or end() if key doesn't exist in O(1) amortized.
+    template<class K = KeyType>
+    iterator find(const key_arg<K>& key) {
+        return iterator(find_position(key), this);
+    }
+
+    // Returns const_iterator to the pair with the given key
+    // or end() if key doesn't exist in O(1) amortized.
+    template<class K = KeyType>
+    const_iterator find(const key_arg<K>& key) const {
+        return const_iterator(find_position(key), this);
+    }
+
+ private:
+    Hash hasher;
+    KeyEqual key_equal;
+    // alloc - allocator of slots, pool - of nodes.
+    slot_allocator alloc;
+    pool_type pool;
+    slot_type* slots;
+    // max_live, min_live - numbers of elements the table grows
+    // and shrinks at.
+    size_t sz, buffer_size, max_live, min_live;
+
+    // Returns hash of the key passed through the mixer of the policy in O(1).
+    template<class K>
+    size_t hash_of(const K& key) const {
+        return typename Policy::mixer()(hasher(key));
+    }
+
+    // Returns position of the element with the given key
+    // or buffer_size if key doesn't exist in O(1) amortized.
+    // Keys are compared only when their hashes are equal.
+    template<class K>
+    size_t find_position(const K& key) const {
+        // A moved-from table has no slots and holds nothing.
+        if (buffer_size == 0) {
+            return buffer_size;
+        }
+        size_t key_hash = hash_of(key);
+        size_t mask = buffer_size - 1;
+        for (size_t pos = key_hash & mask; slots[pos].element != nullptr;
+            pos = (pos + 1) & mask) {
+            if (slots[pos].hash == key_hash &&
+                key_equal(slots[pos].element->value.first, key)) {
+                return pos;
+            }
+        }
+        return buffer_size;
+    }
+
+    // Finds a position for an element with the given key in O(1) amortized.
+    // Returns the position and false if key already exists. Otherwise grows
+    // the table if it's full, sets the hash of the first empty position
+    // and returns it and true, caller has to place a node there with
+    // place(), the position stays empty until then.
+    template<class K>
+    std::pair<size_t, bool> prepare_insert(const K& key) {
+        size_t pos = find_position(key);
+        if (pos != buffer_size) {
+            return { pos, false };
+        }
+        if (sz >= max_live) {
+            // A moved-from table gets its slots on the first insert.
+            rebuild(buffer_size == 0 ? default_size
+                : buffer_size * increasing_size);
+        }
+        size_t key_hash = hash_of(key);
+        size_t mask = buffer_size - 1;
+        pos = key_hash & mask;
+        while (slots[pos].element != nullptr) {
+            pos = (pos + 1) & mask;
+        }
+        slots[pos].hash = key_hash;
+        return { pos, true };
+    }
+
+    // Puts the node into the position returned by prepare_insert() in O(1).
+    void place(size_t pos, element_type* element) {
+        slots[pos].element = element;
+        ++sz;
+    }
+
+    // Returns a node from the pool with the element constructed from the
+    // arguments in O(1) amortized. If constructing throws, the node is
+    // returned to the pool.
+    template<class... Args>
+    element_type* make_element(Args&&... args) {
+        element_type* res = pool.allocate();
+        try {
+            new (&res->mutable_value)
+                std::pair<KeyType, ValueType>(std::forward<Args>(args)...);
+        } catch (...) {
+            pool.deallocate(res);
+            throw;
+        }
+        return res;
+    }
+
+    // Destroys the element and returns its node to the pool in O(1).
+    void drop(element_type* element) {
+        element->value.~pair();
+        pool.deallocate(element);
+    }
+
+    // Fills the hole left by an erased element with the following elements
+    // of its cluster that may be moved there, then marks the last hole
+    // empty in O(1) amortized. Only slots are moved.
+    void backward_shift(size_t hole) {
+        size_t mask = buffer_size - 1;
+        for (size_t pos = (hole + 1) & mask; slots[pos].element != nullptr;
+            pos = (pos + 1) & mask) {
+            size_t start = slots[pos].hash & mask;
+            if (((pos - start) & mask) >= ((pos - hole) & mask)) {
+                slots[hole] = slots[pos];
+                hole = pos;
+            }
+        }
+        slots[hole].element = nullptr;
+    }
+
+    // Returns the smallest size of a table that holds count elements
+    // without growing.
+    static size_t buffer_size_for(size_t count) {
+        size_t res = default_size;
+        while (ratio_of(res, Policy::max_load_numerator,
+            Policy::max_load_denominator) < count) {
+            res *= increasing_size;
+        }
+        return res;
+    }
+
+    // Returns size * numerator / denominator rounded down in O(1)
+    // without overflow.
+    static size_t ratio_of(size_t size, size_t numerator,
+        size_t denominator) {
+        return size / denominator * numerator +
+            size % denominator * numerator / denominator;
+    }
+
+    // Recomputes limits of live elements for the current size in O(1).
+    void update_limits() {
+        max_live = ratio_of(buffer_size, Policy::max_load_numerator,
+            Policy::max_load_denominator);
+        min_live = ratio_of(buffer_size, Policy::min_load_numerator,
+            Policy::min_load_denominator);
+    }
+
+    // Reserves space for elements in range for forward iterators.
+    template<typename It>
+    void reserve_for(It begin, It end, std::forward_iterator_tag) {
+        reserve(size_t(std::distance(begin, end)));
+    }
+
+    // Input iterators can be passed only once, so nothing is reserved.
+    template<typename It>
+    void reserve_for(It, It, std::input_iterator_tag) {}
+
+    // Allocates empty slots of the given number, there must be none.
+    void init(size_t size) {
+        slots = slot_traits::allocate(alloc, size);
+        for (size_t i = 0; i < size; ++i) {
+            slots[i].element = nullptr;
+        }
+        buffer_size = size;
+        update_limits();
+        sz = 0;
+    }
+
+    // Destroys all elements, keeping the slots empty, in O(buffer_size).
+    void destroy_elements() {
+        for (size_t i = 0; i < buffer_size; ++i) {
+            if (slots[i].element != nullptr) {
+                drop(slots[i].element);
+                slots[i].element = nullptr;
+            }
+        }
+    }
+
+    // Destroys all elements and frees the slots in O(buffer_size),
+    // the pool frees the nodes.
+    void destroy() {
+        destroy_elements();
+        if (slots != nullptr) {
+            slot_traits::deallocate(alloc, slots, buffer_size);
+            slots = nullptr;
+        }
+        buffer_size = 0;
+        update_limits();
+        sz = 0;
+    }
+
+    // Moves all slots to new ones of the given number in O(buffer_size)
+    // time, nodes stay where they are and hashes are taken from slots.
+    // Only allocating may throw, the table is left unchanged then.
+    void rebuild(size_t new_buffer_size) {
+        slot_type* next = slot_traits::allocate(alloc, new_buffer_size);
+        for (size_t i = 0; i < new_buffer_size; ++i) {
+            next[i].element = nullptr;
+        }
+        size_t mask = new_buffer_size - 1;
+        for (size_t i = 0; i < buffer_size; ++i) {
+            if (slots[i].element != nullptr) {
+                size_t pos = slots[i].hash & mask;
+                while (next[pos].element != nullptr) {
+                    pos = (pos + 1) & mask;
+                }
+                next[pos] = slots[i];
+            }
+        }
+        if (slots != nullptr) {
+            slot_traits::deallocate(alloc, slots, buffer_size);
+        }
+        slots = next;
+        buffer_size = new_buffer_size;
+        update_limits();
+    }
+
+    // Shrinks the slots after an erase in O(buffer_size). The element
+    // is erased by then, so if allocating the new slots throws the table
+    // keeps its size and the next erase tries again instead.
+    void shrink() noexcept {
+        try {
+            rebuild(buffer_size / decreasing_size);
+        } catch (...) {
+            // The current slots are kept.
+        }
+    }
+
+    // Takes slots and nodes of other table, this one must be destroyed
+    // and have an equal allocator. Leaves other table empty without slots
+    // in O(1), it gets them on the first insert. Nothing is allocated.
+    void take(NodeHashMap& oth) {
+        pool.swap(oth.pool);
+        std::swap(slots, oth.slots);
+        std::swap(sz, oth.sz);
+        std::swap(buffer_size, oth.buffer_size);
+        std::swap(max_live, oth.max_live);
+        std::swap(min_live, oth.min_live);
+    }
+};
+
+
+#if __cplusplus >= 201703L
+// Thread-safe hash table split into shards, every shard is a HashMap
+// with its own reader-writer lock, shard of a key is selected by high bits
+// of its mixed hash. Operations on different shards don't contend.
+// No reference to an element escapes a lock: elements are accessed
+// through callbacks called under the lock of their shard, so callbacks
+// mustn't use the same table.
+// Readers of a shard share its lock, so the policy mustn't collect stats.
+template<class KeyType, class ValueType, class Hash = std::hash<KeyType>,
+    class KeyEqual = std::equal_to<KeyType>,
+    class Allocator = std::allocator<std::pair<const KeyType, ValueType>>,
+    class Policy = DefaultHashMapPolicy>
+class ConcurrentHashMap {
+    template<class K>
+    using key_arg = typename HashMapKeyArg<IsTransparent<Hash>::value &&
+        IsTransparent<KeyEqual>::value>::template type<K, KeyType>;
+
+    static_assert(!Policy::collect_stats,
+        "lookups under a shared lock can't update counters of a shard");
+
+ public:
+    using map_type =
+        HashMap<KeyType, ValueType, Hash, KeyEqual, Allocator, Policy>;
+
+    // default_shard_count - number of shards if it's not given.
+    constexpr static size_t default_shard_count = 64;
+
+    // Constructor with the given number of shards, rounded up to a power
+    // of two, and given hash function, key comparator and allocator
+    // shared by all shards.
+    explicit ConcurrentHashMap(size_t shard_count_ = default_shard_count,
+        Hash hasher_ = Hash(), KeyEqual key_equal_ = KeyEqual(),
+        const Allocator& alloc_ = Allocator()) :
+        hasher(hasher_), shard_bits(0) {
+        while ((size_t(1) << shard_bits) < shard_count_) {
+            ++shard_bits;
+        }
+        shards.reserve(shard_count());
+        for (size_t i = 0; i < shard_count(); ++i) {
+            shards.emplace_back(new shard(hasher_, key_equal_, alloc_));
+        }
+    }
+
+    ConcurrentHashMap(const ConcurrentHashMap&) = delete;
+    ConcurrentHashMap& operator=(const ConcurrentHashMap&) = delete;
+
+    // Adds a new pair of key and value to the table in O(1) amortized.
+    // Does nothing if key already exists.
+    // Returns true if the pair was inserted.
+    bool insert(const std::pair<KeyType, ValueType>& item) {
+        shard& sh = shard_for(item.first);
+        std::unique_lock<std::shared_mutex> lock(sh.mutex);
+        return sh.map.insert(item).second;
+    }
+
+    // Same as insert() above, moves the pair into the table.
+    bool insert(std::pair<KeyType, ValueType>&& item) {
+        shard& sh = shard_for(item.first);
+        std::unique_lock<std::shared_mutex> lock(sh.mutex);
+        return sh.map.insert(std::move(item)).second;
+    }
+
+    // Constructs a pair from the arguments and moves it
+    // into the table in O(1) amortized.
+    // Does nothing if key already exists.
+    template<class... Args>
+    bool emplace(Args&&... args) {
+        return insert(
+            std::pair<KeyType, ValueType>(std::forward<Args>(args)...));
+    }
+
+    // Adds a value constructed from the arguments with the given key
+    // in O(1) amortized.
+    // Does nothing if key already exists.
+    template<class K, class... Args>
+    bool try_emplace(K&& key, Args&&... args) {
+        shard& sh = shard_for(
+            static_cast<const key_arg<typename std::decay<K>::type>&>(key));
+        std::unique_lock<std::shared_mutex> lock(sh.mutex);
+        return sh.map.try_emplace(std::forward<K>(key),
+            std::forward<Args>(args)...).second;
+    }
+
+    // Adds a new pair or assigns the value
+    // if key already exists in O(1) amortized.
+    // Returns true if the pair was inserted.
+    template<class K, class M>
+    bool insert_or_assign(K&& key, M&& obj) {
+        shard& sh = shard_for(
+            static_cast<const key_arg<typename std::decay<K>::type>&>(key));
+        std::unique_lock<std::shared_mutex> lock(sh.mutex);
+        return sh.map.insert_or_assign(std::forward<K>(key),
+            std::forward<M>(obj)).second;
+    }
+
+    // Delete an element with the given key in O(1) amortized.
+    // Returns number of deleted elements.
+    template<class K = KeyType>
+    size_t erase(const key_arg<K>& key) {
+        shard& sh = shard_for(key);
+        std::unique_lock<std::shared_mutex> lock(sh.mutex);
+        return sh.map.erase(key);
+    }
+
+    // Calls f with constant reference to the value with the given key
+    // under a shared lock in O(1) amortized.
+    // Returns false if key doesn't exist.
+    template<class F, class K = KeyType>
+    bool find(const key_arg<K>& key, F f) const {
+        const shard& sh = shard_for(key);
+        std::shared_lock<std::shared_mutex> lock(sh.mutex);
+        auto it = sh.map.find(key);
+        if (it == sh.map.end()) {
+            return false;
+        }
+        f(static_cast<const ValueType&>(it->second));
+        return true;
+    }
+
+    // Calls f with reference to the value with the given key
+    // under an exclusive lock in O(1) amortized.
+    // Returns false if key doesn't exist.
+    template<class F, class K = KeyType>
+    bool update(const key_arg<K>& key, F f) {
+        shard& sh = shard_for(key);
+        std::unique_lock<std::shared_mutex> lock(sh.mutex);
+        auto it = sh.map.find(key);
+        if (it == sh.map.end()) {
+            return false;
+        }
+        f(it->second);
+        return true;
+    }
+
+    // Calls f with reference to the value with the given key
+    // under an exclusive lock, adding a default value first
+    // if key doesn't exist, in O(1) amortized.
+    template<class K, class F>
+    void upsert(K&& key, F f) {
+        shard& sh = shard_for(
+            static_cast<const key_arg<typename std::decay<K>::type>&>(key));
+        std::unique_lock<std::shared_mutex> lock(sh.mutex);
+        f(sh.map[std::forward<K>(key)]);
+    }
+
+    // Returns copy of the value with the given key in O(1) amortized.
+    // If key doesn't exist throws an exception.
+    template<class K = KeyType>
+    ValueType at(const key_arg<K>& key) const {
+        const shard& sh = shard_for(key);
+        std::shared_lock<std::shared_mutex> lock(sh.mutex);
+        return sh.map.at(key);
+    }
+
+    // Returns true if key exists in O(1) amortized.
+    template<class K = KeyType>
+    bool contains(const key_arg<K>& key) const {
+        const shard& sh = shard_for(key);
+        std::shared_lock<std::shared_mutex> lock(sh.mutex);
+        return sh.map.find(key) != sh.map.end();
+    }
+
+    // Calls f for every pair locking one shard at a time in O(size).
+    // Pairs added or deleted meanwhile in other shards may be missed.
+    template<class F>
+    void for_each(F f) const {
+        for (const auto& sh : shards) {
+            std::shared_lock<std::shared_mutex> lock(sh->mutex);
+            for (auto it = sh->map.begin(); it != sh->map.end(); ++it) {
+                f(*it);
+            }
+        }
+    }
+
+    // Returns amount of elements in table in O(shard_count()).
+    // Exact only if there are no concurrent modifications.
+    size_t size() const {
+        size_t res = 0;
+        for (const auto& sh : shards) {
+            std::shared_lock<std::shared_mutex> lock(sh->mutex);
+            res += sh->map.size();
         }
+        return res;
+    }
 
-        // Return true if iterators are the same in O(1).
-        bool operator==(iterator oth) const {
-            return pos == oth.pos && ptr == oth.ptr;
-        }
+    // Returns true if there are no elements in table in O(shard_count()).
+    bool empty() const {
+        return size() == 0;
+    }
 
-        // Return true if iterators are different in O(1).
-        bool operator!=(iterator oth) const {
-            return !((*this) == oth);
+    // Deletes all elements in table in O(size).
+    void clear() {
+        for (auto& sh : shards) {
+            std::unique_lock<std::shared_mutex> lock(sh->mutex);
+            sh->map.clear();
         }
+    }
 
-        // Returns item reference in O(1) time.
-        std::pair<const KeyType, ValueType>* operator->() {
-            return &((*ptr)[pos]);
+    // Makes every shard hold its part of count elements without growing.
+    void reserve(size_t count) {
+        for (auto& sh : shards) {
+            std::unique_lock<std::shared_mutex> lock(sh->mutex);
+            sh->map.reserve(count / shard_count() + 1);
         }
+    }
 
-        // Returns item object in O(1) time.
-        std::pair<const KeyType, ValueType> operator*() {
-            return (*ptr)[pos];
-        }
+    // Returns number of shards in O(1).
+    size_t shard_count() const {
+        return size_t(1) << shard_bits;
+    }
 
-     private:
-        size_t pos;
-        std::vector<std::pair<const KeyType, ValueType>>* ptr;
-        std::vector<bool>* check;
-        std::vector<bool>* is_empty;
-        // Finds the next element in O(1) amortized.
-        void go() {
-            while (pos < ptr->size() &&
-                ((*is_empty)[pos] || (*check)[pos])) {
-                ++pos;
-            }
-        }
+    // Returns hash function of table in O(1).
+    Hash hash_function() const {
+        return hasher;
+    }
+
+ private:
+    // Shards are aligned to separate cache lines,
+    // so their locks don't share one.
+    struct alignas(64) shard {
+        mutable std::shared_mutex mutex;
+        map_type map;
+
+        shard(const Hash& hasher_, const KeyEqual& key_equal_,
+            const Allocator& alloc_) : map(hasher_, key_equal_, alloc_) {}
     };
 
-    // Const iterator allows to iterate over the elements in table and get
-    // their values but doesn't allow to change them.
-    class const_iterator {
-     public:
-        // Default constructor.
-        const_iterator() : pos(0), ptr(nullptr), check(nullptr),
-            is_empty(nullptr) {}
+    Hash hasher;
+    size_t shard_bits;
+    std::vector<std::unique_ptr<shard>> shards;
 
-        // Constructor with the given position.
-        const_iterator(size_t pos_,
-            const std::vector<std::pair<KeyType, ValueType>>& ar,
-            const std::vector<bool>& used_,
-            const std::vector<bool>& is_empty_) : pos(pos_),
-            ptr(reinterpret_cast<const std::vector<std::pair<const KeyType, ValueType>>*>(&ar)),
-            check(&used_), is_empty(&is_empty_) {
-            go();
+    // Returns shard of the key in O(1). Uses high bits of a mixed hash,
+    // the map inside the shard uses low bits of its own.
+    template<class K>
+    shard& shard_for(const K& key) const {
+        if (shard_bits == 0) {
+            return *shards[0];
         }
+        size_t hash = MurmurHashMixer()(hasher(key));
+        return *shards[hash >> (std::numeric_limits<size_t>::digits -
+            shard_bits)];
+    }
+};
+#endif
 
-        // Pre-increment iterator in O(1) amortized.
-        const_iterator operator++() {
-            ++pos;
-            go();
-            return (*this);
-        }
 
-        // Post-increment iterator in O(1) amortized.
-        const_iterator operator++(int) {
-            const_iterator res = *this;
-            ++pos;
-            go();
-            return res;
+// Thread-safe hash table for read-mostly workloads. Readers never lock:
+// they work with an immutable HashMap published through an atomic pointer.
+// Writers serialize on a mutex, apply changes to a copy of the table,
+// publish it and free the previous one once no reader uses it (read-copy-
+// update). A reader announces itself with one counter increment, so reads
+// scale with cores, while every write costs O(size); batch writes with
+// update() when there are many of them. Readers share the table, so the
+// policy mustn't collect stats.
+// https://en.wikipedia.org/wiki/Read-copy-update
+template<class KeyType, class ValueType, class Hash = std::hash<KeyType>,
+    class KeyEqual = std::equal_to<KeyType>,
+    class Allocator = std::allocator<std::pair<const KeyType, ValueType>>,
+    class Policy = DefaultHashMapPolicy>
+class ReadMostlyHashMap {
+    template<class K>
+    using key_arg = typename HashMapKeyArg<IsTransparent<Hash>::value &&
+        IsTransparent<KeyEqual>::value>::template type<K, KeyType>;
+
+    static_assert(!Policy::collect_stats,
+        "lock-free lookups can't update counters of the table");
+
+ public:
+    using map_type =
+        HashMap<KeyType, ValueType, Hash, KeyEqual, Allocator, Policy>;
+
+    // reader_slot_count - number of reader counters, threads are spread
+    // over them so that they rarely share a cache line.
+    constexpr static size_t reader_slot_count = 64;
+
+    // Constructor with the given initial contents.
+    explicit ReadMostlyHashMap(map_type map = map_type()) :
+        current(new map_type(std::move(map))), epoch(0) {}
+
+    ReadMostlyHashMap(const ReadMostlyHashMap&) = delete;
+    ReadMostlyHashMap& operator=(const ReadMostlyHashMap&) = delete;
+
+    // There must be no readers and writers left.
+    ~ReadMostlyHashMap() {
+        delete current.load();
+    }
+
+    // Calls f with constant reference to the value with the given key
+    // in O(1) amortized without locking.
+    // Returns false if key doesn't exist.
+    template<class F, class K = KeyType>
+    bool find(const key_arg<K>& key, F f) const {
+        read_guard guard(*this);
+        auto it = guard.map->find(key);
+        if (it == guard.map->end()) {
+            return false;
         }
+        f(static_cast<const ValueType&>(it->second));
+        return true;
+    }
 
-        // Return true if iterators are the same in O(1).
-        bool operator==(const_iterator oth) const {
-            return pos == oth.pos && ptr == oth.ptr;
+    // Returns copy of the value with the given key
+    // in O(1) amortized without locking.
+    // If key doesn't exist throws an exception.
+    template<class K = KeyType>
+    ValueType at(const key_arg<K>& key) const {
+        read_guard guard(*this);
+        return guard.map->at(key);
+    }
+
+    // Returns true if key exists in O(1) amortized without locking.
+    template<class K = KeyType>
+    bool contains(const key_arg<K>& key) const {
+        read_guard guard(*this);
+        return guard.map->find(key) != guard.map->end();
+    }
+
+    // Returns amount of elements in table in O(1) without locking.
+    size_t size() const {
+        read_guard guard(*this);
+        return guard.map->size();
+    }
+
+    // Returns true if there are no elements in table in O(1).
+    bool empty() const {
+        return size() == 0;
+    }
+
+    // Calls f with constant reference to the whole table without locking.
+    // The table doesn't change while f runs, writers wait for f
+    // before freeing it.
+    template<class F>
+    void read(F f) const {
+        read_guard guard(*this);
+        f(static_cast<const map_type&>(*guard.map));
+    }
+
+    // Calls f with reference to a copy of the table and publishes
+    // the copy in O(size) time. Concurrent readers see either
+    // the table before f or after it.
+    template<class F>
+    void update(F f) {
+        std::lock_guard<std::mutex> lock(write_mutex);
+        map_type* next = new map_type(*current.load());
+        try {
+            f(*next);
+        } catch (...) {
+            delete next;
+            throw;
         }
+        publish(next);
+    }
 
-        // Return true if iterators are different in O(1).
-        bool operator!=(const_iterator oth) const {
-            return !((*this) == oth);
+    // Adds a new pair of key and value to the table in O(size) time.
+    // Does nothing if key already exists.
+    // Returns true if the pair was inserted.
+    bool insert(const std::pair<KeyType, ValueType>& item) {
+        bool res = false;
+        update([&](map_type& map) { res = map.insert(item).second; });
+        return res;
+    }
+
+    // Adds a new pair or assigns the value
+    // if key already exists in O(size) time.
+    // Returns true if the pair was inserted.
+    template<class K, class M>
+    bool insert_or_assign(K&& key, M&& obj) {
+        bool res = false;
+        update([&](map_type& map) {
+            res = map.insert_or_assign(std::forward<K>(key),
+                std::forward<M>(obj)).second;
+        });
+        return res;
+    }
+
+    // Delete an element with the given key in O(size) time.
+    // Returns number of deleted elements.
+    template<class K = KeyType>
+    size_t erase(const key_arg<K>& key) {
+        size_t res = 0;
+        update([&](map_type& map) { res = map.erase(key); });
+        return res;
+    }
+
+    // Deletes all elements in table.
+    void clear() {
+        std::lock_guard<std::mutex> lock(write_mutex);
+        const map_type* prev = current.load();
+        publish(new map_type(prev->hash_function(), prev->key_eq(),
+            prev->get_allocator()));
+    }
+
+ private:
+    // Two counters of readers, one for every parity of the epoch.
+    struct alignas(64) reader_slot {
+        std::atomic<size_t> count[2];
+
+        reader_slot() {
+            count[0] = 0;
+            count[1] = 0;
         }
+    };
 
-        // Returns constant item reference in O(1) time.
-        std::pair<const KeyType, ValueType>* operator->() {
-            return const_cast<std::pair<const KeyType, ValueType>*>(&((*ptr)[pos]));
+    // Announces a reader for its lifetime and holds the table it reads.
+    class read_guard {
+     public:
+        explicit read_guard(const ReadMostlyHashMap& table_) :
+            slot(table_.readers[reader_index()]) {
+            // Counter of the current parity is incremented. If the epoch
+            // changed meanwhile a writer may have missed it, so
+            // the reader retries with the new parity.
+            while (true) {
+                parity = table_.epoch.load() & 1;
+                slot.count[parity].fetch_add(1);
+                if ((table_.epoch.load() & 1) == parity) {
+                    break;
+                }
+                slot.count[parity].fetch_sub(1);
+            }
+            map = table_.current.load();
         }
 
-        // Returns constant item object in O(1) time.
-        std::pair<const KeyType, ValueType> operator*() {
-            return (*ptr)[pos];
+        read_guard(const read_guard&) = delete;
+        read_guard& operator=(const read_guard&) = delete;
+
+        ~read_guard() {
+            slot.count[parity].fetch_sub(1);
         }
 
+        const map_type* map;
+
      private:
-        size_t pos;
-        const std::vector<std::pair<const KeyType, ValueType>>* ptr;
-        const std::vector<bool>* check;
-        const std::vector<bool>* is_empty;
+        reader_slot& slot;
+        size_t parity;
+    };
 
-        // Finds the next element in O(1) amortized.
-        void go() {
-            while (pos < ptr->size() &&
-                ((*is_empty)[pos] || (*check)[pos])) {
-                ++pos;
+    std::atomic<const map_type*> current;
+    // epoch - number of publications, readers count themselves
+    // in the counter of its parity.
+    std::atomic<size_t> epoch;
+    mutable reader_slot readers[reader_slot_count];
+    std::mutex write_mutex;
+
+    // Returns reader slot of the calling thread in O(1),
+    // slots are given out to threads in turn.
+    static size_t reader_index() {
+        static std::atomic<size_t> next(0);
+        thread_local size_t index = next.fetch_add(1) % reader_slot_count;
+        return index;
+    }
+
+    // Replaces the table with next and frees the previous one when
+    // readers that may use it are gone. Must be called under write_mutex.
+    void publish(map_type* next) {
+        const map_type* prev = current.exchange(next);
+        // Readers that come after the epoch change see next, so only
+        // the ones counted in the previous parity have to be waited for.
+        size_t parity = epoch.fetch_add(1) & 1;
+        for (size_t i = 0; i < reader_slot_count; ++i) {
+            while (readers[i].count[parity].load() != 0) {
+                std::this_thread::yield();
             }
         }
-    };
+        delete prev;
+    }
+};
 
-    // Default constructor with given hash function.
-    HashMap(Hash hasher_ = Hash()) : hasher(hasher_) {
-        init();
+
+// Items of a batch of PartitionedHashMap grouped by their partitions:
+// items of partition p are items[offsets[p]] to items[offsets[p + 1]]
+// in the order of the batch, and index[i] is the position of items[i]
+// in the batch. Every group is one contiguous buffer, ready to be sent
+// to the node that owns the partition. A buffer reused for many batches
+// keeps its memory.
+template<class T>
+struct HashMapPartitionBuffer {
+    std::vector<T> items;
+    std::vector<size_t> offsets;
+    std::vector<size_t> index;
+
+    // Returns number of partitions of the batch in O(1).
+    size_t partition_count() const {
+        return offsets.empty() ? 0 : offsets.size() - 1;
     }
 
-    // Constructor for initializer list with given hash function.
-    HashMap(std::initializer_list<std::pair<KeyType, ValueType>> list,
-        Hash hasher_ = Hash()) :
-        HashMap(list.begin(), list.end(), hasher_) {}
+    // Returns pointer to the first item of the partition in O(1).
+    const T* begin(size_t partition) const {
+        return items.data() + offsets[partition];
+    }
 
-    // Copy constructor.
-    HashMap(const HashMap& oth) : hasher(oth.hasher) {
-        init();
-        for (auto it = oth.begin(); it != oth.end(); ++it) {
-            insert(*it);
-        }
+    // Returns pointer past the last item of the partition in O(1).
+    const T* end(size_t partition) const {
+        return items.data() + offsets[partition + 1];
     }
+};
 
-    // Constructor for given begin and end iterator.
-    template<typename It>
-    HashMap(It begin, It end, Hash hasher_ = Hash()) : hasher(hasher_) {
-        init();
-        while (begin != end) {
-            insert(*begin);
-            ++begin;
+// Hash table split into partitions, e.g. ones served by different nodes,
+// every partition is a local HashMap. Keys are routed by consistent
+// hashing: every partition owns virtual_nodes points on a ring of mixed
+// hashes and a key goes to the partition of the first point at or after
+// the hash of the key, so an added partition takes only keys of the arcs
+// before its points, about 1 / partition_count of all keys.
+// Batched operations group items of every partition into a contiguous
+// buffer, see HashMapPartitionBuffer, and partitions are saved and loaded
+// one at a time as snapshots to move them between nodes.
+// https://en.wikipedia.org/wiki/Consistent_hashing
+template<class KeyType, class ValueType, class Hash = std::hash<KeyType>,
+    class KeyEqual = std::equal_to<KeyType>,
+    class Allocator = std::allocator<std::pair<const KeyType, ValueType>>,
+    class Policy = DefaultHashMapPolicy>
+class PartitionedHashMap {
+    template<class K>
+    using key_arg = typename HashMapKeyArg<IsTransparent<Hash>::value &&
+        IsTransparent<KeyEqual>::value>::template type<K, KeyType>;
+    // Points of the ring with their partitions, sorted by points.
+    using ring_type = std::vector<std::pair<size_t, size_t>>;
+
+ public:
+    using map_type =
+        HashMap<KeyType, ValueType, Hash, KeyEqual, Allocator, Policy>;
+    using key_type = KeyType;
+    using mapped_type = ValueType;
+    using value_type = std::pair<const KeyType, ValueType>;
+    using size_type = size_t;
+    // Buffers of the batched operations.
+    using insert_buffer =
+        HashMapPartitionBuffer<std::pair<KeyType, ValueType>>;
+    using lookup_buffer = HashMapPartitionBuffer<KeyType>;
+
+    // default_virtual_nodes - number of points of a partition on the ring
+    // if it's not given, more points balance partitions better and make
+    // routing slower by O(log) of them.
+    constexpr static size_t default_virtual_nodes = 64;
+
+    // Constructor with the given numbers of partitions, at least one,
+    // and of their points on the ring, and given hash function, key
+    // comparator and allocator shared by all partitions.
+    // Tables route keys in the same way if they have the same numbers
+    // and hash function.
+    explicit PartitionedHashMap(size_t partition_count_ = 1,
+        size_t virtual_nodes_ = default_virtual_nodes,
+        Hash hasher_ = Hash(), KeyEqual key_equal_ = KeyEqual(),
+        const Allocator& alloc_ = Allocator()) : hasher(hasher_),
+        key_equal(key_equal_), alloc(alloc_),
+        virtual_nodes(std::max(virtual_nodes_, size_t(1))) {
+        partition_count_ = std::max(partition_count_, size_t(1));
+        ring.reserve(partition_count_ * virtual_nodes);
+        for (size_t i = 0; i < partition_count_; ++i) {
+            partitions.emplace_back(hasher, key_equal, alloc);
+            add_points(ring, i);
         }
+        std::sort(ring.begin(), ring.end());
     }
 
-    // Copies other hash table.
-    HashMap& operator=(const HashMap &oth) {
-        if (&oth != this) {
-            hasher = oth.hasher;
-            clear();
-            for (auto it : oth) {
-                insert(it);
-            }
-        }
-        return (*this);
+    // Adds a new pair of key and value to its partition in O(log(points))
+    // amortized. Does nothing if key already exists.
+    // Returns true if the pair was inserted.
+    bool insert(const std::pair<KeyType, ValueType>& item) {
+        return partitions[partition_of(item.first)].insert(item).second;
     }
 
-    // Deletes all elements in table in O(size)
-    // and resets table to its beginning conditions.
-    void clear() {
-        arr.clear();
-        init();
+    // Same as insert() above, moves the pair into the table.
+    bool insert(std::pair<KeyType, ValueType>&& item) {
+        size_t partition = partition_of(item.first);
+        return partitions[partition].insert(std::move(item)).second;
     }
 
-    // Calls increase_size() method of a table if needed.
-    void check_density() {
-        if (sz + 1 > size_t(overload_size * buffer_size)) {
-            increase_size();
-        }
+    // Adds a value constructed from the arguments with the given key
+    // in O(log(points)) amortized.
+    // Does nothing if key already exists.
+    template<class K, class... Args>
+    bool try_emplace(K&& key, Args&&... args) {
+        size_t partition = partition_of(
+            static_cast<const key_arg<typename std::decay<K>::type>&>(key));
+        return partitions[partition].try_emplace(std::forward<K>(key),
+            std::forward<Args>(args)...).second;
     }
 
-    // Calls decrease_size() method of a table if needed.
-    void check_deleted_elements() {
-        if (size_all_non_nullptr > allowed_deleted_elements * sz) {
-            decrease_size();
-        }
+    // Adds a new pair or assigns the value
+    // if key already exists in O(log(points)) amortized.
+    // Returns true if the pair was inserted.
+    template<class K, class M>
+    bool insert_or_assign(K&& key, M&& obj) {
+        size_t partition = partition_of(
+            static_cast<const key_arg<typename std::decay<K>::type>&>(key));
+        return partitions[partition].insert_or_assign(std::forward<K>(key),
+            std::forward<M>(obj)).second;
     }
 
-    // Adds a new pair of key and value to the table in O(1) amortized.
-    // Does nothing if key already exists.
-    void insert(const std::pair<KeyType, ValueType>& item) {
-        check_density();
-        check_deleted_elements();
-        
-        // Finds a position for element or checks if key already exists.
-        size_t hash = hasher(item.first) % buffer_size;
-        size_t i = 0;
-        // found == true if we want to insert an element to a position
-        // where we have a deleted element.
-        bool found = false;
-        size_t first_deleted = 0;
-        while (!is_nullptr[hash] && i < buffer_size) {
-            if (arr[hash].first == item.first && !used[hash]) {
-                return;
-            }
-            if (used[hash] && !found) {
-                first_deleted = hash;
-                found = true;
-                break;
-            }
-            hash = (hash + 1) % buffer_size;
-            ++i;
-        }
+    // Delete an element with the given key in O(log(points)) amortized.
+    // Returns number of deleted elements.
+    template<class K = KeyType>
+    size_t erase(const key_arg<K>& key) {
+        return partitions[partition_of(key)].erase(key);
+    }
 
-        // Adds an element to a found position.
-        if (!found) {
-            is_nullptr[hash] = false;
-            arr[hash] = item;
-            ++size_all_non_nullptr;
-        } else {
-            is_nullptr[first_deleted] = false;
-            arr[first_deleted] = item;
-            used[first_deleted] = false;
-        }
-        ++sz;
+    // Returns reference to an object with the given key
+    // in O(log(points)) amortized time.
+    // If key doesn't exist adds a new pair and retuns reference to it.
+    template<class K = KeyType>
+    ValueType& operator[](const key_arg<K>& key) {
+        return partitions[partition_of(key)][key];
     }
 
-    // Delete an element with the given key in O(1) amortized.
-    // Does nothing if key doesn't exist in table.
-    void erase(const KeyType& key) {
-        size_t hash = hasher(key) % buffer_size;
-        size_t i = 0;
-        while (!is_nullptr[hash] && i < buffer_size) {
-            if (arr[hash].first == key && !used[hash]) {
-                used[hash] = true;
-                --sz;
-                check_deleted_elements();
-                return;
-            }
-            hash = (hash + 1) % buffer_size;
-            ++i;
-        }
+    // Returns reference to an object with the given key
+    // in O(log(points)) amortized time.
+    // If key doesn't exist throws an exception.
+    template<class K = KeyType>
+    const ValueType& at(const key_arg<K>& key) const {
+        return partitions[partition_of(key)].at(key);
     }
 
-    // Returns amount of elements in table in O(1).
-    size_t size() const {
-        return sz;
+    // Returns true if key exists in O(log(points)) amortized.
+    template<class K = KeyType>
+    bool contains(const key_arg<K>& key) const {
+        const map_type& map = partitions[partition_of(key)];
+        return map.find(key) != map.end();
     }
 
-    // Returns true if there are no elements in table in O(1).
-    bool empty() const {
-        return sz == 0;
+    // Groups pairs from range of random access iterators by their
+    // partitions into the buffer in O(count * log(points)).
+    template<class RandomIt>
+    void route(RandomIt first, RandomIt last, insert_buffer& out) const {
+        group(first, last, out, [](const std::pair<KeyType, ValueType>& item)
+            -> const KeyType& { return item.first; });
     }
 
-    // Returns hash function of table in O(1).
-    Hash hash_function() const {
-        return hasher;
+    // Groups keys from range of random access iterators by their
+    // partitions into the buffer in O(count * log(points)).
+    template<class RandomIt>
+    void route(RandomIt first, RandomIt last, lookup_buffer& out) const {
+        group(first, last, out,
+            [](const KeyType& key) -> const KeyType& { return key; });
     }
 
-    // Returns reference to an object with the given key
-    // in O(1) amortized time.
-    // If key doesn't exist adds a new pair and
-    // retuns reference to it.
-    ValueType& operator[](const KeyType& key) {
-        size_t hash = hasher(key) % buffer_size;
-        size_t i = 0;
-        while (!is_nullptr[hash] && i < buffer_size) {
-            if (arr[hash].first == key && !used[hash]) {
-                return arr[hash].second;
+    // Groups pairs from range of random access iterators into the buffer,
+    // see route(), and adds every group to its partition with
+    // HashMap::insert_batch() in O(count * log(points)) amortized,
+    // keys that already exist are skipped. The groups stay in the buffer
+    // to be sent to the nodes of their partitions.
+    // Returns number of inserted pairs.
+    template<class RandomIt>
+    size_t route_and_insert(RandomIt first, RandomIt last,
+        insert_buffer& grouped) {
+        route(first, last, grouped);
+        size_t res = 0;
+        for (size_t i = 0; i < partitions.size(); ++i) {
+            res += partitions[i].insert_batch(grouped.begin(i),
+                grouped.end(i));
+        }
+        return res;
+    }
+
+    // Same as route_and_insert() above with a temporary buffer.
+    template<class RandomIt>
+    size_t route_and_insert(RandomIt first, RandomIt last) {
+        insert_buffer grouped;
+        return route_and_insert(first, last, grouped);
+    }
+
+    // Writes pointer to the value of every key in range of random access
+    // iterators, or nullptr if it doesn't exist, in the order of the keys
+    // in O(count * log(points)) amortized. Keys are grouped into the
+    // buffer, see route(), and every group is looked up in its partition
+    // with HashMap::find_batch().
+    // Pointers are valid until the table is changed.
+    template<class RandomIt, class OutputIt>
+    OutputIt lookup_batch(RandomIt first, RandomIt last, OutputIt out,
+        lookup_buffer& grouped) const {
+        route(first, last, grouped);
+        std::vector<const ValueType*> values(grouped.items.size());
+        std::vector<typename map_type::const_iterator> found;
+        for (size_t i = 0; i < partitions.size(); ++i) {
+            const map_type& map = partitions[i];
+            found.clear();
+            map.find_batch(grouped.begin(i), grouped.end(i),
+                std::back_inserter(found));
+            for (size_t j = 0; j < found.size(); ++j) {
+                values[grouped.index[grouped.offsets[i] + j]] =
+                    found[j] == map.end() ? nullptr : &found[j]->second;
             }
-            hash = (hash + 1) % buffer_size;
-            ++i;
         }
-        insert({ key, ValueType() });
-        return find(key)->second;
+        return std::copy(values.begin(), values.end(), out);
     }
 
-    // Returns reference to an object with the given key
-    // in O(1) amortized time.
-    // If key doesn't exist throws an exception.
-    const ValueType& at(const KeyType& key) const {
-        size_t hash = hasher(key) % buffer_size;
-        size_t i = 0;
-        while (!is_nullptr[hash] && i < buffer_size) {
-            if (arr[hash].first == key && !used[hash]) {
-                return arr[hash].second;
+    // Same as lookup_batch() above with a temporary buffer.
+    template<class RandomIt, class OutputIt>
+    OutputIt lookup_batch(RandomIt first, RandomIt last,
+        OutputIt out) const {
+        lookup_buffer grouped;
+        return lookup_batch(first, last, out, grouped);
+    }
+
+    // Adds a new empty partition in O(size * log(points)) time and moves
+    // to it the elements of other partitions on its arcs of the ring.
+    // Elements are copied first, so if that throws the table is left
+    // unchanged. Partitions aren't moved, references to them returned by
+    // partition() stay valid. Returns the number of the new partition.
+    size_t add_partition() {
+        size_t added = partitions.size();
+        ring_type next_ring(ring);
+        add_points(next_ring, added);
+        std::sort(next_ring.begin(), next_ring.end());
+        map_type next(hasher, key_equal, alloc);
+        std::vector<std::pair<size_t, KeyType>> moved;
+        for (size_t i = 0; i < added; ++i) {
+            for (const auto& item : partitions[i]) {
+                if (route_on(next_ring, item.first) == added) {
+                    next.insert(item);
+                    moved.emplace_back(i, item.first);
+                }
             }
-            hash = (hash + 1) % buffer_size;
-            ++i;
         }
-        throw std::out_of_range("out of range");
+        partitions.push_back(std::move(next));
+        ring.swap(next_ring);
+        for (const auto& item : moved) {
+            partitions[item.first].erase(item.second);
+        }
+        return added;
     }
 
-    // Returns iterator to the first element in O(1) amortized.
-    iterator begin() {
-        return iterator(0, arr, used, is_nullptr);
+    // Writes elements of the partition to the stream as a snapshot,
+    // see HashMap::save(), in O(buffer size of the partition).
+    void save_partition(size_t partition, std::ostream& out) const {
+        partitions[partition].save(out);
     }
 
-    // Returns iterator to the end of the table in O(1).
-    iterator end() {
-        return iterator(buffer_size, arr, used, is_nullptr);
+    // Adds elements of a snapshot written by save_partition() from the
+    // stream, every one to its partition, in O(buffer size of the
+    // snapshot * log(points)), keys that already exist are skipped.
+    // Elements are routed again, so the snapshot may come from a table
+    // with another number of partitions.
+    // Returns number of inserted pairs.
+    size_t load(std::istream& in) {
+        map_type snapshot(hasher, key_equal, alloc);
+        snapshot.load(in);
+        size_t res = 0;
+        for (const auto& item : snapshot) {
+            res += partitions[partition_of(item.first)].insert(item).second;
+        }
+        return res;
     }
 
-    // Returns const_iterator to the first element in O(1) amortized.
-    const_iterator begin() const {
-        return const_iterator(0, arr, used, is_nullptr);
+    // Returns the partition of the key in O(log(points)).
+    template<class K = KeyType>
+    size_t partition_of(const key_arg<K>& key) const {
+        return route_on(ring, key);
     }
 
-    // Returns const_iterator to the end of the table in O(1).
-    const_iterator end() const {
-        return const_iterator(buffer_size, arr, used, is_nullptr);
+    // Returns the partition with the given number in O(1).
+    const map_type& partition(size_t partition) const {
+        return partitions[partition];
     }
 
-    // Returns iterator to the pair with the given key
-    // or end() if key doesn't exist in O(1) amortized.
-    iterator find(const KeyType& key) {
-        size_t hash = hasher(key) % buffer_size;
-        size_t i = 0;
-        while (!is_nullptr[hash] && i < buffer_size) {
-            if (arr[hash].first == key && !used[hash]) {
-                return iterator(hash, arr, used, is_nullptr);
-            }
-            hash = (hash + 1) % buffer_size;
-            ++i;
+    // Returns number of partitions in O(1).
+    size_t partition_count() const {
+        return partitions.size();
+    }
+
+    // Returns amount of elements in table in O(partition_count).
+    size_t size() const {
+        size_t res = 0;
+        for (const map_type& map : partitions) {
+            res += map.size();
         }
-        return end();
+        return res;
     }
 
-    // Returns const_iterator to the pair with the given key
-    // or end() if key doesn't exist in O(1) amortized.
-    const_iterator find(const KeyType& key) const {
-        size_t hash = hasher(key) % buffer_size;
-        size_t i = 0;
-        while (!is_nullptr[hash] && i < buffer_size) {
-            if (arr[hash].first == key && !used[hash]) {
-                return const_iterator(hash, arr, used, is_nullptr);
-            }
-            hash = (hash + 1) % buffer_size;
-            ++i;
+    // Returns true if there are no elements in table in O(partition_count).
+    bool empty() const {
+        return size() == 0;
+    }
+
+    // Deletes all elements in every partition.
+    void clear() {
+        for (map_type& map : partitions) {
+            map.clear();
         }
-        return end();
+    }
+
+    // Returns hash function of table in O(1).
+    Hash hash_function() const {
+        return hasher;
     }
 
  private:
     Hash hasher;
-    // buffer_size - size of current state of hash table.
-    size_t sz, buffer_size, size_all_non_nullptr;
-    std::vector<bool> used, is_nullptr;
-    std::vector<std::pair<KeyType, ValueType>> arr;
+    KeyEqual key_equal;
+    Allocator alloc;
+    size_t virtual_nodes;
+    // A deque never relocates partitions when one is added.
+    std::deque<map_type> partitions;
+    ring_type ring;
 
-    // Initializes table.
-    void init() {
-        buffer_size = default_size;
-        sz = 0;
-        size_all_non_nullptr = 0;
-        arr = std::vector<std::pair<KeyType, ValueType>>(buffer_size);
-        used.clear();
-        used.resize(default_size, false);
-        is_nullptr.clear();
-        is_nullptr.resize(default_size, true);
+    // Adds unsorted points of the partition to the ring.
+    void add_points(ring_type& points, size_t partition) const {
+        for (size_t i = 0; i < virtual_nodes; ++i) {
+            points.emplace_back(
+                MurmurHashMixer()(partition * virtual_nodes + i), partition);
+        }
     }
 
-    // Increases the size of a table and reinserts all elements in O(size) time.
-    void increase_size() {
-        size_t past_buffer_size = buffer_size;
-        buffer_size *= increasing_size;
-        size_all_non_nullptr = 0;
-        sz = 0;
-        std::vector<bool> prev_used = used;
-        std::vector<bool> prev_nullptr = is_nullptr;
-        used.clear();
-        used.resize(buffer_size, false);
-        is_nullptr.clear();
-        is_nullptr.resize(buffer_size, true);
-        std::vector<std::pair<KeyType, ValueType>> prev_arr(buffer_size);
-        std::swap(arr, prev_arr);
-        for (size_t i = 0; i < past_buffer_size; ++i) {
-            if (!prev_nullptr[i] && !prev_used[i]) {
-                insert(prev_arr[i]);
-            }
-        }
+    // Returns the partition of the key on the ring in O(log(points)).
+    // Hashes are mixed, so keys with close hashes spread over the ring.
+    template<class K>
+    size_t route_on(const ring_type& points, const K& key) const {
+        size_t hash = MurmurHashMixer()(hasher(key));
+        auto it = std::lower_bound(points.begin(), points.end(),
+            std::pair<size_t, size_t>(hash, 0));
+        return it == points.end() ? points.front().second : it->second;
     }
 
-    // Decreases the size of a table and reinserts all elements in O(size) time.
-    void decrease_size() {
-        size_t past_buffer_size = buffer_size;
-        buffer_size /= decreasing_size;
-        size_all_non_nullptr = 0;
-        sz = 0;
-        std::vector<bool> prev_used = used;
-        std::vector<bool> prev_nullptr = is_nullptr;
-        used.clear();
-        used.resize(buffer_size, false);
-        is_nullptr.clear();
-        is_nullptr.resize(buffer_size, true);
-        std::vector<std::pair<KeyType, ValueType>> prev_arr(buffer_size);
-        std::swap(arr, prev_arr);
-        for (size_t i = 0; i < past_buffer_size; ++i) {
-            if (!prev_nullptr[i] && !prev_used[i]) {
-                insert(prev_arr[i]);
-            }
+    // Groups items from range of random access iterators by partitions
+    // of their keys into the buffer, keeping the order of the range,
+    // in O(count * log(points)).
+    template<class RandomIt, class T, class KeyOf>
+    void group(RandomIt first, RandomIt last, HashMapPartitionBuffer<T>& out,
+        KeyOf key_of) const {
+        size_t count = size_t(last - first);
+        out.offsets.assign(partitions.size() + 1, 0);
+        // index holds partitions of items until they are sorted.
+        out.index.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            out.index[i] = partition_of(key_of(first[i]));
+            ++out.offsets[out.index[i] + 1];
+        }
+        for (size_t i = 0; i < partitions.size(); ++i) {
+            out.offsets[i + 1] += out.offsets[i];
+        }
+        std::vector<size_t> order(count);
+        std::vector<size_t> next(out.offsets.begin(), out.offsets.end() - 1);
+        for (size_t i = 0; i < count; ++i) {
+            order[next[out.index[i]]++] = i;
+        }
+        out.index.swap(order);
+        out.items.clear();
+        out.items.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            out.items.push_back(first[out.index[i]]);
         }
     }
 };
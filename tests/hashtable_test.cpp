@@ -0,0 +1,892 @@
+// Correctness tests of the tables: randomized operations checked against
+// std::unordered_map, exception safety with elements whose constructors
+// throw, moved-from tables and concurrent access to the thread-safe ones.
+// Build with HASHTABLE_SANITIZE=address,undefined or thread to run them
+// under sanitizers.
+#include <algorithm>
+#include <cctype>
+#include <limits>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "hashtable.cpp"
+
+namespace {
+
+template<class Policy>
+using PolicyHashMap = HashMap<int, std::string, std::hash<int>,
+    std::equal_to<int>, std::allocator<std::pair<const int, std::string>>,
+    Policy>;
+
+// Returns the elements of a table sorted by keys.
+template<class Map>
+std::map<int, std::string> contents(const Map& map) {
+    std::map<int, std::string> res;
+    for (const auto& item : map) {
+        EXPECT_TRUE(res.emplace(item.first, item.second).second)
+            << "key " << item.first << " is seen twice";
+    }
+    return res;
+}
+
+// Checks that a table holds exactly the elements of the reference.
+template<class Map>
+void expect_same(const Map& map,
+    const std::unordered_map<int, std::string>& expected) {
+    ASSERT_EQ(map.size(), expected.size());
+    std::map<int, std::string> sorted(expected.begin(), expected.end());
+    EXPECT_EQ(contents(map), sorted);
+    for (const auto& item : expected) {
+        auto it = map.find(item.first);
+        ASSERT_TRUE(it != map.end()) << "key " << item.first;
+        EXPECT_EQ(it->second, item.second);
+    }
+}
+
+template<class Map>
+class DifferentialTest : public ::testing::Test {};
+
+using DifferentialTypes = ::testing::Types<
+    PolicyHashMap<DefaultHashMapPolicy>,
+    PolicyHashMap<MixedHashMapPolicy>,
+    PolicyHashMap<BackwardShiftHashMapPolicy>,
+    PolicyHashMap<IncrementalHashMapPolicy>,
+    PolicyHashMap<RobinHoodHashMapPolicy>,
+    PolicyHashMap<CompactHashMapPolicy>,
+    PolicyHashMap<HashedHashMapPolicy>,
+    PolicyHashMap<InstrumentedHashMapPolicy>,
+    SmallHashMap<int, std::string>,
+    OrderedHashMap<int, std::string>,
+    NodeHashMap<int, std::string>,
+    SwissHashMap<int, std::string>>;
+TYPED_TEST_SUITE(DifferentialTest, DifferentialTypes);
+
+// Random inserts, assignments and erases over a small key range, so keys
+// are often found, erased and inserted again and tables grow, shrink
+// and purge deleted elements.
+TYPED_TEST(DifferentialTest, MatchesUnorderedMap) {
+    std::mt19937 random(42);
+    TypeParam map;
+    std::unordered_map<int, std::string> expected;
+    for (int step = 0; step < 40000; ++step) {
+        // Key range changes over time, so the tables also shrink.
+        int range = step < 20000 ? 2000 : 50;
+        int key = int(random() % range);
+        std::string value = std::to_string(random());
+        switch (random() % 8) {
+        case 0: {
+            bool inserted = map.insert({key, value}).second;
+            EXPECT_EQ(inserted, expected.insert({key, value}).second);
+            break;
+        }
+        case 1: {
+            bool inserted = map.try_emplace(key, value).second;
+            EXPECT_EQ(inserted, expected.try_emplace(key, value).second);
+            break;
+        }
+        case 2: {
+            bool inserted = map.insert_or_assign(key, value).second;
+            EXPECT_EQ(inserted,
+                expected.insert_or_assign(key, value).second);
+            break;
+        }
+        case 3:
+            map[key] = value;
+            expected[key] = value;
+            break;
+        case 4: {
+            auto it = map.find(key);
+            auto expected_it = expected.find(key);
+            ASSERT_EQ(it == map.end(), expected_it == expected.end());
+            if (it != map.end()) {
+                EXPECT_EQ(it->second, expected_it->second);
+            }
+            break;
+        }
+        default:
+            EXPECT_EQ(map.erase(key), expected.erase(key));
+            break;
+        }
+        ASSERT_EQ(map.size(), expected.size());
+        if (step % 5000 == 0) {
+            expect_same(map, expected);
+        }
+        if (step == 30000) {
+            map.clear();
+            expected.clear();
+        }
+    }
+    expect_same(map, expected);
+
+    TypeParam copy(map);
+    expect_same(copy, expected);
+    TypeParam assigned;
+    assigned[-1] = "overwritten";
+    assigned = copy;
+    expect_same(assigned, expected);
+}
+
+// A moved-from table is empty and works as a new one.
+TYPED_TEST(DifferentialTest, MovedFromTableIsEmptyAndUsable) {
+    TypeParam map;
+    std::unordered_map<int, std::string> expected;
+    for (int i = 0; i < 100; ++i) {
+        map[i] = std::to_string(i);
+        expected[i] = std::to_string(i);
+    }
+    TypeParam moved(std::move(map));
+    expect_same(moved, expected);
+    EXPECT_EQ(map.size(), 0u);
+    EXPECT_TRUE(map.begin() == map.end());
+    EXPECT_TRUE(map.find(1) == map.end());
+    EXPECT_EQ(map.erase(1), 0u);
+
+    TypeParam copy(map);
+    EXPECT_EQ(copy.size(), 0u);
+    for (int i = 0; i < 1000; ++i) {
+        map[i] = "again";
+    }
+    EXPECT_EQ(map.size(), 1000u);
+
+    TypeParam target;
+    target[7] = "seven";
+    target = std::move(moved);
+    expect_same(target, expected);
+    EXPECT_EQ(moved.size(), 0u);
+    moved.insert({1, "one"});
+    EXPECT_EQ(moved.size(), 1u);
+}
+
+// Hash and comparator of strings ignoring letter case.
+struct CaseInsensitiveHash {
+    size_t operator()(const std::string& key) const {
+        size_t res = 0;
+        for (char c : key) {
+            res = res * 31 + size_t(std::tolower(c));
+        }
+        return res;
+    }
+};
+
+struct CaseInsensitiveEqual {
+    bool operator()(const std::string& a, const std::string& b) const {
+        return a.size() == b.size() && std::equal(a.begin(), a.end(),
+            b.begin(), [](char x, char y) {
+                return std::tolower(x) == std::tolower(y);
+            });
+    }
+};
+
+template<class Map>
+class KeyEqualTest : public ::testing::Test {};
+
+using KeyEqualTypes = ::testing::Types<
+    HashMap<std::string, int, CaseInsensitiveHash, CaseInsensitiveEqual>,
+    OrderedHashMap<std::string, int, CaseInsensitiveHash,
+        CaseInsensitiveEqual>,
+    NodeHashMap<std::string, int, CaseInsensitiveHash, CaseInsensitiveEqual>,
+    SwissHashMap<std::string, int, CaseInsensitiveHash,
+        CaseInsensitiveEqual>>;
+TYPED_TEST_SUITE(KeyEqualTest, KeyEqualTypes);
+
+// Every table compares keys with its comparator, so tables with a custom
+// one can be swapped for each other.
+TYPED_TEST(KeyEqualTest, UsesComparator) {
+    TypeParam map;
+    for (int i = 0; i < 100; ++i) {
+        map["Key" + std::to_string(i)] = i;
+    }
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_FALSE(map.insert({"KEY" + std::to_string(i), -1}).second);
+        EXPECT_EQ(map.at("key" + std::to_string(i)), i);
+    }
+    EXPECT_EQ(map.size(), 100u);
+    EXPECT_EQ(map.erase("kEy7"), 1u);
+    EXPECT_TRUE(map.find("Key7") == map.end());
+}
+
+// Iteration skips groups without elements and finds elements at both
+// ends of a group.
+TEST(SwissHashMapTest, IteratesSparseTable) {
+    SwissHashMap<int, std::string> map(4096);
+    std::unordered_map<int, std::string> expected;
+    for (int i = 0; i < 2000; ++i) {
+        map[i] = std::to_string(i);
+    }
+    for (int i = 0; i < 2000; ++i) {
+        if (i % 97 != 0) {
+            map.erase(i);
+        } else {
+            expected[i] = std::to_string(i);
+        }
+    }
+    EXPECT_EQ(map.bucket_count(), 4096u);
+    expect_same(map, expected);
+}
+
+// A table moved to one with another arena moves its elements one by one
+// into memory of that arena.
+TEST(SwissHashMapTest, MoveAssignmentBetweenArenas) {
+    using map_type = SwissHashMap<int, std::string, std::hash<int>,
+        std::equal_to<int>, ArenaAllocator<std::pair<const int, std::string>>>;
+    HashMapArena first, second;
+    map_type source(std::hash<int>(), std::equal_to<int>(), first);
+    map_type target(std::hash<int>(), std::equal_to<int>(), second);
+    std::unordered_map<int, std::string> expected;
+    for (int i = 0; i < 100; ++i) {
+        source[i] = std::to_string(i);
+        expected[i] = std::to_string(i);
+    }
+    target[-1] = "old";
+    target = std::move(source);
+    expect_same(target, expected);
+    EXPECT_TRUE(target.get_allocator() == map_type::allocator_type(second));
+    EXPECT_EQ(source.size(), 0u);
+    map_type copy(target);
+    expect_same(copy, expected);
+}
+
+static_assert(std::is_nothrow_move_constructible<
+    HashMap<int, std::string>>::value, "HashMap moves can't throw");
+static_assert(std::is_nothrow_move_assignable<
+    HashMap<int, std::string>>::value, "HashMap moves can't throw");
+static_assert(std::is_nothrow_move_constructible<
+    SmallHashMap<int, std::string>>::value,
+    "SmallHashMap moves can't throw");
+static_assert(std::is_nothrow_move_assignable<
+    SmallHashMap<int, std::string>>::value,
+    "SmallHashMap moves can't throw");
+static_assert(std::is_nothrow_move_constructible<
+    OrderedHashMap<int, std::string>>::value,
+    "OrderedHashMap moves can't throw");
+static_assert(std::is_nothrow_move_constructible<
+    NodeHashMap<int, std::string>>::value,
+    "NodeHashMap moves can't throw");
+static_assert(std::is_nothrow_move_constructible<
+    SwissHashMap<int, std::string>>::value,
+    "SwissHashMap moves can't throw");
+
+// Number of constructions of fragile values left before one throws,
+// -1 means they never throw.
+int fragile_countdown = -1;
+// Number of fragile values constructed and not destroyed yet.
+int fragile_live = 0;
+
+// Counts down a construction of a fragile value.
+void fragile_tick() {
+    if (fragile_countdown >= 0 && fragile_countdown-- == 0) {
+        throw std::runtime_error("fragile");
+    }
+}
+
+// Value whose constructors throw once the countdown runs out. Its move
+// throws too unless nothrow_move is set, policies that shift elements
+// only take values with noexcept moves.
+template<bool nothrow_move>
+struct BasicFragile {
+    std::string value;
+
+    BasicFragile(const char* value_) : value(value_) {
+        fragile_tick();
+        ++fragile_live;
+    }
+
+    BasicFragile(const BasicFragile& oth) : value(oth.value) {
+        fragile_tick();
+        ++fragile_live;
+    }
+
+    BasicFragile(BasicFragile&& oth) noexcept(nothrow_move) :
+        value(std::move(oth.value)) {
+        if (!nothrow_move) {
+            fragile_tick();
+        }
+        ++fragile_live;
+    }
+
+    BasicFragile& operator=(const BasicFragile&) = default;
+
+    ~BasicFragile() {
+        --fragile_live;
+    }
+};
+
+using Fragile = BasicFragile<false>;
+using MovableFragile = BasicFragile<true>;
+
+// Returns the elements of a table of Fragile values sorted by keys.
+template<class Map>
+std::map<int, std::string> fragile_contents(const Map& map) {
+    std::map<int, std::string> res;
+    for (const auto& item : map) {
+        res.emplace(item.first, item.second.value);
+    }
+    return res;
+}
+
+template<class Policy, class Value = Fragile>
+using FragileHashMap = HashMap<int, Value, std::hash<int>,
+    std::equal_to<int>, std::allocator<std::pair<const int, Value>>,
+    Policy>;
+
+template<class Map>
+class ThrowingElementTest : public ::testing::Test {};
+
+using ThrowingElementTypes = ::testing::Types<
+    FragileHashMap<DefaultHashMapPolicy>,
+    FragileHashMap<HashedHashMapPolicy>,
+    FragileHashMap<BackwardShiftHashMapPolicy, MovableFragile>,
+    FragileHashMap<IncrementalHashMapPolicy, MovableFragile>,
+    FragileHashMap<RobinHoodHashMapPolicy, MovableFragile>,
+    SmallHashMap<int, Fragile>,
+    OrderedHashMap<int, Fragile>,
+    NodeHashMap<int, Fragile>,
+    SwissHashMap<int, Fragile>>;
+TYPED_TEST_SUITE(ThrowingElementTest, ThrowingElementTypes);
+
+// An element whose constructor throws isn't added and the slot claimed
+// for it is given up, so the table stays as it was and usable.
+TYPED_TEST(ThrowingElementTest, FailedInsertLeavesTableUnchanged) {
+    TypeParam map;
+    map.reserve(64);
+    for (int i = 0; i < 6; ++i) {
+        map.try_emplace(i, "old");
+    }
+    auto before = fragile_contents(map);
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        fragile_countdown = 0;
+        EXPECT_THROW(map.try_emplace(100 + attempt, "new"),
+            std::runtime_error);
+        fragile_countdown = -1;
+        ASSERT_EQ(map.size(), before.size());
+        EXPECT_TRUE(map.find(100 + attempt) == map.end());
+    }
+    EXPECT_EQ(fragile_contents(map), before);
+    map.try_emplace(100, "new");
+    EXPECT_EQ(map.size(), before.size() + 1);
+    EXPECT_EQ(map.erase(100), 1u);
+    EXPECT_EQ(fragile_contents(map), before);
+}
+
+// Tables copy elements into a new buffer when their moves may throw
+// and put the new element only into a complete one, so a failed insert
+// keeps the table as it was whichever construction throws, also when
+// it grows the table.
+TYPED_TEST(ThrowingElementTest, FailedGrowthLeavesTableUnchanged) {
+    for (int fail_at = 0; fail_at < 40; fail_at += 3) {
+        TypeParam map;
+        std::map<int, std::string> expected;
+        int key = 0;
+        bool thrown = false;
+        while (!thrown && key < 1000) {
+            auto before = fragile_contents(map);
+            fragile_countdown = fail_at;
+            try {
+                map.try_emplace(key, "value");
+                expected.emplace(key, "value");
+            } catch (const std::runtime_error&) {
+                thrown = true;
+                fragile_countdown = -1;
+                EXPECT_EQ(fragile_contents(map), before);
+            }
+            fragile_countdown = -1;
+            ++key;
+        }
+        EXPECT_EQ(fragile_contents(map), expected);
+    }
+}
+
+template<class Map>
+class ThrowingCopyTest : public ::testing::Test {};
+
+using ThrowingCopyTypes = ::testing::Types<
+    FragileHashMap<DefaultHashMapPolicy>,
+    FragileHashMap<HashedHashMapPolicy>,
+    FragileHashMap<IncrementalHashMapPolicy, MovableFragile>,
+    FragileHashMap<RobinHoodHashMapPolicy, MovableFragile>,
+    SmallHashMap<int, MovableFragile>,
+    SmallHashMap<int, MovableFragile, 64>,
+    OrderedHashMap<int, Fragile>,
+    SwissHashMap<int, Fragile>>;
+TYPED_TEST_SUITE(ThrowingCopyTest, ThrowingCopyTypes);
+
+// Copy assignment copies into a temporary first, so if that throws
+// the target keeps its elements.
+TYPED_TEST(ThrowingCopyTest, FailedCopyAssignmentLeavesTableUnchanged) {
+    TypeParam source;
+    TypeParam target;
+    for (int i = 0; i < 50; ++i) {
+        source.try_emplace(i, "source");
+        target.try_emplace(-i, "target");
+    }
+    auto before = fragile_contents(target);
+    for (int fail_at = 0; fail_at < 50; fail_at += 7) {
+        fragile_countdown = fail_at;
+        EXPECT_THROW(target = source, std::runtime_error);
+        fragile_countdown = -1;
+        EXPECT_EQ(fragile_contents(target), before);
+    }
+    target = source;
+    EXPECT_EQ(fragile_contents(target), fragile_contents(source));
+}
+
+// A copy that throws halfway destroys the elements copied before.
+TYPED_TEST(ThrowingCopyTest, FailedCopyConstructionDestroysCopies) {
+    TypeParam source;
+    for (int i = 0; i < 50; ++i) {
+        source.try_emplace(i, "source");
+    }
+    int live = fragile_live;
+    for (int fail_at = 0; fail_at < 50; fail_at += 7) {
+        fragile_countdown = fail_at;
+        EXPECT_THROW({ TypeParam copy(source); }, std::runtime_error);
+        fragile_countdown = -1;
+        EXPECT_EQ(fragile_live, live);
+    }
+}
+
+// Number of allocations made by counting allocators.
+int allocations = 0;
+
+// Allocator counting its allocations.
+template<class T>
+struct CountingAllocator : std::allocator<T> {
+    template<class U>
+    struct rebind {
+        using other = CountingAllocator<U>;
+    };
+
+    CountingAllocator() = default;
+
+    template<class U>
+    CountingAllocator(const CountingAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        ++allocations;
+        return std::allocator<T>::allocate(n);
+    }
+};
+
+// A copy allocates only the buffers it fills, so a copy of a moved-from
+// table allocates nothing.
+TEST(OrderedHashMapTest, CopyAllocatesOnlyItsBuffers) {
+    using map_type = OrderedHashMap<int, int, std::hash<int>,
+        std::equal_to<int>, CountingAllocator<std::pair<const int, int>>>;
+    map_type map;
+    for (int i = 0; i < 100; ++i) {
+        map[i] = i;
+    }
+    allocations = 0;
+    map_type copy(map);
+    EXPECT_EQ(allocations, 3);
+    EXPECT_EQ(copy.size(), 100u);
+    map_type moved(std::move(map));
+    allocations = 0;
+    map_type empty(map);
+    EXPECT_EQ(allocations, 0);
+    EXPECT_EQ(empty.size(), 0u);
+}
+
+// Number of allocations of failing allocators left before one throws,
+// -1 means they never throw.
+int allocation_countdown = -1;
+// Number of blocks taken from failing allocators and not freed yet.
+int allocated_blocks = 0;
+
+// Allocator throwing std::bad_alloc once the countdown runs out.
+template<class T>
+struct FailingAllocator : std::allocator<T> {
+    template<class U>
+    struct rebind {
+        using other = FailingAllocator<U>;
+    };
+
+    FailingAllocator() = default;
+
+    template<class U>
+    FailingAllocator(const FailingAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        if (allocation_countdown >= 0 && allocation_countdown-- == 0) {
+            throw std::bad_alloc();
+        }
+        ++allocated_blocks;
+        return std::allocator<T>::allocate(n);
+    }
+
+    void deallocate(T* ptr, size_t n) {
+        --allocated_blocks;
+        std::allocator<T>::deallocate(ptr, n);
+    }
+};
+
+template<class Map>
+class FailingAllocatorTest : public ::testing::Test {};
+
+using FailingAllocatorTypes = ::testing::Types<
+    HashMap<int, std::string, std::hash<int>, std::equal_to<int>,
+        FailingAllocator<std::pair<const int, std::string>>>,
+    HashMap<int, int, std::hash<int>, std::equal_to<int>,
+        FailingAllocator<std::pair<const int, int>>>>;
+TYPED_TEST_SUITE(FailingAllocatorTest, FailingAllocatorTypes);
+
+// Whichever allocation of a growing table fails, the table keeps its
+// elements and frees everything it allocated.
+TYPED_TEST(FailingAllocatorTest, FailedAllocationLeavesTableUnchanged) {
+    // Growing takes three blocks: the slots and two bitmaps or
+    // the states and a bitmap.
+    for (int fail_at = 0; fail_at < 3; ++fail_at) {
+        {
+            TypeParam map;
+            int key = 0;
+            bool thrown = false;
+            while (!thrown && key < 1000) {
+                allocation_countdown = fail_at;
+                try {
+                    map[key];
+                    ++key;
+                } catch (const std::bad_alloc&) {
+                    thrown = true;
+                }
+                allocation_countdown = -1;
+            }
+            EXPECT_TRUE(thrown);
+            ASSERT_EQ(map.size(), size_t(key));
+            for (int i = 0; i < key; ++i) {
+                EXPECT_TRUE(map.find(i) != map.end());
+            }
+        }
+        EXPECT_EQ(allocated_blocks, 0);
+    }
+}
+
+// Erase shrinks a node table only if it can allocate the new slots,
+// so it doesn't throw once the element is erased.
+TEST(NodeHashMapTest, EraseDoesNotThrowWhenShrinkingFails) {
+    {
+        NodeHashMap<int, int, std::hash<int>, std::equal_to<int>,
+            FailingAllocator<std::pair<const int, int>>> map;
+        for (int i = 0; i < 1000; ++i) {
+            map[i] = i;
+        }
+        size_t buckets = map.bucket_count();
+        for (int i = 0; i < 990; ++i) {
+            allocation_countdown = 0;
+            EXPECT_NO_THROW(EXPECT_EQ(map.erase(i), 1u));
+        }
+        allocation_countdown = -1;
+        EXPECT_EQ(map.bucket_count(), buckets);
+        ASSERT_EQ(map.size(), 10u);
+        for (int i = 990; i < 1000; ++i) {
+            EXPECT_EQ(map.at(i), i);
+        }
+        map.erase(990);
+        EXPECT_LT(map.bucket_count(), buckets);
+    }
+    EXPECT_EQ(allocated_blocks, 0);
+}
+
+// Hash function that throws once the countdown runs out.
+struct FragileHash {
+    static int countdown;
+
+    size_t operator()(const std::string& key) const {
+        if (countdown >= 0 && countdown-- == 0) {
+            throw std::runtime_error("hash");
+        }
+        return std::hash<std::string>()(key);
+    }
+};
+
+int FragileHash::countdown = -1;
+
+// Inline elements are copied to the heap table while hashing may throw,
+// so if it does they are all still there, whether it throws while they
+// are moved or when the new key is inserted into the heap table.
+TEST(SmallHashMapTest, FailedMoveToHeapKeepsInlineElements) {
+    for (int fail_at = 0; fail_at < 6; ++fail_at) {
+        SmallHashMap<std::string, std::string, 4, FragileHash> map;
+        for (int i = 0; i < 4; ++i) {
+            map[std::string(32, char('a' + i))] = std::string(32, 'v');
+        }
+        FragileHash::countdown = fail_at;
+        try {
+            map[std::string(32, 'z')] = "new";
+        } catch (const std::runtime_error&) {
+            EXPECT_TRUE(map.find(std::string(32, 'z')) == map.end());
+        }
+        FragileHash::countdown = -1;
+        for (int i = 0; i < 4; ++i) {
+            EXPECT_EQ(map.at(std::string(32, char('a' + i))),
+                std::string(32, 'v'));
+        }
+    }
+}
+
+// The heap table isn't kept beside the inline slots.
+static_assert(sizeof(SmallHashMap<int, int>) <=
+    8 * sizeof(std::pair<int, int>) + 4 * sizeof(size_t),
+    "a small table costs its inline slots");
+
+// A table moves from inline slots to the heap and back, also into
+// a table with another arena, which gets its own heap table.
+TEST(SmallHashMapTest, MovesBetweenInlineAndHeap) {
+    using map_type = SmallHashMap<int, std::string, 4, std::hash<int>,
+        std::equal_to<int>, ArenaAllocator<std::pair<const int, std::string>>>;
+    HashMapArena first, second;
+    map_type source(std::hash<int>(), std::equal_to<int>(), first);
+    std::unordered_map<int, std::string> expected;
+    for (int i = 0; i < 100; ++i) {
+        source[i] = std::to_string(i);
+        expected[i] = std::to_string(i);
+    }
+    EXPECT_TRUE(source.is_on_heap());
+    map_type copy(source);
+    expect_same(copy, expected);
+    map_type target(std::hash<int>(), std::equal_to<int>(), second);
+    target[-1] = "old";
+    target = std::move(source);
+    expect_same(target, expected);
+    EXPECT_EQ(source.size(), 0u);
+    EXPECT_FALSE(source.is_on_heap());
+    source[1] = "one";
+    EXPECT_EQ(source.at(1), "one");
+    target.clear();
+    EXPECT_FALSE(target.is_on_heap());
+    target = copy;
+    expect_same(target, expected);
+}
+
+// Small trivially copyable elements keep slot states in bytes beside
+// the slots instead of bitmaps.
+TEST(HashMapTest, ByteStatesMatchUnorderedMap) {
+    static_assert(HashMapByteStates<uint64_t, uint32_t>::value,
+        "small elements keep states in bytes");
+    std::mt19937 random(7);
+    HashMap<uint64_t, uint32_t> map;
+    std::unordered_map<uint64_t, uint32_t> expected;
+    for (int step = 0; step < 40000; ++step) {
+        uint64_t key = random() % (step < 20000 ? 3000 : 100);
+        uint32_t value = uint32_t(random());
+        if (random() % 3 == 0) {
+            EXPECT_EQ(map.erase(key), expected.erase(key));
+        } else {
+            map[key] = value;
+            expected[key] = value;
+        }
+        ASSERT_EQ(map.size(), expected.size());
+    }
+    HashMap<uint64_t, uint32_t> copy(map);
+    for (const auto* table : { &map, &copy }) {
+        size_t count = 0;
+        for (const auto& item : *table) {
+            EXPECT_EQ(expected.at(item.first), item.second);
+            ++count;
+        }
+        EXPECT_EQ(count, expected.size());
+    }
+}
+
+// Number of counted values constructed from other ones so far.
+int constructions = 0;
+
+// Value that counts its copies and moves.
+struct Counted {
+    int value = 0;
+
+    Counted() = default;
+
+    Counted(const Counted& oth) : value(oth.value) {
+        ++constructions;
+    }
+
+    Counted(Counted&& oth) noexcept : value(oth.value) {
+        ++constructions;
+    }
+
+    Counted& operator=(const Counted&) = default;
+};
+
+// A copy of a table constructs each element once, also the ones of
+// the buffer being migrated.
+TEST(HashMapTest, CopyConstructsEachElementOnce) {
+    HashMap<int, Counted, std::hash<int>, std::equal_to<int>,
+        std::allocator<std::pair<const int, Counted>>,
+        IncrementalHashMapPolicy> map;
+    for (int i = 0; i < 2000; ++i) {
+        map[i].value = i;
+        constructions = 0;
+        auto copy = map;
+        ASSERT_EQ(constructions, i + 1) << "size " << map.size();
+        EXPECT_EQ(copy.at(i).value, i);
+    }
+}
+
+// Sizes of a snapshot header are checked before offsets are computed
+// from them, so a crafted header can't make them wrap around.
+TEST(HashMapTest, SnapshotHeaderOfHugeBufferDoesNotFit) {
+    HashMapSnapshotHeader header = {};
+    header.slot_size = 16;
+    header.buffer_size = 1024;
+    EXPECT_TRUE(header.fits());
+    EXPECT_EQ(header.file_size(), 64 + 1024 * 16 + 2 * 8 * 16u);
+    header.buffer_size = std::numeric_limits<size_t>::max() / 16 + 1;
+    EXPECT_FALSE(header.fits());
+    header.buffer_size = std::numeric_limits<size_t>::max() / 17;
+    EXPECT_FALSE(header.fits());
+    header.buffer_size = 1;
+    header.slot_size = std::numeric_limits<uint64_t>::max();
+    EXPECT_FALSE(header.fits());
+}
+
+template<class Map>
+class VectorOfTablesTest : public ::testing::Test {};
+
+using VectorOfTablesTypes = ::testing::Types<
+    HashMap<int, std::string>,
+    SmallHashMap<int, std::string, 1>>;
+TYPED_TEST_SUITE(VectorOfTablesTest, VectorOfTablesTypes);
+
+// Growing a vector of tables moves them, since their moves can't throw.
+TYPED_TEST(VectorOfTablesTest, MovesThemOnGrowth) {
+    std::vector<TypeParam> tables;
+    for (int i = 0; i < 100; ++i) {
+        tables.emplace_back();
+        tables.back()[i] = std::to_string(i);
+        tables.back()[-i - 1] = std::to_string(i);
+    }
+    const std::string* value = &tables[0][0];
+    tables.reserve(tables.capacity() * 2);
+    EXPECT_EQ(value, &tables[0][0]);
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_EQ(tables[i].at(i), std::to_string(i));
+    }
+}
+
+// Large tables are rebuilt by several threads.
+TEST(HashMapTest, ParallelRebuildKeepsElements) {
+    PolicyHashMap<ParallelHashMapPolicy> map;
+    for (int i = 0; i < 200000; ++i) {
+        map[i] = std::to_string(i);
+    }
+    map.rehash(map.bucket_count() * 4);
+    map.shrink_to_fit();
+    ASSERT_EQ(map.size(), 200000u);
+    for (int i = 0; i < 200000; ++i) {
+        ASSERT_EQ(map.at(i), std::to_string(i));
+    }
+}
+
+// Batched lookups and inserts find the same elements as single ones,
+// also while a table grows incrementally.
+TEST(HashMapTest, BatchedOperationsMatchSingleOnes) {
+    PolicyHashMap<IncrementalHashMapPolicy> map;
+    std::vector<std::pair<int, std::string>> items;
+    for (int i = 0; i < 5000; ++i) {
+        items.emplace_back(i * 7, std::to_string(i));
+    }
+    for (size_t i = 0; i < items.size(); i += 100) {
+        EXPECT_EQ(map.insert_batch(items.begin() + i,
+            items.begin() + i + 100), 100u);
+    }
+    std::vector<int> keys;
+    for (int i = 0; i < 40000; ++i) {
+        keys.push_back(i);
+    }
+    std::vector<PolicyHashMap<IncrementalHashMapPolicy>::iterator> found;
+    map.find_batch(keys.begin(), keys.end(), std::back_inserter(found));
+    for (int i = 0; i < 40000; ++i) {
+        EXPECT_EQ(found[i] == map.end(), i % 7 != 0 || i >= 35000);
+    }
+}
+
+// Adding partitions moves only keys of the new arcs and doesn't move
+// the partitions themselves.
+TEST(PartitionedHashMapTest, AddPartitionKeepsElementsAndPartitions) {
+    PartitionedHashMap<int, int> map(3);
+    for (int i = 0; i < 10000; ++i) {
+        map.insert({i, i});
+    }
+    const auto& first = map.partition(0);
+    for (int i = 0; i < 5; ++i) {
+        map.add_partition();
+    }
+    EXPECT_EQ(&first, &map.partition(0));
+    EXPECT_EQ(map.partition_count(), 8u);
+    EXPECT_EQ(map.size(), 10000u);
+    for (int i = 0; i < 10000; ++i) {
+        EXPECT_EQ(map.at(i), i);
+    }
+}
+
+// Threads insert, look up and erase their own keys concurrently.
+TEST(ConcurrentHashMapTest, ConcurrentWritersAndReaders) {
+    ConcurrentHashMap<int, int> map(8);
+    constexpr int threads = 4;
+    constexpr int per_thread = 20000;
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&map, t]() {
+            for (int i = t * per_thread; i < (t + 1) * per_thread; ++i) {
+                map.insert({i, i});
+                map.find(i - 1, [](const int&) {});
+                if (i % 3 == 0) {
+                    map.erase(i);
+                }
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    size_t expected = 0;
+    for (int i = 0; i < threads * per_thread; ++i) {
+        EXPECT_EQ(map.contains(i), i % 3 != 0);
+        expected += i % 3 != 0;
+    }
+    EXPECT_EQ(map.size(), expected);
+}
+
+// Readers see either the table before a write or after it, never
+// a partial one, and keys once inserted stay.
+TEST(ReadMostlyHashMapTest, ReadersDuringWrites) {
+    ReadMostlyHashMap<int, int> map;
+    constexpr int count = 2000;
+    std::atomic<bool> done(false);
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 3; ++t) {
+        readers.emplace_back([&map, &done]() {
+            while (!done.load()) {
+                map.read([](const ReadMostlyHashMap<int, int>::map_type&
+                    table) {
+                    for (const auto& item : table) {
+                        ASSERT_EQ(item.first, item.second);
+                    }
+                });
+                size_t size = map.size();
+                for (size_t i = 0; i < size; ++i) {
+                    ASSERT_TRUE(map.contains(int(i)));
+                }
+            }
+        });
+    }
+    for (int i = 0; i < count; ++i) {
+        map.insert({i, i});
+    }
+    done.store(true);
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    EXPECT_EQ(map.size(), size_t(count));
+}
+
+}  // namespace